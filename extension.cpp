@@ -34,35 +34,54 @@
 *********************************************************************************************************/
 
 #include <dlfcn.h>	/* We may use libtool's <ltdl.h> later for better portability.... */
+#include <link.h>
 #include <libgen.h>	/* for "basename" */
 #include <cstring>
 #include <cerrno>
+#include <cstdlib>
+#include <stdint.h>
 #include <list>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "cch_port.h"
 #include "diameter_base.h"
 #include "dau_common_def.h"
-#include "extension.h"
+#include "extension_internal.h"
 #include "dict.h"
 
 /* plugins management */
 
-/* List of extensions to load, from the configuration parsing */
-struct fd_ext_info {
-	char 		*filename;	/* extension filename. must be a dynamic library with fd_ext_init symbol. */
-	char 		*conffile;	/* optional configuration file name for the extension */
-	void 		*handler;	/* object returned by dlopen() */
-	const char 	**depends;	/* names of the other extensions this one depends on (if provided) */
-	char		*ext_name;	/* points to the extension name, either inside depends, or basename(filename) */
-	int		free_ext_name;	/* must be freed if it was malloc'd */
-	void		(*fini)(void);	/* optional address of the fd_ext_fini callback */
-};
-
 /* list of extensions */
-static std::list<struct fd_ext_info*> ext_list;
+std::list<struct fd_ext_info*> ext_list;
+/* held to change ext_list or the names of its entries, and by the readers which may run at any time (statistics, limits, threads) */
+std::mutex ext_list_lock;
+
+/* number of threads running fd_ext_init concurrently, 0 means one per CPU */
+static unsigned ext_load_threads = 0;
+
+/* critical path of the last fd_ext_load, see fd_ext_critical_path */
+static std::string ext_load_report;
+
+/* deadline of each fd_ext_fini in fd_ext_term, 0 for none, and the times of the last one, see fd_ext_fini_report */
+static unsigned ext_fini_timeout_ms = 10000;
+static std::string ext_term_report;
+
+/* an extension was abandoned in fd_ext_fini and may still use the services: they run until the process exits */
+static int ext_services_left = 0;
+
+/* serializes fd_ext_reload */
+static std::mutex ext_reload_lock;
 
 /* Add new extension */
 int fd_ext_add( const char * filename, const char * conffile )
@@ -74,57 +93,78 @@ int fd_ext_add( const char * filename, const char * conffile )
 	/* Check the filename is valid */
 	if (NULL == filename || NULL == conffile)
 		return -1;
+	if (ext_list.size() >= EXT_MAX)
+		return -4;
 	
 	/* Create a new object in the list */
-	newExt = new(struct fd_ext_info);
+	newExt = new(struct fd_ext_info)();
 	if (NULL == newExt)
 		return -2;
-	memset(newExt, 0, sizeof(struct fd_ext_info));
 	newExt->filename = strndup(filename, 128);
 	newExt->conffile = strndup(conffile, 128);
-	if (NULL == newExt->filename || NULL == newExt->conffile)
+	if (NULL == newExt->filename || NULL == newExt->conffile) {
+		free(newExt->filename);
+		free(newExt->conffile);
+		delete newExt;
 		return -3;
+	}
+	std::lock_guard<std::mutex> lock(ext_list_lock);
+	newExt->idx = ext_list.size();
 	ext_list.push_back(newExt);
+	ext_stats_clear(newExt->idx);
 	//TRACE_DEBUG (FULL, "Extension %s added to the list.", filename);
 	return 0;
 }
 
-/* Check the dependencies. The object must have been dlopened already. */
-static int check_dependencies(struct fd_ext_info * ext)
+/* Check the dependencies of an extension without a manifest. The object must have been dlopened already. */
+static int check_dependencies(struct fd_ext_info * ext, struct fd_ext_inst * inst)
 {
 	int i = 1;
 	
-	/* Attempt to resolve the dependency array */
-	*((void**)&ext->depends) = dlsym( ext->handler, "fd_ext_depends" );
-	if (!ext->depends) {
+	/* Attempt to resolve the dependency array, it is in the descriptor of an extension linked in */
+	if (inst->handler)
+		*((void**)&inst->depends) = dlsym( inst->handler, "fd_ext_depends" );
+
+	/* The graph was built from the manifests, before any extension was opened */
+	if (ext->manifest)
+		return 0;
+
+	/* The name from the configuration, of an extension loaded on demand */
+	if (ext->free_ext_name) {
+		free(ext->ext_name);
+		ext->ext_name = NULL;
+		ext->free_ext_name = 0;
+	}
+
+	if (!inst->depends) {
 		/* Duplicate the filename */
 		char * tmp = strdup(ext->filename);
+		if (tmp == NULL)
+			return ENOMEM;
 		ext->ext_name = strdup(basename(tmp));
-		delete(tmp);
+		free(tmp);
+		if (ext->ext_name == NULL)
+			return ENOMEM;
 		ext->free_ext_name = 1;
 		//TRACE_DEBUG(FULL, "Old extension's [%s] API: missing dependencies (ignored)", ext->ext_name);
 		return 0;
 	}
 	
-	ext->ext_name = (char *)ext->depends[0];
+	ext->ext_name = (char *)inst->depends[0];
 	
 	//TRACE_DEBUG(FULL, "Checking dependencies for '%s'...", ext->ext_name);
 	
-	while (ext->depends[i]) {
-		std::list<struct fd_ext_info*>::const_iterator li;
-		for (li = ext_list.begin(); li != ext_list.end() && *li != ext; ++li)
-		{
-			struct fd_ext_info * e = *li;
-			if (!strcasecmp(e->ext_name, ext->depends[i])) {
-				/* the dependency was already loaded */
-				break;
-			}
-		}
-		
-		if (*li == ext) {
+	while (inst->depends[i]) {
+		/* the extensions before this one in the configuration are indexed by name */
+		struct fd_ext_info * e = ext_index_find(inst->depends[i]);
+		if (e != NULL && e != ext) {
+			/* the dependency was already loaded, record the edge */
+			ext->deps.push_back(e);
+			e->dependents.push_back(ext);
+		} else {
 			/* the dependency was not found */
 			//LOG_F("Error: extension [%s] depends on [%s] which was not loaded first. Please fix your configuration file.",
-			//	ext->ext_name, ext->depends[i]);
+			//	ext->ext_name, inst->depends[i]);
 			return ESRCH;
 		}
 		
@@ -135,170 +175,1132 @@ static int check_dependencies(struct fd_ext_info * ext)
 	return 0;
 }
 
-/* Load all extensions in the list */
-int fd_ext_load()
+struct ext_text_lookup {
+	struct link_map		*lm;
+	struct fd_ext_inst	*inst;
+};
+
+/* Record the executable segments of the object of the copy */
+static int ext_text_cb(struct dl_phdr_info * info, size_t size, void * data)
 {
-	int ret;
-	int (*fd_ext_init)(int, int, fd_ext_arg *) = NULL;
-	std::list<struct fd_ext_info*>::iterator li;
-	dictionary *pDictionary = dictionary::getInstance();
+	struct ext_text_lookup * l = (struct ext_text_lookup *)data;
+	struct fd_ext_inst * inst = l->inst;
+
+	(void)size;
+	if (info->dlpi_addr != l->lm->l_addr || strcmp(info->dlpi_name, l->lm->l_name))
+		return 0;
+	inst->base = info->dlpi_addr;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) * ph = &info->dlpi_phdr[i];
+		if (ph->p_type == PT_LOAD && (ph->p_flags & PF_X))
+			inst->text.push_back(std::make_pair(info->dlpi_addr + ph->p_vaddr, info->dlpi_addr + ph->p_vaddr + ph->p_memsz));
+	}
+	return 1;
+}
+
+/* Resolve the entry points of a dlopened copy of the extension */
+static int ext_resolve(struct fd_ext_inst * inst)
+{
+	/* Resolve the entry point of the extension */
+	inst->init = ( int (*) (int, int, fd_ext_arg *) )dlsym( inst->handler, "fd_ext_init" );
 	
-	/* Loop on all extensions */
-	for (li = ext_list.begin(); li != ext_list.end(); ++li)
+	if (inst->init == NULL) {
+		/* An error occured */
+		//TRACE_ERROR("Unable to resolve symbol 'fd_ext_init' for extension %s: %s", inst->ext->filename, dlerror());
+		return EINVAL;
+	}
+	
+	/* Resolve the exit point of the extension, which is optional for extensions */
+	inst->fini = ( void (*) (void) )dlsym( inst->handler, "fd_ext_fini" );
+	
+	if (inst->fini == NULL) {
+		/* Not provided */
+		//TRACE_DEBUG (FULL, "Extension [%s] has no fd_ext_fini function.", inst->ext->filename);
+	} else {
+		/* Provided */
+		//TRACE_DEBUG (FULL, "Extension [%s] fd_ext_fini has been resolved successfully.", inst->ext->filename);
+	}
+
+	/* The per-thread entry points are optional too, and go together */
+	inst->thread_init = ( int (*) (fd_ext_arg *, void *) )dlsym( inst->handler, "fd_ext_thread_init" );
+	inst->thread_fini = ( void (*) (fd_ext_arg *, void *) )dlsym( inst->handler, "fd_ext_thread_fini" );
+	if (inst->thread_fini != NULL && inst->thread_init == NULL) {
+		//TRACE_ERROR("Extension %s has fd_ext_thread_fini but no fd_ext_thread_init", inst->ext->filename);
+		return EINVAL;
+	}
+
+	/* The hooks of this one are called with batches of messages, when it provides it */
+	*((void**)&inst->batch) = dlsym( inst->handler, "fd_ext_hook_batch" );
+
+	/* Where its code lies, for the profiler and fd_ext_huge_text */
 	{
-		struct fd_ext_info * ext = *li;
-		//LOG_D( "Loading : %s", ext->filename);
-		
-		/* Load the extension */
+		struct ext_text_lookup l = { NULL, inst };
+		if (dlinfo(inst->handler, RTLD_DI_LINKMAP, &l.lm) == 0)
+			dl_iterate_phdr(ext_text_cb, &l);
+	}
+
+	return 0;
+}
+
+/* Open the extension, check its dependencies and resolve its entry points */
+static int ext_open(struct fd_ext_info * ext)
+{
+	uint64_t start = ext_now_ns();
+	struct fd_ext_inst * inst = new(struct fd_ext_inst)();
+
+	//LOG_D( "Loading : %s", ext->filename);
+	inst->ext = ext;
+
+	/* Not loaded in the daemon, its fd_ext_init starts the helper */
+	if (ext->oop) {
+		if (ext_oop_open(inst)) {
+			delete inst;
+			return EINVAL;
+		}
+		ext_index_add(ext);
+		ext->inst.store(inst, std::memory_order_release);
+		ext->open_ns = ext_now_ns() - start;
+		return 0;
+	}
+	
+	/* Linked into the daemon, nothing to load */
+	if (ext->stat) {
+		if (ext_static_open(inst) || check_dependencies(ext, inst)) {
+			delete inst;
+			return EINVAL;
+		}
+		ext_index_add(ext);
+		ext->inst.store(inst, std::memory_order_release);
+		ext->open_ns = ext_now_ns() - start;
+		return 0;
+	}
+
+	/* Load the extension */
 #ifndef DEBUG
-		ext->handler = dlopen(ext->filename, RTLD_LAZY | RTLD_GLOBAL);
+	inst->handler = dlopen(ext->filename, RTLD_LAZY | RTLD_GLOBAL);
 #else /* DEBUG */
-		/* We resolve symbols immediatly so it's easier to find problems in ABI */
-		ext->handler = dlopen(ext->filename, RTLD_NOW | RTLD_GLOBAL);
+	/* We resolve symbols immediatly so it's easier to find problems in ABI */
+	inst->handler = dlopen(ext->filename, RTLD_NOW | RTLD_GLOBAL);
 #endif /* DEBUG */
-		if (ext->handler == NULL) {
-			/* An error occured */
-			//LOG_F("Loading of extension %s failed: %s", ext->filename, dlerror());
-			ext->handler = dlopen(ext->filename, RTLD_LAZY | RTLD_GLOBAL);
-			if (ext->handler) {
-				if (check_dependencies(ext)) {
-					//LOG_F("In addition, not all declared dependencies are satisfied (Internal Error!)");
-				}
-				dlclose(ext->handler);
-				ext->handler = NULL;
+	if (inst->handler == NULL) {
+		/* An error occured, its dependencies were checked from the manifests already */
+		//LOG_F("Loading of extension %s failed: %s", ext->filename, dlerror());
+		delete inst;
+		return EINVAL;
+	}
+	
+	/* Check if declared dependencies are satisfied, then look for the entry points */
+	if (check_dependencies(ext, inst) || ext_resolve(inst)) {
+		dlclose(inst->handler);
+		delete inst;
+		return EINVAL;
+	}
+
+	ext_index_add(ext);
+	ext->inst.store(inst, std::memory_order_release);
+	ext->open_ns = ext_now_ns() - start;
+	return 0;
+}
+
+static void ext_ready(struct fd_ext_arg * self, int status);
+
+/* Call the entry point of the extension, may run concurrently for independent extensions; FD_EXT_PENDING is not an error */
+static int ext_call_init(struct fd_ext_inst * inst)
+{
+	int ret;
+	dictionary *pDictionary = dictionary::getInstance();
+
+	/* Now call the entry point to initialize the extension */
+	inst->args.conffile = inst->ext->conffile;
+	inst->args.dict = static_cast<void*>(pDictionary);
+	inst->args.hooks = &ext_hooks_ops;
+	inst->args.dict_cache = &ext_dict_ops;
+	inst->args.alloc = &ext_alloc_ops;
+	/* the snapshot is saved by fd_ext_load, before any extension loaded on demand created its objects */
+	inst->args.warm_start = ext_snap_warm && !inst->ext->on_demand;
+	inst->args.ready = ext_ready;
+	inst->args.config = &ext_config_ops;
+	inst->args.timers = &ext_timer_ops;
+	inst->args.sessions = &ext_session_ops;
+	inst->init_called = 1;
+	ret = (*inst->init)( 1, 2, &inst->args );
+
+	/* It may have added objects other extensions declared */
+	fd_ext_dict_refresh();
+	if (ret != 0 && ret != FD_EXT_PENDING) {
+		/* The extension was unable to load cleanly */
+		//TRACE_ERROR("Extension %s returned an error during initialization: %s", inst->ext->filename, strerror(ret));
+	}
+
+	return ret;
+}
+
+/* Call the exit point of the copy, if it was resolved and initialized; returns the time fd_ext_fini took. The copy must not be serving anymore. */
+static uint64_t ext_close_fini(struct fd_ext_inst * inst)
+{
+	uint64_t ns = 0;
+
+	/* No reconfiguration while it is finalized, nor timer */
+	ext_config_unwatch(inst);
+	if (inst->init_called)
+		ext_timer_release(inst);
+
+	/* The contexts of the threads which did not exit, before the global teardown */
+	if (inst->thread_init != NULL && inst->init_called)
+		ext_thread_release(inst);
+
+	if (inst->fini != NULL && inst->init_called) {
+		uint64_t start = ext_now_ns();
+		//TRACE_DEBUG (FULL, "Calling [%s]->fd_ext_fini function.", inst->ext->ext_name ?: inst->ext->filename);
+		(*inst->fini)();
+		ns = ext_now_ns() - start;
+	}
+
+	/* The helper runs fd_ext_fini of an extension hosted out of process */
+	if (inst->oop != NULL)
+		ext_oop_close(inst);
+	return ns;
+}
+
+/* Then release what the copy left and unload it, unless code of its dependents may still run */
+static void ext_close_unload(struct fd_ext_inst * inst, int unload)
+{
+	/* The hooks it did not unregister, no longer called since the copy was switched out, its dictionary tables and configuration */
+	ext_hooks_release(inst);
+	ext_dict_release(inst);
+	ext_config_release(inst);
+	
+#ifndef SKIP_DLCLOSE
+	/* Now unload the extension */
+	if (inst->handler && unload) {
+		//TRACE_DEBUG (FULL, "Unloading %s", inst->ext->ext_name ?: inst->ext->filename);
+		if ( dlclose(inst->handler) != 0 ) {
+			//TRACE_DEBUG (INFO, "Unloading [%s] failed : %s", inst->ext->ext_name ?: inst->ext->filename, dlerror());
+		}
+	}
+#endif /* SKIP_DLCLOSE */
+
+	delete inst;
+}
+
+static void ext_close(struct fd_ext_inst * inst)
+{
+	uint64_t ns = ext_close_fini(inst);
+
+	if (inst->fini != NULL && inst->init_called)
+		inst->ext->fini_ns = ns;
+	ext_close_unload(inst, 1);
+}
+
+/* A reloaded copy which never served: the statistics stay those of the copy loaded */
+static void ext_discard(struct fd_ext_inst * inst)
+{
+	ext_close_fini(inst);
+	ext_close_unload(inst, 1);
+}
+
+/* State shared by the threads initializing the extensions, and by the extensions completing in the background */
+struct ext_load_sched {
+	std::mutex				lock;
+	std::condition_variable			cond;
+	std::deque<struct fd_ext_info*>		ready;		/* extensions whose dependencies are all ready */
+	unsigned				running;	/* fd_ext_init in progress */
+	int					error;		/* first error returned by a fd_ext_init */
+	int					loading;	/* the workers of fd_ext_load take the ready extensions */
+	int					closing;	/* fd_ext_term is running, late readiness is ignored */
+	std::vector<std::thread>		late;		/* workers started after fd_ext_load returned */
+	std::vector<std::pair<void (*)(void *), void *> > waiters;	/* fd_ext_on_ready */
+};
+static struct ext_load_sched ext_sched;
+
+static void ext_load_worker(void);
+
+/* Number of extensions in the state. Called with ext_sched.lock held. */
+static size_t ext_sched_count(int state)
+{
+	size_t n = 0;
+
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+		if ((*li)->state.load(std::memory_order_relaxed) == state)
+			n++;
+	}
+	return n;
+}
+
+static void ext_set_state(struct fd_ext_info * ext, struct fd_ext_inst * inst, int state)
+{
+	inst->state.store(state, std::memory_order_release);
+	ext->state.store(state, std::memory_order_relaxed);
+}
+
+/* The dependents of a failed extension will never be initialized. Called with ext_sched.lock held. */
+static void ext_sched_fail(struct fd_ext_info * ext)
+{
+	for (auto it = ext->dependents.cbegin(); it != ext->dependents.cend(); ++it) {
+		struct fd_ext_info * dep = *it;
+		if (dep->state.load(std::memory_order_relaxed) != FD_EXT_STATE_LOADING)
+			continue;
+		ext_set_state(dep, dep->inst.load(std::memory_order_relaxed), FD_EXT_STATE_FAILED);
+		ext_sched_fail(dep);
+	}
+}
+
+/* The extension completed its initialization: release its dependents. Called with ext_sched.lock held. */
+static void ext_sched_done(struct fd_ext_info * ext, struct fd_ext_inst * inst, int status)
+{
+	ext->ready_ns = ext_now_ns() - ext->init_start;
+	if (status != 0) {
+		//LOG_E("Extension %s failed to complete its initialization: %s", ext->ext_name, strerror(status));
+		ext_set_state(ext, inst, FD_EXT_STATE_FAILED);
+		ext_sched_fail(ext);
+		return;
+	}
+	ext_set_state(ext, inst, FD_EXT_STATE_READY);
+
+	/* The dependencies are all ready, the chain ending here is final */
+	ext->path_ns = ext->ready_ns;
+	for (auto it = ext->deps.cbegin(); it != ext->deps.cend(); ++it) {
+		if ((*it)->path_ns + ext->ready_ns > ext->path_ns) {
+			ext->path_ns = (*it)->path_ns + ext->ready_ns;
+			ext->path_prev = *it;
+		}
+	}
+
+	/* Release the dependents, the workers of fd_ext_load are gone when this is late; none once fd_ext_term runs */
+	if (ext_sched.closing)
+		return;
+	for (auto it = ext->dependents.cbegin(); it != ext->dependents.cend(); ++it) {
+		if (--(*it)->pending_deps == 0)
+			ext_sched.ready.push_back(*it);
+	}
+	if (!ext_sched.loading && !ext_sched.ready.empty())
+		ext_sched.late.push_back(std::thread(ext_load_worker));
+}
+
+/* The gating of the hooks changed, tell the daemon it can dispatch the messages it held again */
+static void ext_sched_notify(void)
+{
+	std::vector<std::pair<void (*)(void *), void *> > waiters;
+	int settled;
+
+	ext_hooks_ready();
+	ext_demand_update();
+	{
+		std::lock_guard<std::mutex> lock(ext_sched.lock);
+		waiters.swap(ext_sched.waiters);
+		settled = !ext_sched.loading
+			&& ext_sched_count(FD_EXT_STATE_READY) + ext_sched_count(FD_EXT_STATE_IDLE) == ext_list.size();
+	}
+	for (auto it = waiters.cbegin(); it != waiters.cend(); ++it)
+		(*it->first)(it->second);
+
+	/* The dictionary snapshot waits for the last extension, it covers the objects created in the background */
+	if (settled)
+		ext_snap_save();
+}
+
+/* fd_ext_arg.ready, called by an extension which returned FD_EXT_PENDING from fd_ext_init */
+static void ext_ready(struct fd_ext_arg * self, int status)
+{
+	struct fd_ext_inst * inst = ext_inst_of(self);
+	struct fd_ext_info * ext = inst->ext;
+
+	{
+		std::lock_guard<std::mutex> lock(ext_sched.lock);
+		if (ext_sched.closing)
+			return;
+		if (inst->state.load(std::memory_order_relaxed) == FD_EXT_STATE_LOADING) {
+			/* fd_ext_init did not return yet, or this is a copy being reloaded */
+			inst->ready_early = 1;
+			inst->ready_status = status;
+			ext_sched.cond.notify_all();
+			return;
+		}
+		if (inst->state.load(std::memory_order_relaxed) != FD_EXT_STATE_PENDING)
+			return;
+		ext_sched_done(ext, inst, status);
+		ext_sched.cond.notify_all();
+	}
+	ext_sched_notify();
+}
+
+/* Load an extension on demand, and those it depends on. Called with ext_sched.lock held. */
+static void ext_demand_queue(struct fd_ext_info * ext)
+{
+	int idle = FD_EXT_STATE_IDLE;
+
+	if (ext->state.compare_exchange_strong(idle, FD_EXT_STATE_LOADING, std::memory_order_acq_rel))
+		ext_sched.ready.push_back(ext);
+}
+
+/* Open an extension loaded on demand and count the dependencies it waits for. Called with ext_sched.lock held,
+ * the edges of the dependency graph are read by ext_sched_done. */
+static int ext_demand_open(struct fd_ext_info * ext)
+{
+	int ret = ext_open(ext);
+
+	if (ret != 0)
+		return ret;
+	ext->pending_deps = 0;
+	for (auto it = ext->deps.cbegin(); it != ext->deps.cend(); ++it) {
+		switch ((*it)->state.load(std::memory_order_acquire)) {
+		case FD_EXT_STATE_READY:
+			continue;
+		case FD_EXT_STATE_FAILED:
+			return ESRCH;
+		case FD_EXT_STATE_IDLE:
+			ext_demand_queue(*it);
+		}
+		ext->pending_deps++;
+	}
+	ext->state.store(FD_EXT_STATE_LOADING, std::memory_order_release);
+	return 0;
+}
+
+/* A message served by an extension loaded on demand arrived: load it in the background */
+void ext_demand_start(struct fd_ext_info * ext)
+{
+	std::lock_guard<std::mutex> lock(ext_sched.lock);
+
+	if (ext_sched.closing || ext->state.load(std::memory_order_relaxed) != FD_EXT_STATE_IDLE)
+		return;
+	ext_demand_queue(ext);
+	/* during fd_ext_load, its workers take it */
+	if (!ext_sched.loading)
+		ext_sched.late.push_back(std::thread(ext_load_worker));
+}
+
+/* Initialize the extensions as soon as their dependencies are ready */
+static void ext_load_worker(void)
+{
+	std::unique_lock<std::mutex> lock(ext_sched.lock);
+	int changed = 0;
+
+	for (;;) {
+		struct fd_ext_info * ext;
+		struct fd_ext_inst * inst;
+		int ret;
+
+		/* After an error, or once fd_ext_term runs, the extensions not started yet are left alone */
+		while (ext_sched.ready.empty() && ext_sched.running && !ext_sched.error && !ext_sched.closing)
+			ext_sched.cond.wait(lock);
+		if (ext_sched.ready.empty() || ext_sched.error || ext_sched.closing)
+			break;
+
+		ext = ext_sched.ready.front();
+		ext_sched.ready.pop_front();
+		inst = ext->inst.load(std::memory_order_relaxed);
+		if (inst == NULL) {
+			/* loaded on demand, its dependencies are known once it is opened */
+			changed = 1;
+			ret = ext_demand_open(ext);
+			if (ret != 0) {
+				if (ext->inst.load(std::memory_order_relaxed))
+					ext_set_state(ext, ext->inst.load(std::memory_order_relaxed), FD_EXT_STATE_FAILED);
+				else
+					ext->state.store(FD_EXT_STATE_FAILED, std::memory_order_release);
+				ext_sched_fail(ext);
+				continue;
 			}
-			return EINVAL;
+			if (ext->pending_deps)
+				continue;
+			inst = ext->inst.load(std::memory_order_relaxed);
 		}
-		
-		/* Check if declared dependencies are satisfied. */
-		if (check_dependencies(ext)) {
-			dlclose(ext->handler);
-			ext->handler = NULL;
-			return EINVAL;
+		ext_sched.running++;
+
+		lock.unlock();
+		ext->init_start = ext_now_ns();
+		ret = ext_call_init(inst);
+		ext->init_ns = ext_now_ns() - ext->init_start;
+		lock.lock();
+		ext_sched.running--;
+		changed = 1;
+
+		if (ret == FD_EXT_PENDING && !inst->ready_early) {
+			/* its ready() releases the dependents */
+			ext_set_state(ext, inst, FD_EXT_STATE_PENDING);
+			ext_sched.cond.notify_all();
+			continue;
 		}
-		
-		/* Resolve the entry point of the extension */
-		fd_ext_init = ( int (*) (int, int, fd_ext_arg *) )dlsym( ext->handler, "fd_ext_init" );
-		
-		if (fd_ext_init == NULL) {
-			/* An error occured */
-			//TRACE_ERROR("Unable to resolve symbol 'fd_ext_init' for extension %s: %s", ext->filename, dlerror());
-			dlclose(ext->handler);
-			ext->handler = NULL;
-			return EINVAL;
+		if (ret != 0 && ret != FD_EXT_PENDING) {
+			ext_set_state(ext, inst, FD_EXT_STATE_FAILED);
+			if (!ext_sched.loading) {
+				/* loaded on demand, the others are not concerned */
+				ext_sched_fail(ext);
+				continue;
+			}
+			if (!ext_sched.error)
+				ext_sched.error = ret;
+			ext_sched.cond.notify_all();
+			break;
 		}
-		
-		/* Resolve the exit point of the extension, which is optional for extensions */
-		ext->fini = ( void (*) (void) )dlsym( ext->handler, "fd_ext_fini" );
-		
-		if (ext->fini == NULL) {
-			/* Not provided */
-			//TRACE_DEBUG (FULL, "Extension [%s] has no fd_ext_fini function.", ext->filename);
-		} else {
-			/* Provided */
-			//TRACE_DEBUG (FULL, "Extension [%s] fd_ext_fini has been resolved successfully.", ext->filename);
+
+		ext_sched_done(ext, inst, ret == FD_EXT_PENDING ? inst->ready_status : 0);
+		ext_sched.cond.notify_all();
+	}
+
+	/* The hooks registered by the extensions initialized here are no longer gated */
+	if (ext_sched.closing)
+		changed = 0;
+	lock.unlock();
+	if (changed)
+		ext_sched_notify();
+}
+
+/* Call cb once an extension which was not ready is ready, or failed; EALREADY when all are ready */
+int fd_ext_on_ready(void (*cb)(void *data), void *data)
+{
+	std::lock_guard<std::mutex> lock(ext_sched.lock);
+
+	if (!ext_sched_count(FD_EXT_STATE_LOADING) && !ext_sched_count(FD_EXT_STATE_PENDING))
+		return EALREADY;
+	ext_sched.waiters.push_back(std::make_pair(cb, data));
+	return 0;
+}
+
+/* Format the longest chain of initializations, which bounds the loading time */
+static void ext_build_report(uint64_t wall_ns)
+{
+	struct fd_ext_info * last = NULL;
+	std::vector<struct fd_ext_info*> path;
+	std::ostringstream out;
+	char buf[64];
+
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+		if (!last || (*li)->path_ns > last->path_ns)
+			last = *li;
+	}
+	for (; last; last = last->path_prev)
+		path.push_back(last);
+
+	for (auto it = path.crbegin(); it != path.crend(); ++it) {
+		snprintf(buf, sizeof(buf), "%s(%.3f ms)", (*it)->ext_name, (*it)->ready_ns / 1e6);
+		if (it != path.crbegin())
+			out << " -> ";
+		out << buf;
+	}
+	snprintf(buf, sizeof(buf), "%.3f ms of %.3f ms", path.empty() ? 0 : path.front()->path_ns / 1e6, wall_ns / 1e6);
+	out << (path.empty() ? "" : " = ") << buf;
+	ext_load_report = out.str();
+}
+
+/* Load all extensions in the list */
+int fd_ext_load()
+{
+	std::vector<std::thread> workers;
+	std::list<struct fd_ext_info*>::iterator li;
+	int settled, ret;
+	unsigned nthreads = ext_load_threads;
+	uint64_t start = ext_now_ns();
+	
+	/* The manifests order the extensions after their dependencies, nothing is loaded if they cannot be */
+	ret = ext_manifest_order();
+	if (ret != 0)
+		return ret;
+
+	/* Open all extensions in that order, or in the configuration order when some have no manifest */
+	for (li = ext_list.begin(); li != ext_list.end(); ++li)
+	{
+		if ((*li)->on_demand) {
+			ext_index_add(*li);
+			continue;
 		}
-		
-		/* Now call the entry point to initialize the extension */
-		struct fd_ext_arg args = {};
-		args.conffile = ext->conffile;
-		args.dict = static_cast<void*>(pDictionary);
-		ret = (*fd_ext_init)( 1, 2, &args );
-		if (ret != 0) {
-			/* The extension was unable to load cleanly */
-			//TRACE_ERROR("Extension %s returned an error during initialization: %s", ext->filename, strerror(ret));
+		ret = ext_open(*li);
+		if (ret != 0)
 			return ret;
+	}
+
+	/* Those loaded on demand which an extension opened now depends on are opened now too, their dependencies come first */
+	for (auto ri = ext_list.rbegin(); ri != ext_list.rend(); ++ri)
+	{
+		struct fd_ext_info * ext = *ri;
+		if (ext->inst.load(std::memory_order_relaxed) || std::none_of(ext->dependents.cbegin(), ext->dependents.cend(),
+				[](struct fd_ext_info * d) { return d->inst.load(std::memory_order_relaxed) != NULL; }))
+			continue;
+		ret = ext_open(ext);
+		if (ret != 0)
+			return ret;
+	}
+
+	/* Restore the dictionary objects of the previous start, or journal them for the next one */
+	ext_snap_open();
+
+	/* The independent extensions are initialized first, the dependents are released as their dependencies become ready */
+	{
+		std::lock_guard<std::mutex> lock(ext_sched.lock);
+		ext_sched.ready.clear();
+		ext_sched.running = 0;
+		ext_sched.error = 0;
+		ext_sched.loading = 1;
+		ext_sched.closing = 0;
+		for (li = ext_list.begin(); li != ext_list.end(); ++li)
+		{
+			struct fd_ext_info * ext = *li;
+			if (ext->inst.load(std::memory_order_relaxed) == NULL) {
+				ext->state.store(FD_EXT_STATE_IDLE, std::memory_order_relaxed);
+				continue;
+			}
+			ext->state.store(FD_EXT_STATE_LOADING, std::memory_order_relaxed);
+			ext->pending_deps = ext->deps.size();
+			if (ext->pending_deps == 0)
+				ext_sched.ready.push_back(ext);
 		}
-		
-		/* Proceed to the next extension */
 	}
 
-	//LOG_N("All extensions loaded.");
+	if (nthreads == 0)
+		nthreads = std::thread::hardware_concurrency() ?: 1;
+	if (nthreads > ext_list.size())
+		nthreads = ext_list.size() ?: 1;
+
+	/* The current thread is one of the workers */
+	for (unsigned i = 1; i < nthreads; i++)
+		workers.push_back(std::thread(ext_load_worker));
+	ext_load_worker();
+	for (auto it = workers.begin(); it != workers.end(); ++it)
+		it->join();
+
+	/* The extensions still pending complete in the background, their dependents are initialized then */
+	{
+		std::lock_guard<std::mutex> lock(ext_sched.lock);
+		ext_sched.loading = 0;
+		if (ext_sched.error != 0)
+			return ext_sched.error;
+		if (!ext_sched.ready.empty())
+			ext_sched.late.push_back(std::thread(ext_load_worker));
+		settled = ext_sched_count(FD_EXT_STATE_READY) + ext_sched_count(FD_EXT_STATE_IDLE) == ext_list.size();
+	}
+
+	/* The first message served by an extension not opened loads it */
+	ext_demand_update();
+
+	/* The text of the extensions onto huge pages, before the first message */
+	ext_huge_load();
+
+	ext_build_report(ext_now_ns() - start);
+	if (settled)
+		ext_snap_save();
+	//LOG_N("All extensions loaded, critical path: %s", ext_load_report.c_str());
 	
 	/* We have finished. */
 	return 0;
 }
 
+/* Retrieve the critical path of the last fd_ext_load */
+int fd_ext_critical_path(char *buf, size_t len)
+{
+	return snprintf(buf, len, "%s", ext_load_report.c_str());
+}
+
+/* An extension finalized by fd_ext_term */
+struct ext_term_job {
+	struct fd_ext_info			*ext;
+	struct fd_ext_inst			*inst;
+	std::vector<struct ext_term_job*>	deps;		/* finalized after this one */
+	unsigned				pending;	/* dependents not finalized yet */
+	uint64_t				start;		/* fd_ext_fini called, 0 before */
+	uint64_t				fini_ns;
+	int					abandoned;	/* past its deadline, left running */
+	int					keep;		/* neither finalized nor unloaded, an abandoned dependent may still run into it */
+};
+
+/* Shared with the threads finalizing the extensions, which outlive fd_ext_term when one is abandoned */
+struct ext_term_sched {
+	std::mutex				lock;
+	std::condition_variable			cond;
+	std::deque<struct ext_term_job*>	ready;		/* extensions whose dependents are all finalized */
+	size_t					remaining;
+	std::vector<struct ext_term_job>	jobs;
+	std::vector<struct ext_term_job*>	order;		/* as they were finalized, for the report */
+};
+
+/* The job is over, its dependencies may be finalized. Called with ts->lock held. */
+static void ext_term_release(struct ext_term_sched * ts, struct ext_term_job * job)
+{
+	ts->remaining--;
+	ts->order.push_back(job);
+	for (auto it = job->deps.begin(); it != job->deps.end(); ++it) {
+		if (--(*it)->pending == 0)
+			ts->ready.push_back(*it);
+	}
+	ts->cond.notify_all();
+}
+
+/* The dependencies of an abandoned extension stay initialized and mapped */
+static void ext_term_keep(struct ext_term_job * job)
+{
+	for (auto it = job->deps.begin(); it != job->deps.end(); ++it) {
+		if (!(*it)->keep) {
+			(*it)->keep = 1;
+			ext_term_keep(*it);
+		}
+	}
+}
+
+static void ext_term_worker(std::shared_ptr<struct ext_term_sched> ts)
+{
+	std::unique_lock<std::mutex> lock(ts->lock);
+
+	for (;;) {
+		struct ext_term_job * job;
+		uint64_t ns;
+
+		while (ts->ready.empty() && ts->remaining)
+			ts->cond.wait(lock);
+		if (ts->ready.empty())
+			return;
+		job = ts->ready.front();
+		ts->ready.pop_front();
+		if (job->keep) {
+			ext_term_release(ts.get(), job);
+			continue;
+		}
+		job->start = ext_now_ns();
+		ts->cond.notify_all();
+		lock.unlock();
+		ns = ext_close_fini(job->inst);
+		lock.lock();
+
+		/* another thread replaced this one past the deadline, the copy is left as it is */
+		if (job->abandoned)
+			return;
+		job->fini_ns = ns;
+		lock.unlock();
+		ext_close_unload(job->inst, 1);
+		lock.lock();
+		ext_term_release(ts.get(), job);
+	}
+}
+
 /* Now unload the extensions and free the memory */
 int fd_ext_term( void )
 {
-	/* Loop on all extensions, in FIFO order */
-	while (!ext_list.empty())
+	std::lock_guard<std::mutex> lock(ext_reload_lock);
+	std::shared_ptr<struct ext_term_sched> ts = std::make_shared<struct ext_term_sched>();
+	std::vector<struct ext_term_job*> byIdx(EXT_MAX, NULL);
+	std::vector<std::thread> late;
+	std::ostringstream out;
+	uint64_t start = ext_now_ns(), timeout = ext_fini_timeout_ms * 1000000ULL;
+	unsigned nthreads = ext_load_threads;
+	int abandoned = 0;
+
+	/* No more initialization, the extensions still pending are finalized without waiting for them */
 	{
-		std::list<struct fd_ext_info*>::iterator li = ext_list.begin();
-		struct fd_ext_info * ext = *li;
-	
-		/* Unlink this element from the list */
-		ext_list.erase(li);
-		
-		/* Call the exit point of the extension, if it was resolved */
-		if (ext->fini != NULL) {
-			//TRACE_DEBUG (FULL, "Calling [%s]->fd_ext_fini function.", ext->ext_name ?: ext->filename);
-			(*ext->fini)();
+		std::lock_guard<std::mutex> slock(ext_sched.lock);
+		ext_sched.closing = 1;
+		ext_sched.ready.clear();
+		ext_sched.waiters.clear();
+		ext_sched.cond.notify_all();
+	}
+	/* until no worker started meanwhile is left */
+	for (;;) {
+		{
+			std::lock_guard<std::mutex> slock(ext_sched.lock);
+			late.swap(ext_sched.late);
 		}
-		
-#ifndef SKIP_DLCLOSE
-		/* Now unload the extension */
-		if (ext->handler) {
-			//TRACE_DEBUG (FULL, "Unloading %s", ext->ext_name ?: ext->filename);
-			if ( dlclose(ext->handler) != 0 ) {
-				//TRACE_DEBUG (INFO, "Unloading [%s] failed : %s", ext->ext_name ?: ext->filename, dlerror());
+		if (late.empty())
+			break;
+		for (auto it = late.begin(); it != late.end(); ++it)
+			it->join();
+		late.clear();
+	}
+
+	/* Stop calling the hooks of all the extensions at once */
+	ts->jobs.reserve(ext_list.size());
+	for (auto li = ext_list.begin(); li != ext_list.end(); ++li) {
+		struct ext_term_job job = {};
+		job.ext = *li;
+		job.inst = (*li)->inst.exchange(NULL);
+		if (job.inst == NULL)
+			continue;
+		ts->jobs.push_back(job);
+		byIdx[(*li)->idx] = &ts->jobs.back();
+	}
+	ext_hooks_update();
+	fd_ext_rcu_synchronize();
+
+	/* The dependents are finalized before their dependencies, the independent extensions in parallel */
+	std::unique_lock<std::mutex> tlock(ts->lock);
+	for (auto it = ts->jobs.begin(); it != ts->jobs.end(); ++it) {
+		for (auto di = it->ext->deps.cbegin(); di != it->ext->deps.cend(); ++di) {
+			struct ext_term_job * dep = byIdx[(*di)->idx];
+			if (dep == NULL)
+				continue;
+			it->deps.push_back(dep);
+			dep->pending++;
+		}
+	}
+	for (auto it = ts->jobs.begin(); it != ts->jobs.end(); ++it) {
+		if (it->pending == 0)
+			ts->ready.push_back(&*it);
+	}
+	ts->remaining = ts->jobs.size();
+	if (nthreads == 0)
+		nthreads = std::thread::hardware_concurrency() ?: 1;
+	if (nthreads > ts->jobs.size())
+		nthreads = ts->jobs.size();
+	for (unsigned i = 0; i < nthreads; i++)
+		std::thread(ext_term_worker, ts).detach();
+
+	/* An extension past its deadline is left running, a new thread takes its place */
+	while (ts->remaining) {
+		uint64_t now = ext_now_ns(), next = 0;
+		for (auto it = ts->jobs.begin(); timeout && it != ts->jobs.end(); ++it) {
+			if (!it->start || it->abandoned || std::find(ts->order.cbegin(), ts->order.cend(), &*it) != ts->order.cend())
+				continue;
+			if (now - it->start >= timeout) {
+				//LOG_E("Extension %s did not return from fd_ext_fini within %u ms, it is not unloaded", it->ext->ext_name, ext_fini_timeout_ms);
+				it->abandoned = 1;
+				abandoned = 1;
+				it->fini_ns = now - it->start;
+				ext_term_keep(&*it);
+				ext_term_release(ts.get(), &*it);
+				std::thread(ext_term_worker, ts).detach();
+			} else if (!next || it->start + timeout < next) {
+				next = it->start + timeout;
 			}
 		}
-#endif /* SKIP_DLCLOSE */
-		
-		/* Free the object and continue */
+		if (!ts->remaining)
+			break;
+		if (next)
+			ts->cond.wait_for(tlock, std::chrono::nanoseconds(next - now));
+		else
+			ts->cond.wait(tlock);
+	}
+
+	for (auto it = ts->order.cbegin(); it != ts->order.cend(); ++it) {
+		out << (it == ts->order.cbegin() ? "" : ", ") << (*it)->ext->ext_name << "(" << (*it)->fini_ns / 1e6 << " ms"
+			<< ((*it)->abandoned ? ", abandoned" : (*it)->keep ? ", kept" : "") << ")";
+	}
+	out << " = " << (ext_now_ns() - start) / 1e6 << " ms";
+	ext_term_report = out.str();
+	//LOG_N("All extensions finalized: %s", ext_term_report.c_str());
+
+	/* Free the objects, but those an abandoned copy may still refer to */
+	std::unique_lock<std::mutex> llock(ext_list_lock);
+	while (!ext_list.empty())
+	{
+		struct fd_ext_info * ext = ext_list.front();
+		struct ext_term_job * job = byIdx[ext->idx];
+
+		ext_list.pop_front();
+		if (job && (job->abandoned || job->keep))
+			continue;
+		ext_session_release(ext->idx);
 		if (ext->free_ext_name)
 			free(ext->ext_name);
 		free(ext->filename);
 		free(ext->conffile);
 		delete ext;
 	}
+	llock.unlock();
+	tlock.unlock();
+	ext_index_clear();
+	ext_demand_update();
+	/* The services stay for an abandoned extension, which may still be using them */
+	if (abandoned)
+		ext_services_left = 1;
+	if (ext_services_left) {
+		ext_config_leave();
+		ext_timer_leave();
+		ext_session_leave();
+	} else {
+		ext_config_stop();
+		ext_timer_stop();
+		ext_session_stop();
+	}
 	
 	/* We always return 0 since we would not handle an error anyway... */
 	return 0;
 }
 
-static std::vector<std::string> split(const std::string &s, char delim)
+/* Retrieve the finalization times of the last fd_ext_term */
+int fd_ext_fini_report(char *buf, size_t len)
+{
+	return snprintf(buf, len, "%s", ext_term_report.c_str());
+}
+
+/* Remove the private copy and its directory, once it is opened */
+static void ext_private_remove(const std::string & path)
+{
+	unlink(path.c_str());
+	rmdir(path.substr(0, path.rfind('/')).c_str());
+}
+
+/* Copy the file of the extension into path, in a directory of its own under $TMPDIR (/tmp by default), so that dlopen
+ * does not return the copy already loaded and that nothing is written into the installation */
+static int ext_private_copy(struct fd_ext_info * ext, std::string & path)
 {
-	std::string item;
-	std::stringstream ss(s);
-	std::vector<std::string> elems;
-	while (getline(ss, item, delim)) {
-		elems.push_back(item);
+	const char * tmp = getenv("TMPDIR");
+	const char * base = strrchr(ext->filename, '/');
+	char buf[65536];
+	ssize_t len = 0;
+	int in, out, ret = 0;
+
+	path = tmp && *tmp ? tmp : "/tmp";
+	path += "/fdx.XXXXXX";
+	if (mkdtemp(&path[0]) == NULL)
+		return errno;
+	path += '/';
+	path += base ? base + 1 : ext->filename;
+
+	in = open(ext->filename, O_RDONLY);
+	if (in < 0) {
+		ret = errno;
+		ext_private_remove(path);
+		return ret;
+	}
+	out = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0700);
+	if (out < 0) {
+		ret = errno;
+		close(in);
+		ext_private_remove(path);
+		return ret;
+	}
+	while ((len = read(in, buf, sizeof(buf))) > 0) {
+		ssize_t done = write(out, buf, len);
+		if (done != len) {
+			ret = done < 0 ? errno : ENOSPC;
+			break;
+		}
 	}
-	return elems;
+	if (len < 0)
+		ret = errno;
+	close(in);
+	if (close(out) && !ret)
+		ret = errno;
+	if (ret)
+		ext_private_remove(path);
+	return ret;
 }
 
-static std::string &strip(std::string &s)
+/* Replace the loaded copy of an extension by the current content of its file */
+int fd_ext_reload(const char *name)
 {
-	std::string::iterator it = s.begin();
-	while (it != s.end()) {
-		if (std::isspace(*it))
-			it = s.erase(it);
-		else
-			++it;
+	std::lock_guard<std::mutex> lock(ext_reload_lock);
+	struct fd_ext_info * ext = NULL;
+	struct fd_ext_inst * old, * inst;
+	std::string path;
+	int ret, i;
+
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+		if ((*li)->ext_name && !strcasecmp((*li)->ext_name, name)) {
+			ext = *li;
+			break;
+		}
+	}
+	if (ext == NULL || (old = ext->inst.load(std::memory_order_relaxed)) == NULL)
+		return ENOENT;
+
+	/* Its helper would have to be restarted, or there is no other copy of its code */
+	if (old->oop != NULL || ext->stat != NULL)
+		return ENOTSUP;
+
+	/* The dependents may have bound symbols of the loaded copy */
+	if (!ext->dependents.empty())
+		return EBUSY;
+
+	ret = ext_private_copy(ext, path);
+	if (ret)
+		return ret;
+
+	/* The new copy resolves its own symbols first, and does not interpose the loaded one */
+	inst = new(struct fd_ext_inst)();
+	inst->ext = ext;
+	inst->handler = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND);
+	ext_private_remove(path);
+	if (inst->handler == NULL) {
+		//LOG_F("Reloading of extension %s failed: %s", ext->filename, dlerror());
+		delete inst;
+		return EINVAL;
+	}
+
+	/* Same name, and no new dependency */
+	*((void**)&inst->depends) = dlsym( inst->handler, "fd_ext_depends" );
+	ret = (old->depends && !inst->depends) || (inst->depends && strcasecmp(inst->depends[0], ext->ext_name)) ? EINVAL : 0;
+	for (i = 1; !ret && inst->depends && inst->depends[i]; i++) {
+		ret = ESRCH;
+		for (auto it = ext->deps.cbegin(); it != ext->deps.cend(); ++it) {
+			if (!strcasecmp((*it)->ext_name, inst->depends[i]))
+				ret = 0;
+		}
+	}
+	if (!ret)
+		ret = ext_resolve(inst);
+	if (!ret)
+		ret = ext_call_init(inst);
+	if (ret == FD_EXT_PENDING) {
+		/* The old copy serves until the new one is ready */
+		std::unique_lock<std::mutex> lock(ext_sched.lock);
+		while (!inst->ready_early && !ext_sched.closing)
+			ext_sched.cond.wait(lock);
+		ret = inst->ready_early ? inst->ready_status : ECANCELED;
+	}
+	if (ret) {
+		ext_discard(inst);
+		return ret;
+	}
+	inst->state.store(FD_EXT_STATE_READY, std::memory_order_release);
+
+	/* The name must outlive the copy it points into */
+	if (!ext->free_ext_name) {
+		char * name_copy = strdup(ext->ext_name);
+		if (name_copy == NULL) {
+			ext_discard(inst);
+			return ENOMEM;
+		}
+		std::lock_guard<std::mutex> llock(ext_list_lock);
+		ext->ext_name = name_copy;
+		ext->free_ext_name = 1;
 	}
-	return s;
+
+	/* Switch the callers, the hooks of the new copy replace the old ones in a single step, then wait until none is still running the old code */
+	ext->inst.store(inst, std::memory_order_release);
+	ret = ext_hooks_update();
+	if (ret) {
+		ext->inst.store(old, std::memory_order_release);
+		ext_hooks_update();
+		fd_ext_rcu_synchronize();
+		ext_discard(inst);
+		return ret;
+	}
+	fd_ext_rcu_synchronize();
+	ext_close(old);
+	ext->reloads++;
+
+	//LOG_N("Extension %s reloaded.", ext->ext_name);
+	return 0;
+}
+
+/* Value of a key of extensions.cfg, empty if absent */
+static std::string ext_cfg_string(struct ext_cfg * cfg, const char * key)
+{
+	struct fd_ext_cfg_view v;
+
+	if (ext_cfg_find(cfg, "Extension", key, &v))
+		return std::string();
+	return std::string(v.ptr, v.len);
 }
 
 int fd_ext_initialize(void *pParam)
 {
-	char buf[FILE_NAME_LENGTH] = {0};
 	std::string pHome(static_cast<char*>(pParam));
 	std::string extHome = pHome + "lib/extensions/";
 	std::string cfgFile = pHome + "cfg/extensions.cfg";
+	std::vector<struct fd_ext_cfg_view> vecExtName, vecLimit;
+	struct fd_ext_cfg_view list, cpus;
+	std::string onDemand;
+	int demand;
+	unsigned first = ext_list.size();
+	struct ext_cfg * cfg = ext_cfg_open(cfgFile.c_str());
+	int ret = RTN_FAIL;
 
-	GetPrivateProfileString("Extension", "ExtensionList", "", buf, sizeof(buf)-1, cfgFile.c_str());
-	std::string extName(buf);
-	strip(extName);
-	std::vector<std::string> vecExtName = split(extName, ',');
+	if (cfg == NULL)
+		return RTN_FAIL;
+
+	if (ext_cfg_find(cfg, "Extension", "ExtensionList", &list) == 0)
+		ext_cfg_split(list, ',', vecExtName);
+	/* The extensions declaring the messages they serve are loaded on the first one, unless OnDemand is off */
+	onDemand = ext_cfg_string(cfg, "OnDemand");
+	demand = !(onDemand == "0" || !strcasecmp(onDemand.c_str(), "no") || !strcasecmp(onDemand.c_str(), "off")
+			|| !strcasecmp(onDemand.c_str(), "false"));
 	for (auto it = vecExtName.cbegin(); it != vecExtName.cend(); ++it) {
-		std::string fdxPath = extHome + *it + ".fdx";
-		std::string cfgPath = extHome + *it + ".cfg";
+		std::string name(it->ptr, it->len);
+		std::string fdxPath = extHome + name + ".fdx";
+		std::string cfgPath = extHome + name + ".cfg";
+		struct fd_ext_info * ext;
 		if (fd_ext_add(fdxPath.c_str(), cfgPath.c_str()))
-			return RTN_FAIL;
+			goto out;
+		ext = ext_list.back();
+		if (ext_demand_configure(ext))
+			goto out;
+		ext->on_demand = demand && !ext->serves.empty();
+		/* Hosted out of process when listed in [OutOfProcess], with the CPUs of its helper as value */
+		if (ext_cfg_find(cfg, "OutOfProcess", name.c_str(), &cpus) == 0) {
+			ext->oop = 1;
+			ext->oop_cpus.assign(cpus.ptr, cpus.len);
+		}
+		/* Linked into the daemon, its .fdx is not used */
+		if (!ext->oop)
+			ext->stat = ext_static_find(name.c_str());
+		if (ext->on_demand || ext->oop) {
+			/* the dependencies are looked up by name before it is opened */
+			if ((ext->ext_name = strdup(name.c_str())) == NULL)
+				goto out;
+			ext->free_ext_name = 1;
+		}
 	}
-	
-	return RTN_SUCCESS;
+
+	/* Helper process of the extensions hosted out of process, relative to the home directory */
+	{
+		std::string helper = ext_cfg_string(cfg, "OopHelper");
+		if (helper.empty())
+			helper = "bin/fdx_host";
+		if (helper[0] != '/')
+			helper = pHome + helper;
+		ext_oop_configure(helper.c_str(), strtoul(ext_cfg_string(cfg, "OopChannels").c_str(), NULL, 10),
+				strtoul(ext_cfg_string(cfg, "OopDepth").c_str(), NULL, 10),
+				strtoul(ext_cfg_string(cfg, "OopSlotSize").c_str(), NULL, 10),
+				strtoul(ext_cfg_string(cfg, "OopTimeout").c_str(), NULL, 10));
+	}
+
+	/* Extensions whose text is remapped onto huge pages once loaded, "all" or a list of names */
+	ext_huge_configure(ext_cfg_string(cfg, "HugeText").c_str());
+
+	/* Deadline of each fd_ext_fini in fd_ext_term, in milliseconds, 0 waits for them */
+	if (ext_cfg_find(cfg, "Extension", "FiniTimeout", &list) == 0)
+		ext_fini_timeout_ms = strtoul(std::string(list.ptr, list.len).c_str(), NULL, 10);
+
+	/* Threads of the timer wheels and of the pool running the deferred work of the extensions */
+	ext_timer_configure(strtoul(ext_cfg_string(cfg, "TimerThreads").c_str(), NULL, 10),
+			strtoul(ext_cfg_string(cfg, "ExecutorThreads").c_str(), NULL, 10));
+
+	/* Buckets of the session store of the extensions */
+	if (ext_cfg_find(cfg, "Extension", "SessionBuckets", &list) == 0)
+		ext_session_configure(strtoul(std::string(list.ptr, list.len).c_str(), NULL, 10));
+
+	/* Threads initializing independent extensions concurrently, 1 keeps the sequential loading */
+	ext_load_threads = strtoul(ext_cfg_string(cfg, "LoadThreads").c_str(), NULL, 10);
+
+	/* Snapshot of the dictionary objects created by the extensions, relative to the home directory */
+	{
+		std::string snapPath = ext_cfg_string(cfg, "DictSnapshot");
+		if (!snapPath.empty() && snapPath[0] != '/')
+			snapPath = pHome + snapPath;
+		ext_snap_configure(snapPath.c_str());
+	}
+
+	/* Soft limits of the memory of the extensions, "name:bytes[K|M|G],..." */
+	if (ext_cfg_find(cfg, "Extension", "MemLimit", &list) == 0)
+		ext_cfg_split(list, ',', vecLimit);
+	for (auto it = vecLimit.cbegin(); it != vecLimit.cend(); ++it) {
+		std::string limit(it->ptr, it->len);
+		size_t colon = limit.find(':');
+		char * end;
+		uint64_t bytes;
+		unsigned idx;
+		if (colon == std::string::npos)
+			goto out;
+		bytes = strtoull(limit.c_str() + colon + 1, &end, 10);
+		switch (*end) {
+		case 'G': case 'g':
+			bytes <<= 10;
+			/* fall through */
+		case 'M': case 'm':
+			bytes <<= 10;
+			/* fall through */
+		case 'K': case 'k':
+			bytes <<= 10;
+		}
+		for (idx = 0; idx < vecExtName.size(); idx++) {
+			if (vecExtName[idx].len == colon && !memcmp(vecExtName[idx].ptr, limit.data(), colon))
+				break;
+		}
+		if (idx == vecExtName.size())
+			goto out;
+		ext_alloc_limit(first + idx, bytes);
+	}
+	ret = RTN_SUCCESS;
+out:
+	ext_cfg_close(cfg);
+	return ret;
 }
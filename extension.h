@@ -42,19 +42,282 @@ extern "C" {
 
 /* Include definition of freeDiameter API */
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #define FD_PROJECT_VERSION_MAJOR 1
 #define FD_PROJECT_VERSION_MINOR 2
 
+/* Points of the messages processing where the extensions can be called */
+enum fd_ext_hook_point {
+	FD_EXT_HOOK_MSG_RECEIVED = 0,	/* a message was received from a peer */
+	FD_EXT_HOOK_BEFORE_ROUTING,	/* a request is about to be routed */
+	FD_EXT_HOOK_BEFORE_SEND,	/* a message is about to be sent to a peer */
+	FD_EXT_HOOK_ANSWER,		/* an answer to a request we forwarded was received */
+	FD_EXT_HOOK_MAX
+};
+
+/* A message, as seen by the hooks */
+struct fd_ext_msg {
+	uint32_t	app_id;		/* from the header */
+	uint32_t	cmd_code;
+	uint32_t	hbh_id;
+	uint32_t	e2e_id;
+	uint8_t		flags;
+	uint8_t		*data;		/* the encoded message, header included */
+	size_t		len;
+	void		*host_msg;	/* the daemon's own representation, if any */
+	struct fd_ext_arena *arena;	/* memory of the hooks for this message, NULL until they allocate */
+};
+
+/* Matches any Application-Id or Command-Code */
+#define FD_EXT_ANY		0xffffffff
+
+/* Values returned by the hooks. Any value but FD_EXT_HOOK_CONTINUE ends the dispatch and is returned to the daemon */
+#define FD_EXT_HOOK_CONTINUE	0	/* proceed with the next hook */
+#define FD_EXT_HOOK_HANDLED	1	/* the extension took care of the message */
+#define FD_EXT_HOOK_DROP	2	/* the message must be discarded */
+/* Returned by fd_ext_hook_dispatch, before calling any hook, when a hook matching the message belongs to an extension */
+#define FD_EXT_HOOK_PENDING	3	/* ... which is not ready yet: hold the message and dispatch it again later, see fd_ext_on_ready */
+#define FD_EXT_HOOK_UNAVAILABLE	4	/* ... whose initialization failed: reject the message */
+
+/* ctx is the slot of the calling thread for the extension, see fd_ext_thread_init, NULL if it has none */
+typedef int (*fd_ext_hook_cb)(enum fd_ext_hook_point point, struct fd_ext_msg *msg, void *regdata, void *ctx);
+
+struct fd_ext_arg;
+struct fd_ext_hook_hdl;
+
+/* Hooks registration; the hooks with the lowest priority value are called first */
+struct fd_ext_hooks {
+	int (*hook_register)(struct fd_ext_arg *self, enum fd_ext_hook_point point, uint32_t app_id, uint32_t cmd_code,
+				int priority, fd_ext_hook_cb cb, void *regdata, struct fd_ext_hook_hdl **hdl);
+	int (*hook_unregister)(struct fd_ext_hook_hdl *hdl);
+};
+
+struct dict_object;
+
+/* Dictionary objects an extension declares it uses, resolved once by the daemon */
+enum fd_ext_dict_kind {
+	FD_EXT_DICT_AVP = 0,
+	FD_EXT_DICT_COMMAND,		/* the request */
+	FD_EXT_DICT_APPLICATION
+};
+
+/* Looked up by name, or by code when name is NULL */
+struct fd_ext_dict_decl {
+	enum fd_ext_dict_kind	kind;
+	const char		*name;
+	uint32_t		code;		/* AVP Code, Command-Code or Application-Id */
+	uint32_t		vendor;		/* AVPs only */
+};
+
+/* objs[i] is the object of the i-th declaration, NULL as long as it is not in the dictionary */
+struct fd_ext_dict_cache {
+	unsigned		count;
+	struct dict_object	**objs;
+};
+
+/* O(1) access to a declared object, safe while the table is refreshed */
+#define FD_EXT_DICT(_cache, _idx)	__atomic_load_n(&(_cache)->objs[(_idx)], __ATOMIC_ACQUIRE)
+
+/* The tables are refreshed when an extension is initialized and when objects are added with dict_new */
+struct fd_ext_dict {
+	int (*dict_declare)(struct fd_ext_arg *self, const struct fd_ext_dict_decl *decls, unsigned count,
+				struct fd_ext_dict_cache **cache);
+	int (*dict_new)(struct fd_ext_arg *self, int type, void *data, struct dict_object *parent, struct dict_object **ref);
+};
+
+/* Memory charged to the extension; NULL is returned when it is out of memory or above its limit */
+struct fd_ext_alloc {
+	void *(*mem_alloc)(struct fd_ext_arg *self, size_t size);	/* from pools of the calling thread */
+	void (*mem_free)(void *ptr);					/* from any thread */
+	/* valid until the daemon is done with the message, then freed at once with fd_ext_msg_release */
+	void *(*msg_alloc)(struct fd_ext_arg *self, struct fd_ext_msg *msg, size_t size);
+};
+
+/* A value of the configuration, not NUL-terminated */
+struct fd_ext_cfg_view {
+	const char	*ptr;
+	size_t		len;
+};
+
+/* A key whose value changed; value.ptr is NULL if it was removed, old.ptr if it was added */
+struct fd_ext_cfg_change {
+	struct fd_ext_cfg_view	section;
+	struct fd_ext_cfg_view	key;
+	struct fd_ext_cfg_view	value;
+	struct fd_ext_cfg_view	old;
+};
+
+typedef void (*fd_ext_cfg_cb)(struct fd_ext_arg *self, const struct fd_ext_cfg_change *changes, unsigned count, void *data);
+
+/* The configuration file of the extension, INI syntax, parsed once by the daemon. The section is NULL for the keys before the first one.
+ * The getters return ENOENT if the key is absent, EINVAL if the value has not the type. The views point into the mapped file:
+ * they stay valid until fd_ext_fini, or, once cfg_watch was called, in read-side sections (the hooks) and in the callback. */
+struct fd_ext_config {
+	int (*cfg_get)(struct fd_ext_arg *self, const char *section, const char *key, struct fd_ext_cfg_view *value);
+	int (*cfg_get_int)(struct fd_ext_arg *self, const char *section, const char *key, long long *value);
+	int (*cfg_get_double)(struct fd_ext_arg *self, const char *section, const char *key, double *value);
+	int (*cfg_get_bool)(struct fd_ext_arg *self, const char *section, const char *key, int *value);	/* true/yes/on/1, false/no/off/0 */
+	/* when the file is replaced, cb is called from a daemon thread with the keys that changed; it must not call cfg_watch */
+	int (*cfg_watch)(struct fd_ext_arg *self, fd_ext_cfg_cb cb, void *data);
+};
+
+/* Timers and deferred work, run from threads of the daemon shared by all the extensions. A timer calls cb(data) after
+ * delay_ms, then every period_ms unless it is 0, and *id identifies it for timer_cancel (ENOENT once a single shot expired).
+ * defer runs cb(data) once, as soon as a thread of the pool is free: the timer callbacks must be short, the long work
+ * is deferred. What the extension started and is still pending is cancelled before its fd_ext_fini, which is called once
+ * the callbacks running have returned; after that, timer_start and defer return ECANCELED. */
+typedef void (*fd_ext_timer_cb)(void *data);
+struct fd_ext_timers {
+	int (*timer_start)(struct fd_ext_arg *self, uint64_t delay_ms, uint64_t period_ms, fd_ext_timer_cb cb, void *data, uint64_t *id);
+	int (*timer_cancel)(struct fd_ext_arg *self, uint64_t id);
+	int (*defer)(struct fd_ext_arg *self, fd_ext_timer_cb cb, void *data);
+};
+
+/* State of the extension for a session, kept by the daemon in a table shared by all the extensions, each one having its own
+ * namespace: no map nor lock of its own. The state is copied into the entry, charged to the memory of the extension. sess_get
+ * does not lock, the pointer it returns stays valid until the end of the read-side section (the hooks run in one, other
+ * threads use fd_ext_rcu_read_lock); the state replaced by sess_put is not changed meanwhile. sess_update changes the state
+ * in place, under the lock of its bucket, which may be read concurrently: it is for counters and flags read atomically.
+ * An entry expires ttl_ms after it was stored or updated, never if ttl_ms is 0. fd_ext_term removes the entries. */
+struct fd_ext_sessions {
+	/* The Session-Id of the message, pointing into msg->data; ENOENT if it has none */
+	int (*sess_id)(struct fd_ext_msg *msg, struct fd_ext_cfg_view *sid);
+	/* NULL if the session has no state (or it expired), else the state and its size */
+	const void *(*sess_get)(struct fd_ext_arg *self, const char *sid, size_t len, size_t *size);
+	int (*sess_put)(struct fd_ext_arg *self, const char *sid, size_t len, const void *state, size_t size, uint64_t ttl_ms);
+	/* cb gets the state of size bytes, created (zeroed) if there was none, resized (what fits is kept) if it was of another size */
+	int (*sess_update)(struct fd_ext_arg *self, const char *sid, size_t len, size_t size, uint64_t ttl_ms,
+				void (*cb)(void *state, int created, void *data), void *data);
+	int (*sess_remove)(struct fd_ext_arg *self, const char *sid, size_t len);
+};
+
+/* Returned by fd_ext_init when the extension completes its initialization in the background, it calls ready() once done.
+ * Its dependents are initialized and the messages its hooks match are dispatched only after that. */
+#define FD_EXT_PENDING		EINPROGRESS
+
+/* Passed to fd_ext_init, stays valid until fd_ext_fini returns */
 struct fd_ext_arg {
 	char *conffile;
 	void *dict;
+	const struct fd_ext_hooks *hooks;
+	const struct fd_ext_dict *dict_cache;
+	const struct fd_ext_alloc *alloc;
+	/* from any thread, once, after fd_ext_init returned FD_EXT_PENDING; status is 0 or an error code. Not after fd_ext_fini. */
+	void (*ready)(struct fd_ext_arg *self, int status);
+	int warm_start;		/* the objects this extension created with dict_new at the previous start are
+				   already in the dictionary, restored from the snapshot; only declare them.
+				   Never set for an extension loaded on demand, the snapshot is saved without it */
+	const struct fd_ext_config *config;	/* of conffile */
+	const struct fd_ext_timers *timers;
+	const struct fd_ext_sessions *sessions;
+};
+
+/* Most messages passed at once to fd_ext_hook_batch. An extension may export
+ *   FD_EXT_EXPORT int fd_ext_hook_batch(enum fd_ext_hook_point point, fd_ext_hook_cb cb, void *regdata,
+ *					struct fd_ext_msg **msgs, int *verdicts, unsigned count, void *ctx);
+ * which the daemon calls instead of the hook registered with cb and regdata, for the messages of a batch (see
+ * fd_ext_hook_dispatch_batch) the hook matches; it sets verdicts[i] for msgs[i] (all are FD_EXT_HOOK_CONTINUE
+ * on entry) and returns 0, or ENOTSUP to get one call of cb per message instead. */
+#define FD_EXT_BATCH_MAX	64
+
+/* Size of the per-thread slot of an extension, cache-line aligned. An extension may export
+ *   FD_EXT_EXPORT int fd_ext_thread_init(struct fd_ext_arg *args, void *ctx);
+ *   FD_EXT_EXPORT void fd_ext_thread_fini(struct fd_ext_arg *args, void *ctx);
+ * which are called on each thread calling its hooks, before the first call and when the thread exits,
+ * with the slot of the thread (zeroed) to keep its own state in, or a pointer to it. The slots of a copy
+ * which is finalized are given back to fd_ext_thread_fini from the finalizing thread, before fd_ext_fini. */
+#define FD_EXT_THREAD_SLOT	64
+
+/* The extensions are built with -fvisibility=hidden, the symbols the daemon looks up must be marked */
+#ifndef FD_EXT_STATIC
+#define FD_EXT_EXPORT	__attribute__((visibility("default")))
+#else /* FD_EXT_STATIC */
+#define FD_EXT_EXPORT
+#endif /* FD_EXT_STATIC */
+
+/* Descriptor of an extension linked into the daemon ('make static' in extensions/makefile), instead of a .fdx.
+ * Built with -DFD_EXT_STATIC=<name of the extension>, the same source gets its entry points renamed to
+ * <name>_fd_ext_init, ... and EXTENSION_ENTRY puts their addresses in a descriptor in the section
+ * FD_EXT_REGISTRY, which fd_ext_load walks: an extension of the configuration found there is not dlopened. */
+#define FD_EXT_REGISTRY		fd_ext_registry
+struct fd_ext_static {
+	const char		*name;
+	const char * const	*depends;	/* the name, then the dependencies, NULL-terminated */
+	const char * const	*services;	/* from FD_EXT_SERVICES, NULL-terminated, or NULL */
+	uint32_t		version;	/* FD_EXT_NOTE_VERSION */
+	int			(*init)(int major, int minor, struct fd_ext_arg *args);
+	void			(*fini)(void);	/* the optional entry points are NULL when not defined */
+	int			(*thread_init)(struct fd_ext_arg *args, void *ctx);
+	void			(*thread_fini)(struct fd_ext_arg *args, void *ctx);
+	int			(*batch)(enum fd_ext_hook_point point, fd_ext_hook_cb cb, void *regdata,
+					struct fd_ext_msg **msgs, int *verdicts, unsigned count, void *ctx);
 };
 
+/* Manifest of an extension: an ELF note (section .note.fdext, owner FD_EXT_NOTE_NAME) the daemon reads
+ * before loading any extension. FD_EXT_NOTE_MANIFEST holds FD_EXT_NOTE_VERSION (32 bits) then the name and
+ * the dependencies, FD_EXT_NOTE_SERVICES the services the extension needs, declared with
+ *   FD_EXT_SERVICES("config", "alloc");
+ * each as NUL-terminated strings ending with an empty one. EXTENSION_ENTRY emits the manifest. */
+#define FD_EXT_NOTE_NAME	"fdext"
+#define FD_EXT_NOTE_MANIFEST	1
+#define FD_EXT_NOTE_SERVICES	2
+#define FD_EXT_NOTE_VERSION	((FD_PROJECT_VERSION_MAJOR << 16) | FD_PROJECT_VERSION_MINOR)
+
+#define FD_EXT_STR_(_x)		#_x
+#define FD_EXT_STR(_x)		FD_EXT_STR_(_x)
+#define FD_EXT_NOTE(_type, _desc)								\
+__asm__(".pushsection .note.fdext,\"a\",%note\n\t.balign 4\n\t.long 2f - 1f\n\t.long 4f - 3f\n"	\
+	"\t.long " FD_EXT_STR(_type) "\n1:\t.asciz \"" FD_EXT_NOTE_NAME "\"\n2:\t.balign 4\n"		\
+	"3:\t" _desc "\n4:\t.balign 4\n\t.popsection")
+#define FD_EXT_MANIFEST_(...)									\
+	FD_EXT_NOTE(FD_EXT_NOTE_MANIFEST, ".long " FD_EXT_STR(FD_EXT_NOTE_VERSION) "\n\t.asciz " #__VA_ARGS__ "\n\t.byte 0")
+#define FD_EXT_MANIFEST(...)	FD_EXT_MANIFEST_(__VA_ARGS__)
+#define FD_EXT_SERVICES_(...)	FD_EXT_NOTE(FD_EXT_NOTE_SERVICES, ".asciz " #__VA_ARGS__ "\n\t.byte 0")
+#ifndef FD_EXT_STATIC
+#define FD_EXT_SERVICES(...)	FD_EXT_SERVICES_(__VA_ARGS__)
+#else /* FD_EXT_STATIC */
+#define FD_EXT_SERVICES(...)	const char * const fd_ext_services[] = { __VA_ARGS__ , NULL }
+#endif /* FD_EXT_STATIC */
+
+#ifdef FD_EXT_STATIC
+/* The entry points of each extension linked into the daemon get their own names, the optional ones are weak;
+ * the descriptors are packed as an array in the section, with no other alignment than the one of their type */
+#define FD_EXT_CAT_(_a, _b)	_a ## _ ## _b
+#define FD_EXT_CAT(_a, _b)	FD_EXT_CAT_(_a, _b)
+#define fd_ext_init		FD_EXT_CAT(FD_EXT_STATIC, fd_ext_init)
+#define fd_ext_depends		FD_EXT_CAT(FD_EXT_STATIC, fd_ext_depends)
+#define fd_ext_services		FD_EXT_CAT(FD_EXT_STATIC, fd_ext_services)
+#define fd_ext_fini		FD_EXT_CAT(FD_EXT_STATIC, fd_ext_fini)
+#define fd_ext_thread_init	FD_EXT_CAT(FD_EXT_STATIC, fd_ext_thread_init)
+#define fd_ext_thread_fini	FD_EXT_CAT(FD_EXT_STATIC, fd_ext_thread_fini)
+#define fd_ext_hook_batch	FD_EXT_CAT(FD_EXT_STATIC, fd_ext_hook_batch)
+#define fd_ext_descriptor	FD_EXT_CAT(FD_EXT_STATIC, fd_ext_descriptor)
+extern const char * const fd_ext_services[] __attribute__((weak));
+extern void fd_ext_fini(void) __attribute__((weak));
+extern int fd_ext_thread_init(struct fd_ext_arg *args, void *ctx) __attribute__((weak));
+extern void fd_ext_thread_fini(struct fd_ext_arg *args, void *ctx) __attribute__((weak));
+extern int fd_ext_hook_batch(enum fd_ext_hook_point point, fd_ext_hook_cb cb, void *regdata,
+				struct fd_ext_msg **msgs, int *verdicts, unsigned count, void *ctx) __attribute__((weak));
+
+#define FD_EXT_ENTRY_HEAD(_name, _depends...)							\
+const char * const fd_ext_depends[] = { _name , ## _depends , NULL };				\
+int fd_ext_init(int major, int minor, struct fd_ext_arg * args);				\
+static const struct fd_ext_static fd_ext_descriptor						\
+	__attribute__((used, section(FD_EXT_STR(FD_EXT_REGISTRY)), aligned(sizeof(void *)))) = {	\
+	_name, fd_ext_depends, fd_ext_services, FD_EXT_NOTE_VERSION, fd_ext_init, fd_ext_fini,	\
+	fd_ext_thread_init, fd_ext_thread_fini, fd_ext_hook_batch };
+#else /* FD_EXT_STATIC */
+#define FD_EXT_ENTRY_HEAD(_name, _depends...)							\
+FD_EXT_MANIFEST(_name , ## _depends);								\
+FD_EXT_EXPORT const char *fd_ext_depends[] = { _name , ## _depends , NULL };
+#endif /* FD_EXT_STATIC */
+
 /* Macro that define the entry point of the extension */
 #define EXTENSION_ENTRY(_name, _function, _depends...)					\
-const char *fd_ext_depends[] = { _name , ## _depends , NULL };				\
+FD_EXT_ENTRY_HEAD(_name , ## _depends)							\
 static int extension_loaded = 0;							\
-int fd_ext_init(int major, int minor, struct fd_ext_arg * args) {			\
+FD_EXT_EXPORT int fd_ext_init(int major, int minor, struct fd_ext_arg * args) {		\
 	if ((major != FD_PROJECT_VERSION_MAJOR)						\
 		|| (minor != FD_PROJECT_VERSION_MINOR)) {				\
 		return EINVAL;								\
@@ -66,6 +329,46 @@ int fd_ext_init(int major, int minor, struct fd_ext_arg * args) {			\
 	return (_function)(args);							\
 }
 
+/* Functions of the daemon the extensions call, resolved at dlopen() time (see extension.exports) */
+
+/* Threads calling into the extensions do it inside a read-side section */
+void fd_ext_rcu_read_lock(void);
+void fd_ext_rcu_read_unlock(void);
+void fd_ext_rcu_synchronize(void);
+
+/* Call the hooks registered for the point and the message, returns the verdict of the last one called */
+int fd_ext_msg_parse(struct fd_ext_msg *msg, uint8_t *data, size_t len);
+int fd_ext_hook_dispatch(enum fd_ext_hook_point point, struct fd_ext_msg *msg);
+/* Same for count messages, verdicts[i] is the verdict on msgs[i]; returns the number of messages not left to FD_EXT_HOOK_CONTINUE */
+int fd_ext_hook_dispatch_batch(enum fd_ext_hook_point point, struct fd_ext_msg **msgs, int *verdicts, unsigned count);
+
+/* The message was processed: free the memory the hooks allocated for it with msg_alloc */
+void fd_ext_msg_release(struct fd_ext_msg *msg);
+
+/* Statistics of an extension, the calls are those of its hooks */
+#define FD_EXT_STATS_BUCKETS	32
+struct fd_ext_stats {
+	uint64_t	open_ns;	/* dlopen and symbols resolution */
+	uint64_t	init_ns;	/* fd_ext_init */
+	uint64_t	fini_ns;	/* fd_ext_fini, of the last copy finalized */
+	int		state;		/* enum fd_ext_state */
+	uint64_t	ready_ns;	/* from the call of fd_ext_init to the readiness */
+	unsigned	reloads;
+	uint64_t	calls;
+	uint64_t	call_ns;	/* total time spent in the calls */
+	uint64_t	hist[FD_EXT_STATS_BUCKETS];	/* calls which took [2^i, 2^(i+1)) ns */
+	int64_t		mem_live;	/* bytes allocated through fd_ext_alloc and not freed yet */
+	int64_t		mem_peak;
+	uint64_t	mem_limit;	/* soft limit, 0 if none */
+	unsigned	mem_limit_hits;	/* times the limit was exceeded */
+	uint64_t	mem_allocs;	/* mem_alloc and msg_alloc calls, the last ones of each running thread not counted yet */
+	uint64_t	oop_calls;	/* messages passed to the helper, when hosted out of process */
+	uint64_t	oop_rtt_ns;	/* total time until their verdicts */
+	unsigned	oop_depth_peak;	/* most requests in flight on a channel */
+	uint64_t	sessions;	/* entries in the session store, their memory is in mem_live */
+};
+int fd_ext_stats_get(const char *name, struct fd_ext_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -73,5 +376,59 @@ int fd_ext_init(int major, int minor, struct fd_ext_arg * args) {			\
 int fd_ext_initialize(void *pParam);
 int fd_ext_term(void);
 int fd_ext_load();
+int fd_ext_critical_path(char *buf, size_t len);
+/* Times of the fd_ext_fini of the last fd_ext_term, in the order they returned, "abandoned" past FiniTimeout */
+int fd_ext_fini_report(char *buf, size_t len);
+int fd_ext_reload(const char *name);
+
+/* Readiness of an extension */
+enum fd_ext_state {
+	FD_EXT_STATE_LOADING = 0,	/* fd_ext_init not called yet, or running */
+	FD_EXT_STATE_PENDING,		/* fd_ext_init returned FD_EXT_PENDING */
+	FD_EXT_STATE_READY,
+	FD_EXT_STATE_FAILED,		/* it, or one of its dependencies, failed to initialize */
+	FD_EXT_STATE_IDLE		/* loaded on demand, no message it serves arrived yet */
+};
+
+/* Call cb once (from any thread) when an extension which was not ready becomes ready or fails; EALREADY if none is pending */
+int fd_ext_on_ready(void (*cb)(void *data), void *data);
+
+/* Worker threads call these at startup and before they exit to create and release their contexts in the
+ * extensions; otherwise it is done on their first call into each extension, and when they exit */
+int fd_ext_thread_attach(void);
+void fd_ext_thread_detach(void);
+
+/* Resolve the declared dictionary objects again, after the daemon added some */
+void fd_ext_dict_refresh(void);
+
+int fd_ext_stats_dump(const char *path);
+int fd_ext_stats_signal(int signo, const char *path);
+
+/* Soft limit of the memory an extension allocates through fd_ext_alloc, 0 removes it */
+int fd_ext_mem_limit(const char *name, size_t bytes);
+
+/* Sampling profiler of the CPU time of the extensions (SIGPROF, hz samples per second of CPU): the report lists
+ * the share of each extension, then its stacks, folded. The signal variant profiles for seconds on each signo. */
+int fd_ext_profile_start(unsigned hz);
+int fd_ext_profile_stop(const char *path);
+int fd_ext_profile_signal(int signo, const char *path, unsigned seconds);
+
+/* Write the messages received into path (at most max, 0 for no limit), to replay them with fdreplay; NULL stops */
+int fd_ext_capture(const char *path, unsigned long max);
+
+/* Text of the extensions moved onto huge pages, see fd_ext_huge_text */
+struct fd_ext_huge_report {
+	unsigned	segments;		/* executable segments of the extensions selected */
+	unsigned	small_pages_before;	/* 4K pages of their text */
+	unsigned	small_pages_after;
+	unsigned	huge_pages;		/* 2M pages backing it now */
+	int		status;			/* 0, or why a part was left on small pages (ENOTSUP: no transparent huge pages) */
+};
+/* Remap the text of the extensions named ("all", or "name,...") onto huge pages where it spans aligned 2M ranges;
+ * done by fd_ext_load when HugeText is set in extensions.cfg, before the first message is dispatched */
+int fd_ext_huge_text(const char *names, struct fd_ext_huge_report *report);
+
+/* main() of fdx_host, the helper process of the extensions listed in [OutOfProcess] of extensions.cfg */
+int fd_ext_oop_main(int argc, char **argv);
 
 #endif /* _EXTENSION_H */
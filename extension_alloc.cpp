@@ -0,0 +1,458 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Memory service of the extensions.
+ *
+ * The blocks come from per-thread free lists of a few size classes, refilled and drained
+ * in batches through a global depot, so that the messages path does not go to the global
+ * malloc. The memory a hook needs only while a message is processed is taken from an arena
+ * attached to the message, released in a single step by fd_ext_msg_release.
+ *
+ * Every block and arena allocation is charged to the extension which requested it. Each
+ * thread accumulates its charges and folds them into the totals of the extension once they
+ * exceed ALLOC_FLUSH bytes, the live bytes are therefore exact within ALLOC_FLUSH per thread,
+ * which is also the precision of the soft limits.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <mutex>
+#include <vector>
+#include <atomic>
+
+#include "extension_internal.h"
+
+/* Size classes of the pools: 16 << c bytes, larger blocks go to malloc */
+#define ALLOC_CLASSES	9
+#define ALLOC_LARGE	ALLOC_CLASSES
+#define ALLOC_SLAB	65536		/* carved into blocks of one class */
+#define ALLOC_BATCH	64		/* blocks moved between a thread and the depot at once */
+#define ALLOC_FLUSH	32768		/* bytes charged by a thread before the totals are updated */
+#define ALLOC_COUNT	256		/* allocations counted by a thread before the totals are updated */
+
+/* Arenas of the messages */
+#define ARENA_CHUNK	8192
+#define ARENA_CACHE	16		/* free chunks kept by a thread */
+#define ARENA_ACCT	8		/* extensions accounted in the first chunk */
+
+/* In front of each block, keeps the payload 16 bytes aligned */
+struct alloc_hdr {
+	uint32_t	idx;		/* extension charged */
+	uint32_t	cls;		/* size class, or ALLOC_LARGE */
+	uint64_t	size;		/* charged bytes */
+};
+
+/* A free block, the link is stored in the payload */
+struct alloc_free {
+	struct alloc_hdr	hdr;
+	struct alloc_free	*next;
+};
+
+struct arena_chunk {
+	struct arena_chunk	*next;
+	size_t			size;		/* usable bytes after this header */
+} __attribute__((aligned(16)));
+
+struct arena_acct {
+	uint32_t	idx;
+	uint64_t	bytes;
+};
+
+/* At the start of the first chunk of a message */
+struct fd_ext_arena {
+	struct arena_chunk	*chunks;
+	char			*cur;
+	char			*end;
+	struct arena_acct	*acct;		/* grows inside the arena when more extensions use it */
+	unsigned		nacct;
+	unsigned		cap;
+	struct arena_acct	first[ARENA_ACCT];
+};
+
+/* Totals of an extension, one cache line each */
+struct alloc_ext {
+	std::atomic<int64_t>	live;
+	std::atomic<int64_t>	peak;
+	std::atomic<uint64_t>	limit;		/* 0: none */
+	std::atomic<unsigned>	limit_hits;
+	std::atomic<int>	over;		/* allocations fail while the limit is exceeded */
+	std::atomic<uint64_t>	allocs;		/* blocks and message allocations */
+} __attribute__((aligned(64)));
+
+/* Per-thread caches, given back when the thread exits */
+struct alloc_cache {
+	struct alloc_free	*head[ALLOC_CLASSES];
+	unsigned		count[ALLOC_CLASSES];
+	struct arena_chunk	*chunks;
+	unsigned		nchunks;
+	int64_t			delta[EXT_MAX];
+	uint32_t		allocs[EXT_MAX];
+	~alloc_cache();
+};
+
+static struct alloc_ext alloc_exts[EXT_MAX];
+static std::mutex alloc_lock;		/* protects the depot */
+static std::vector<struct alloc_free*> alloc_depot[ALLOC_CLASSES];	/* batches of ALLOC_BATCH blocks */
+static thread_local struct alloc_cache alloc_me;
+
+static inline size_t alloc_class_size(unsigned cls)
+{
+	return (size_t)16 << cls;
+}
+
+/* Fold the charges of the thread into the totals of the extension, and check its limit */
+static void alloc_flush(unsigned idx)
+{
+	struct alloc_ext * e = &alloc_exts[idx];
+	int64_t live, peak;
+	uint64_t limit;
+
+	live = e->live.fetch_add(alloc_me.delta[idx], std::memory_order_relaxed) + alloc_me.delta[idx];
+	alloc_me.delta[idx] = 0;
+	peak = e->peak.load(std::memory_order_relaxed);
+	while (live > peak && !e->peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+		;
+	limit = e->limit.load(std::memory_order_relaxed);
+	if (limit && live > (int64_t)limit) {
+		if (!e->over.exchange(1, std::memory_order_relaxed)) {
+			e->limit_hits.fetch_add(1, std::memory_order_relaxed);
+			//LOG_E("Extension #%u uses %lld bytes, above its limit of %llu", idx, (long long)live, (unsigned long long)limit);
+		}
+	} else if (e->over.load(std::memory_order_relaxed)) {
+		e->over.store(0, std::memory_order_relaxed);
+	}
+}
+
+static inline void alloc_charge(unsigned idx, int64_t bytes)
+{
+	int64_t d = alloc_me.delta[idx] += bytes;
+	if (d >= ALLOC_FLUSH || d <= -ALLOC_FLUSH)
+		alloc_flush(idx);
+}
+
+/* One more allocation by the extension, counted apart from the bytes which may cancel out */
+static inline void alloc_count(unsigned idx)
+{
+	if (++alloc_me.allocs[idx] == ALLOC_COUNT) {
+		alloc_exts[idx].allocs.fetch_add(ALLOC_COUNT, std::memory_order_relaxed);
+		alloc_me.allocs[idx] = 0;
+	}
+}
+
+alloc_cache::~alloc_cache()
+{
+	std::lock_guard<std::mutex> lock(alloc_lock);
+
+	for (unsigned c = 0; c < ALLOC_CLASSES; c++) {
+		/* the depot takes lists of any length back */
+		if (head[c])
+			alloc_depot[c].push_back(head[c]);
+		head[c] = NULL;
+		count[c] = 0;
+	}
+	while (chunks) {
+		struct arena_chunk * next = chunks->next;
+		free(chunks);
+		chunks = next;
+	}
+	for (unsigned i = 0; i < EXT_MAX; i++) {
+		if (delta[i])
+			alloc_flush(i);
+		if (allocs[i])
+			alloc_exts[i].allocs.fetch_add(allocs[i], std::memory_order_relaxed);
+		allocs[i] = 0;
+	}
+}
+
+/* Give the thread a batch of blocks of the class */
+static int alloc_refill(unsigned cls)
+{
+	size_t bsize = sizeof(struct alloc_hdr) + alloc_class_size(cls);
+	struct alloc_free * list = NULL, * b;
+	unsigned n = 0;
+	char * slab;
+
+	{
+		std::lock_guard<std::mutex> lock(alloc_lock);
+		if (!alloc_depot[cls].empty()) {
+			list = alloc_depot[cls].back();
+			alloc_depot[cls].pop_back();
+		}
+	}
+	if (list) {
+		for (b = list; b; b = b->next)
+			n++;
+	} else {
+		slab = (char *)malloc(ALLOC_SLAB);
+		if (slab == NULL)
+			return ENOMEM;
+		/* the slabs stay in the pools until the process exits */
+		for (size_t off = 0; off + bsize <= ALLOC_SLAB; off += bsize) {
+			b = (struct alloc_free *)(slab + off);
+			b->hdr.cls = cls;
+			b->next = list;
+			list = b;
+			n++;
+		}
+	}
+	alloc_me.head[cls] = list;
+	alloc_me.count[cls] = n;
+	return 0;
+}
+
+/* Too many free blocks in the thread, move a batch to the depot */
+static void alloc_drain(unsigned cls)
+{
+	struct alloc_free * list = alloc_me.head[cls], * b = list;
+
+	for (unsigned i = 1; i < ALLOC_BATCH; i++)
+		b = b->next;
+	alloc_me.head[cls] = b->next;
+	alloc_me.count[cls] -= ALLOC_BATCH;
+	b->next = NULL;
+
+	std::lock_guard<std::mutex> lock(alloc_lock);
+	alloc_depot[cls].push_back(list);
+}
+
+static void * mem_alloc(struct fd_ext_arg *self, size_t size)
+{
+	unsigned idx = ext_inst_of(self)->ext->idx;
+	struct alloc_free * b;
+	unsigned cls;
+
+	if (alloc_exts[idx].over.load(std::memory_order_relaxed))
+		return NULL;
+
+	cls = size <= 16 ? 0 : 64 - __builtin_clzll(size - 1) - 4;
+	if (cls >= ALLOC_CLASSES) {
+		struct alloc_hdr * h = (struct alloc_hdr *)malloc(sizeof(*h) + size);
+		if (h == NULL)
+			return NULL;
+		h->idx = idx;
+		h->cls = ALLOC_LARGE;
+		h->size = size;
+		alloc_charge(idx, size);
+		alloc_count(idx);
+		return h + 1;
+	}
+
+	if (alloc_me.head[cls] == NULL && alloc_refill(cls))
+		return NULL;
+	b = alloc_me.head[cls];
+	alloc_me.head[cls] = b->next;
+	alloc_me.count[cls]--;
+	b->hdr.idx = idx;
+	b->hdr.size = alloc_class_size(cls);
+	alloc_charge(idx, b->hdr.size);
+	alloc_count(idx);
+	return &b->hdr + 1;
+}
+
+/* Any thread may free the block, it joins the pool of that thread */
+static void mem_free(void *ptr)
+{
+	struct alloc_free * b;
+
+	if (ptr == NULL)
+		return;
+	b = (struct alloc_free *)((struct alloc_hdr *)ptr - 1);
+	alloc_charge(b->hdr.idx, -(int64_t)b->hdr.size);
+	if (b->hdr.cls == ALLOC_LARGE) {
+		free(b);
+		return;
+	}
+	b->next = alloc_me.head[b->hdr.cls];
+	alloc_me.head[b->hdr.cls] = b;
+	if (++alloc_me.count[b->hdr.cls] >= 2 * ALLOC_BATCH)
+		alloc_drain(b->hdr.cls);
+}
+
+static struct arena_chunk * arena_chunk_get(size_t size)
+{
+	struct arena_chunk * c;
+
+	if (size <= ARENA_CHUNK - sizeof(*c) && alloc_me.chunks) {
+		c = alloc_me.chunks;
+		alloc_me.chunks = c->next;
+		alloc_me.nchunks--;
+		return c;
+	}
+	if (size < ARENA_CHUNK - sizeof(*c))
+		size = ARENA_CHUNK - sizeof(*c);
+	c = (struct arena_chunk *)malloc(sizeof(*c) + size);
+	if (c)
+		c->size = size;
+	return c;
+}
+
+static void arena_chunk_put(struct arena_chunk * c)
+{
+	if (c->size == ARENA_CHUNK - sizeof(*c) && alloc_me.nchunks < ARENA_CACHE) {
+		c->next = alloc_me.chunks;
+		alloc_me.chunks = c;
+		alloc_me.nchunks++;
+		return;
+	}
+	free(c);
+}
+
+/* Bump allocation in the arena, without accounting */
+static void * arena_take(struct fd_ext_arena * a, size_t size)
+{
+	struct arena_chunk * c;
+	void * p;
+
+	size = (size + 15) & ~(size_t)15;
+	if ((size_t)(a->end - a->cur) < size) {
+		c = arena_chunk_get(size);
+		if (c == NULL)
+			return NULL;
+		c->next = a->chunks->next;	/* the first chunk stays first, it holds the arena */
+		a->chunks->next = c;
+		a->cur = (char *)(c + 1);
+		a->end = a->cur + c->size;
+	}
+	p = a->cur;
+	a->cur += size;
+	return p;
+}
+
+static void * msg_alloc(struct fd_ext_arg *self, struct fd_ext_msg *msg, size_t size)
+{
+	unsigned idx = ext_inst_of(self)->ext->idx;
+	struct fd_ext_arena * a = msg->arena;
+	struct arena_acct * acct;
+	unsigned i;
+	void * p;
+
+	if (alloc_exts[idx].over.load(std::memory_order_relaxed))
+		return NULL;
+
+	if (a == NULL) {
+		struct arena_chunk * c = arena_chunk_get(0);
+		if (c == NULL)
+			return NULL;
+		c->next = NULL;
+		a = (struct fd_ext_arena *)(c + 1);
+		a->chunks = c;
+		a->cur = (char *)a + ((sizeof(*a) + 15) & ~(size_t)15);
+		a->end = (char *)(c + 1) + c->size;
+		a->acct = a->first;
+		a->nacct = 0;
+		a->cap = ARENA_ACCT;
+		msg->arena = a;
+	}
+
+	for (i = 0; i < a->nacct && a->acct[i].idx != idx; i++)
+		;
+	if (i == a->nacct) {
+		if (a->nacct == a->cap) {
+			acct = (struct arena_acct *)arena_take(a, 2 * a->cap * sizeof(*acct));
+			if (acct == NULL)
+				return NULL;
+			memcpy(acct, a->acct, a->nacct * sizeof(*acct));
+			a->acct = acct;
+			a->cap *= 2;
+		}
+		a->acct[i].idx = idx;
+		a->acct[i].bytes = 0;
+		a->nacct++;
+	}
+
+	p = arena_take(a, size);
+	if (p == NULL)
+		return NULL;
+	a->acct[i].bytes += size;
+	alloc_charge(idx, size);
+	alloc_count(idx);
+	return p;
+}
+
+const struct fd_ext_alloc ext_alloc_ops = {
+	mem_alloc,
+	mem_free,
+	msg_alloc
+};
+
+/* The message was processed, free what the hooks allocated for it */
+void fd_ext_msg_release(struct fd_ext_msg *msg)
+{
+	struct fd_ext_arena * a = msg->arena;
+	struct arena_chunk * c, * next;
+
+	if (a == NULL)
+		return;
+	msg->arena = NULL;
+	for (unsigned i = 0; i < a->nacct; i++)
+		alloc_charge(a->acct[i].idx, -(int64_t)a->acct[i].bytes);
+	for (c = a->chunks; c; c = next) {
+		next = c->next;
+		arena_chunk_put(c);
+	}
+}
+
+void ext_alloc_limit(unsigned idx, uint64_t bytes)
+{
+	alloc_exts[idx].limit.store(bytes, std::memory_order_relaxed);
+	if (bytes == 0)
+		alloc_exts[idx].over.store(0, std::memory_order_relaxed);
+}
+
+/* Soft limit of the memory of an extension, 0 removes it */
+int fd_ext_mem_limit(const char *name, size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(ext_list_lock);
+
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+		if ((*li)->ext_name && !strcasecmp((*li)->ext_name, name)) {
+			ext_alloc_limit((*li)->idx, bytes);
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+void ext_alloc_stats(unsigned idx, struct fd_ext_stats * stats)
+{
+	struct alloc_ext * e = &alloc_exts[idx];
+
+	stats->mem_live = e->live.load(std::memory_order_relaxed);
+	stats->mem_peak = e->peak.load(std::memory_order_relaxed);
+	stats->mem_limit = e->limit.load(std::memory_order_relaxed);
+	stats->mem_limit_hits = e->limit_hits.load(std::memory_order_relaxed);
+	stats->mem_allocs = e->allocs.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,85 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Capture of the messages received, for fdreplay.
+ *
+ * fd_ext_capture(path, max) appends each message passed to the hooks of
+ * FD_EXT_HOOK_MSG_RECEIVED to the file, as it was encoded, the messages following each
+ * other: the format fdreplay reads besides pcap. While no capture runs, the dispatch only
+ * tests a flag.
+ */
+
+#include <stdio.h>
+#include <mutex>
+
+#include "extension_internal.h"
+
+std::atomic<int> ext_capture_on(0);
+static std::mutex capture_lock;
+static FILE * capture_file;
+static unsigned long capture_left;	/* messages still to write, 0 for no limit */
+
+void ext_capture_record(struct fd_ext_msg * msg)
+{
+	std::lock_guard<std::mutex> lock(capture_lock);
+
+	if (capture_file == NULL || msg->data == NULL || msg->len < 20)
+		return;
+	if (fwrite(msg->data, msg->len, 1, capture_file) != 1 || (capture_left && --capture_left == 0)) {
+		ext_capture_on.store(0, std::memory_order_relaxed);
+		fclose(capture_file);
+		capture_file = NULL;
+	}
+}
+
+/* Start writing the messages received into path, at most max of them if not 0; NULL stops */
+int fd_ext_capture(const char *path, unsigned long max)
+{
+	std::lock_guard<std::mutex> lock(capture_lock);
+
+	ext_capture_on.store(0, std::memory_order_relaxed);
+	if (capture_file != NULL)
+		fclose(capture_file);
+	capture_file = NULL;
+	if (path == NULL)
+		return 0;
+	capture_file = fopen(path, "we");
+	if (capture_file == NULL)
+		return errno;
+	setvbuf(capture_file, NULL, _IOFBF, 1 << 20);
+	capture_left = max;
+	ext_capture_on.store(1, std::memory_order_relaxed);
+	return 0;
+}
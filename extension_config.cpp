@@ -0,0 +1,624 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Configuration service of the extensions.
+ *
+ * The .cfg file of an extension (INI syntax: [section], key = value, lines starting
+ * with # or ; are comments) is mapped and parsed once, on its first access, into an
+ * index of views on the mapping: nothing is copied, and the values which read as an
+ * integer, a number or a boolean are converted at the same time. Sections and keys
+ * are case-insensitive, the last occurrence of a key wins.
+ *
+ * An extension calling cfg_watch has its file watched with inotify; when it is
+ * replaced, the new content is parsed and published, and the callback receives the
+ * keys whose value changed, was added or removed. The previous mapping is released
+ * after a grace period. Files must be replaced (written aside then renamed) and not
+ * rewritten in place, which would change a mapping still in use.
+ *
+ * The same parser reads extensions.cfg in fd_ext_initialize.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <new>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <system_error>
+
+#include "extension_internal.h"
+
+/* Conversions done at parse time */
+#define CFG_INT		0x1
+#define CFG_DOUBLE	0x2
+#define CFG_BOOL	0x4
+
+struct cfg_entry {
+	struct fd_ext_cfg_view	section;
+	struct fd_ext_cfg_view	key;
+	struct fd_ext_cfg_view	value;
+	uint32_t		hash;
+	unsigned		types;
+	long long		ival;
+	double			dval;
+	int			bval;
+};
+
+/* A parsed file, immutable once published */
+struct ext_cfg {
+	void				*map;
+	size_t				size;
+	std::vector<struct cfg_entry>	entries;	/* sorted by section and key */
+	std::vector<uint32_t>		table;		/* open addressing on the hash, index + 1, 0 is free */
+};
+
+/* A watched file */
+struct cfg_watch {
+	struct fd_ext_inst	*inst;
+	int			wd;		/* of its directory */
+	std::string		name;		/* in the directory */
+	fd_ext_cfg_cb		cb;
+	void			*data;
+};
+
+static std::mutex cfg_lock;		/* first parse, watches, and serializes the callbacks with ext_config_release */
+static std::vector<struct cfg_watch> cfg_watches;
+static std::thread cfg_thread;
+static int cfg_inotify = -1;
+static int cfg_stop = -1;		/* eventfd waking the watcher to exit */
+
+static inline int cfg_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static struct fd_ext_cfg_view cfg_trim(const char * b, const char * e)
+{
+	struct fd_ext_cfg_view v;
+
+	while (b < e && cfg_space(*b))
+		b++;
+	while (e > b && cfg_space(e[-1]))
+		e--;
+	v.ptr = b;
+	v.len = e - b;
+	return v;
+}
+
+/* FNV-1a on the lowercase section and key */
+static uint32_t cfg_hash_add(uint32_t h, const char * s, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)tolower((unsigned char)s[i]);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint32_t cfg_hash(const char * section, size_t slen, const char * key, size_t klen)
+{
+	uint32_t h = cfg_hash_add(2166136261u, section, slen);
+	h = (h ^ 0xff) * 16777619u;
+	return cfg_hash_add(h, key, klen);
+}
+
+static int cfg_view_cmp(const struct fd_ext_cfg_view & a, const struct fd_ext_cfg_view & b)
+{
+	int c = strncasecmp(a.ptr, b.ptr, std::min(a.len, b.len));
+	return c ? c : (a.len > b.len) - (a.len < b.len);
+}
+
+static int cfg_entry_cmp(const struct cfg_entry & a, const struct cfg_entry & b)
+{
+	int c = cfg_view_cmp(a.section, b.section);
+	return c ? c : cfg_view_cmp(a.key, b.key);
+}
+
+static bool cfg_same_value(const struct fd_ext_cfg_view & a, const struct fd_ext_cfg_view & b)
+{
+	return a.len == b.len && !memcmp(a.ptr, b.ptr, a.len);
+}
+
+/* Convert the value once, numbers are short enough for the stack */
+static void cfg_convert(struct cfg_entry * e)
+{
+	char buf[64], * end;
+
+	if (e->value.len == 0 || e->value.len >= sizeof(buf))
+		return;
+	memcpy(buf, e->value.ptr, e->value.len);
+	buf[e->value.len] = '\0';
+
+	errno = 0;
+	e->ival = strtoll(buf, &end, 0);
+	if (*end == '\0' && errno == 0)
+		e->types |= CFG_INT;
+	e->dval = strtod(buf, &end);
+	if (*end == '\0')
+		e->types |= CFG_DOUBLE;
+	if (!strcasecmp(buf, "true") || !strcasecmp(buf, "yes") || !strcasecmp(buf, "on") || !strcmp(buf, "1")) {
+		e->bval = 1;
+		e->types |= CFG_BOOL;
+	} else if (!strcasecmp(buf, "false") || !strcasecmp(buf, "no") || !strcasecmp(buf, "off") || !strcmp(buf, "0")) {
+		e->bval = 0;
+		e->types |= CFG_BOOL;
+	}
+}
+
+static void cfg_parse(struct ext_cfg * cfg)
+{
+	const char * p = (const char *)cfg->map, * end = p + cfg->size;
+	struct fd_ext_cfg_view section = { "", 0 };
+	size_t n, i, slots;
+
+	while (p < end) {
+		const char * eol = (const char *)memchr(p, '\n', end - p);
+		struct fd_ext_cfg_view line;
+		const char * eq;
+
+		if (eol == NULL)
+			eol = end;
+		line = cfg_trim(p, eol);
+		p = eol + 1;
+		if (line.len == 0 || line.ptr[0] == '#' || line.ptr[0] == ';')
+			continue;
+		if (line.ptr[0] == '[') {
+			const char * close = (const char *)memchr(line.ptr, ']', line.len);
+			if (close)
+				section = cfg_trim(line.ptr + 1, close);
+			continue;
+		}
+		eq = (const char *)memchr(line.ptr, '=', line.len);
+		if (eq == NULL)
+			continue;
+
+		struct cfg_entry e = cfg_entry();
+		e.section = section;
+		e.key = cfg_trim(line.ptr, eq);
+		e.value = cfg_trim(eq + 1, line.ptr + line.len);
+		if (e.value.len >= 2 && (e.value.ptr[0] == '"' || e.value.ptr[0] == '\'')
+				&& e.value.ptr[e.value.len - 1] == e.value.ptr[0]) {
+			e.value.ptr++;
+			e.value.len -= 2;
+		}
+		e.hash = cfg_hash(e.section.ptr, e.section.len, e.key.ptr, e.key.len);
+		cfg_convert(&e);
+		cfg->entries.push_back(e);
+	}
+
+	/* the last occurrence of a key wins */
+	std::stable_sort(cfg->entries.begin(), cfg->entries.end(),
+		[](const struct cfg_entry & a, const struct cfg_entry & b) { return cfg_entry_cmp(a, b) < 0; });
+	for (i = 0, n = 0; i < cfg->entries.size(); i++) {
+		if (n && !cfg_entry_cmp(cfg->entries[n - 1], cfg->entries[i]))
+			n--;
+		cfg->entries[n++] = cfg->entries[i];
+	}
+	cfg->entries.resize(n);
+
+	for (slots = 8; slots < 2 * n; slots *= 2)
+		;
+	cfg->table.assign(slots, 0);
+	for (i = 0; i < n; i++) {
+		size_t s = cfg->entries[i].hash & (slots - 1);
+		while (cfg->table[s])
+			s = (s + 1) & (slots - 1);
+		cfg->table[s] = i + 1;
+	}
+}
+
+/* Map and parse the file; a missing or empty file gives an empty configuration, NULL means out of memory */
+struct ext_cfg * ext_cfg_open(const char * path)
+{
+	struct ext_cfg * cfg = new(std::nothrow) ext_cfg();
+	struct stat st;
+	int fd;
+
+	if (cfg == NULL)
+		return NULL;
+	cfg->map = NULL;
+	cfg->size = 0;
+	if (path && (fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED) {
+				cfg->map = map;
+				cfg->size = st.st_size;
+			}
+		}
+		close(fd);
+	}
+	try {
+		cfg_parse(cfg);
+	} catch (std::bad_alloc &) {
+		ext_cfg_close(cfg);
+		return NULL;
+	}
+	return cfg;
+}
+
+void ext_cfg_close(struct ext_cfg * cfg)
+{
+	if (cfg == NULL)
+		return;
+	if (cfg->map)
+		munmap(cfg->map, cfg->size);
+	delete cfg;
+}
+
+static const struct cfg_entry * cfg_lookup(const struct ext_cfg * cfg, const char * section, const char * key)
+{
+	size_t slen, klen, mask = cfg->table.size() - 1;
+	uint32_t h;
+
+	if (section == NULL)
+		section = "";
+	if (key == NULL)
+		return NULL;
+	slen = strlen(section);
+	klen = strlen(key);
+	h = cfg_hash(section, slen, key, klen);
+	for (size_t s = h & mask; cfg->table[s]; s = (s + 1) & mask) {
+		const struct cfg_entry * e = &cfg->entries[cfg->table[s] - 1];
+		if (e->hash == h && e->section.len == slen && e->key.len == klen
+				&& !strncasecmp(e->section.ptr, section, slen) && !strncasecmp(e->key.ptr, key, klen))
+			return e;
+	}
+	return NULL;
+}
+
+int ext_cfg_find(struct ext_cfg * cfg, const char * section, const char * key, struct fd_ext_cfg_view * value)
+{
+	const struct cfg_entry * e = cfg_lookup(cfg, section, key);
+
+	if (e == NULL)
+		return ENOENT;
+	*value = e->value;
+	return 0;
+}
+
+/* Items of a list, trimmed, the empty ones skipped */
+void ext_cfg_split(struct fd_ext_cfg_view value, char delim, std::vector<struct fd_ext_cfg_view> & items)
+{
+	const char * p = value.ptr, * end = value.ptr + value.len;
+
+	while (p < end) {
+		const char * next = (const char *)memchr(p, delim, end - p);
+		struct fd_ext_cfg_view item = cfg_trim(p, next ? next : end);
+		if (item.len)
+			items.push_back(item);
+		p = next ? next + 1 : end;
+	}
+}
+
+/* The file of the copy, parsed on the first access */
+static struct ext_cfg * cfg_of(struct fd_ext_arg * self)
+{
+	struct fd_ext_inst * inst = ext_inst_of(self);
+	struct ext_cfg * cfg = inst->cfg.load(std::memory_order_acquire);
+
+	if (cfg == NULL) {
+		std::lock_guard<std::mutex> lock(cfg_lock);
+		cfg = inst->cfg.load(std::memory_order_relaxed);
+		if (cfg == NULL) {
+			cfg = ext_cfg_open(self->conffile);
+			inst->cfg.store(cfg, std::memory_order_release);
+		}
+	}
+	return cfg;
+}
+
+static const struct cfg_entry * cfg_get_entry(struct fd_ext_arg * self, const char * section, const char * key)
+{
+	struct ext_cfg * cfg = cfg_of(self);
+
+	return cfg ? cfg_lookup(cfg, section, key) : NULL;
+}
+
+static int cfg_get(struct fd_ext_arg * self, const char * section, const char * key, struct fd_ext_cfg_view * value)
+{
+	const struct cfg_entry * e = cfg_get_entry(self, section, key);
+
+	if (e == NULL)
+		return ENOENT;
+	*value = e->value;
+	return 0;
+}
+
+static int cfg_get_int(struct fd_ext_arg * self, const char * section, const char * key, long long * value)
+{
+	const struct cfg_entry * e = cfg_get_entry(self, section, key);
+
+	if (e == NULL)
+		return ENOENT;
+	if (!(e->types & CFG_INT))
+		return EINVAL;
+	*value = e->ival;
+	return 0;
+}
+
+static int cfg_get_double(struct fd_ext_arg * self, const char * section, const char * key, double * value)
+{
+	const struct cfg_entry * e = cfg_get_entry(self, section, key);
+
+	if (e == NULL)
+		return ENOENT;
+	if (!(e->types & CFG_DOUBLE))
+		return EINVAL;
+	*value = e->dval;
+	return 0;
+}
+
+static int cfg_get_bool(struct fd_ext_arg * self, const char * section, const char * key, int * value)
+{
+	const struct cfg_entry * e = cfg_get_entry(self, section, key);
+
+	if (e == NULL)
+		return ENOENT;
+	if (!(e->types & CFG_BOOL))
+		return EINVAL;
+	*value = e->bval;
+	return 0;
+}
+
+/* Keys of the new file which differ from the old one, both sorted */
+static void cfg_diff(const struct ext_cfg * o, const struct ext_cfg * n, std::vector<struct fd_ext_cfg_change> & changes)
+{
+	size_t i = 0, j = 0;
+
+	while (i < o->entries.size() || j < n->entries.size()) {
+		struct fd_ext_cfg_change c;
+		int cmp;
+
+		if (i == o->entries.size())
+			cmp = 1;
+		else if (j == n->entries.size())
+			cmp = -1;
+		else
+			cmp = cfg_entry_cmp(o->entries[i], n->entries[j]);
+
+		memset(&c, 0, sizeof(c));
+		if (cmp < 0) {
+			/* removed */
+			c.section = o->entries[i].section;
+			c.key = o->entries[i].key;
+			c.old = o->entries[i++].value;
+		} else if (cmp > 0) {
+			/* added */
+			c.section = n->entries[j].section;
+			c.key = n->entries[j].key;
+			c.value = n->entries[j++].value;
+		} else {
+			if (cfg_same_value(o->entries[i].value, n->entries[j].value)) {
+				i++;
+				j++;
+				continue;
+			}
+			c.section = n->entries[j].section;
+			c.key = n->entries[j].key;
+			c.value = n->entries[j++].value;
+			c.old = o->entries[i++].value;
+		}
+		changes.push_back(c);
+	}
+}
+
+static void cfg_release(void * data)
+{
+	ext_cfg_close((struct ext_cfg *)data);
+}
+
+/* The file of a watch was replaced, the previous one is returned for release. Called with cfg_lock held. */
+static struct ext_cfg * cfg_reload(struct cfg_watch * w)
+{
+	struct fd_ext_inst * inst = w->inst;
+	struct ext_cfg * cfg = ext_cfg_open(inst->args.conffile), * old;
+	std::vector<struct fd_ext_cfg_change> changes;
+
+	if (cfg == NULL)
+		return NULL;
+	old = inst->cfg.exchange(cfg, std::memory_order_acq_rel);
+	if (old)
+		cfg_diff(old, cfg, changes);
+	if (!changes.empty())
+		(*w->cb)(&inst->args, changes.data(), changes.size(), w->data);
+	return old;
+}
+
+static void cfg_watcher(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2];
+
+	fds[0].fd = cfg_inotify;
+	fds[0].events = POLLIN;
+	fds[1].fd = cfg_stop;
+	fds[1].events = POLLIN;
+	for (;;) {
+		std::vector<struct ext_cfg *> old;
+		ssize_t len;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if (fds[1].revents)
+			return;
+		len = read(cfg_inotify, buf, sizeof(buf));
+		if (len <= 0)
+			continue;
+
+		{
+			std::lock_guard<std::mutex> lock(cfg_lock);
+			for (char * p = buf; p < buf + len; ) {
+				struct inotify_event * ev = (struct inotify_event *)p;
+				p += sizeof(struct inotify_event) + ev->len;
+				if (ev->len == 0)
+					continue;
+				for (size_t i = 0; i < cfg_watches.size(); i++) {
+					struct ext_cfg * cfg;
+					if (cfg_watches[i].wd == ev->wd && cfg_watches[i].name == ev->name
+							&& (cfg = cfg_reload(&cfg_watches[i])) != NULL)
+						old.push_back(cfg);
+				}
+			}
+		}
+
+		/* the views of the previous files may still be read in the hooks; outside of the lock, which readers may take */
+		for (size_t i = 0; i < old.size(); i++)
+			ext_rcu_defer(cfg_release, old[i]);
+	}
+}
+
+/* Watch the file of the copy, cb is called from the watcher thread and must not call cfg_watch */
+static int cfg_watch(struct fd_ext_arg * self, fd_ext_cfg_cb cb, void * data)
+{
+	struct fd_ext_inst * inst = ext_inst_of(self);
+	struct cfg_watch w;
+
+	if (cb == NULL || self->conffile == NULL)
+		return EINVAL;
+	if (cfg_of(self) == NULL)
+		return ENOMEM;
+
+	std::lock_guard<std::mutex> lock(cfg_lock);
+	for (auto it = cfg_watches.begin(); it != cfg_watches.end(); ++it) {
+		if (it->inst == inst) {
+			it->cb = cb;
+			it->data = data;
+			return 0;
+		}
+	}
+
+	if (cfg_inotify < 0) {
+		if ((cfg_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+			return errno;
+		if ((cfg_stop = eventfd(0, EFD_CLOEXEC)) < 0) {
+			int ret = errno;
+			close(cfg_inotify);
+			cfg_inotify = -1;
+			return ret;
+		}
+		try {
+			cfg_thread = std::thread(cfg_watcher);
+		} catch (std::system_error & e) {
+			close(cfg_stop);
+			close(cfg_inotify);
+			cfg_stop = cfg_inotify = -1;
+			return e.code().value();
+		}
+	}
+
+	/* the directory, so that the file is seen when it is replaced */
+	std::string dir(self->conffile), base(self->conffile);
+	w.wd = inotify_add_watch(cfg_inotify, dirname(&dir[0]),
+				IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM);
+	if (w.wd < 0)
+		return errno;
+	w.inst = inst;
+	w.name = basename(&base[0]);
+	w.cb = cb;
+	w.data = data;
+	cfg_watches.push_back(w);
+	return 0;
+}
+
+const struct fd_ext_config ext_config_ops = {
+	cfg_get,
+	cfg_get_int,
+	cfg_get_double,
+	cfg_get_bool,
+	cfg_watch
+};
+
+/* The copy is being finalized: no more callback */
+void ext_config_unwatch(struct fd_ext_inst * inst)
+{
+	std::lock_guard<std::mutex> lock(cfg_lock);
+
+	for (auto it = cfg_watches.begin(); it != cfg_watches.end(); ++it) {
+		if (it->inst == inst) {
+			int wd = it->wd;
+			cfg_watches.erase(it);
+			if (std::none_of(cfg_watches.cbegin(), cfg_watches.cend(),
+					[wd](const struct cfg_watch & w) { return w.wd == wd; }))
+				inotify_rm_watch(cfg_inotify, wd);
+			break;
+		}
+	}
+}
+
+/* fd_ext_fini returned, its file can be unmapped */
+void ext_config_release(struct fd_ext_inst * inst)
+{
+	ext_cfg_close(inst->cfg.exchange(NULL, std::memory_order_acq_rel));
+}
+
+/* An abandoned copy may still be watched: the watcher runs until the process exits */
+void ext_config_leave(void)
+{
+	if (cfg_thread.joinable())
+		cfg_thread.detach();
+}
+
+/* Stop the watcher, all the copies were released */
+void ext_config_stop(void)
+{
+	uint64_t one = 1;
+
+	if (cfg_inotify < 0)
+		return;
+	if (write(cfg_stop, &one, sizeof(one)) < 0) {
+		//TRACE_ERROR("Unable to stop the configuration watcher: %s", strerror(errno));
+	}
+	if (cfg_thread.joinable())
+		cfg_thread.join();
+	close(cfg_stop);
+	close(cfg_inotify);
+	cfg_stop = cfg_inotify = -1;
+}
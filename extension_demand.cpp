@@ -0,0 +1,186 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Extensions loaded on demand.
+ *
+ * An extension whose .cfg declares the messages it serves:
+ *	[OnDemand]
+ *	Serves = 4, 16777238/272, 16777251/316
+ * (Application-Id, or Application-Id/Command-Code, '*' matching any) is not opened by
+ * fd_ext_load, unless an extension loaded then depends on it. The first message it
+ * serves triggers its loading, and the loading of its dependencies, on a background
+ * thread; fd_ext_hook_dispatch returns FD_EXT_HOOK_PENDING for the messages it
+ * serves until it is ready, so that the daemon holds them (see fd_ext_on_ready).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "extension_internal.h"
+
+struct demand_entry {
+	uint32_t		app_id;
+	uint32_t		cmd_code;
+	struct fd_ext_info	*ext;
+};
+
+/* Triggers of the extensions not ready yet, immutable once published */
+struct demand_table {
+	unsigned		count;
+	struct demand_entry	entries[];
+};
+
+std::atomic<unsigned> ext_demand_count(0);
+static std::atomic<struct demand_table*> demand_tables(NULL);
+static std::mutex demand_lock;		/* serializes the updates */
+
+/* Read the declaration from the .cfg of the extension; nothing declared is not an error */
+int ext_demand_configure(struct fd_ext_info * ext)
+{
+	std::vector<struct fd_ext_cfg_view> items;
+	struct fd_ext_cfg_view serves;
+	struct ext_cfg * cfg = ext_cfg_open(ext->conffile);
+	int ret = 0;
+
+	if (cfg == NULL)
+		return ENOMEM;
+	if (ext_cfg_find(cfg, "OnDemand", "Serves", &serves) == 0)
+		ext_cfg_split(serves, ',', items);
+	for (auto it = items.cbegin(); it != items.cend(); ++it) {
+		std::string item(it->ptr, it->len);
+		const char * p = item.c_str();
+		uint32_t app, cmd = FD_EXT_ANY;
+		char * end;
+
+		if (*p == '*') {
+			app = FD_EXT_ANY;
+			end = (char *)p + 1;
+		} else {
+			app = strtoul(p, &end, 10);
+		}
+		while (*end == ' ' || *end == '\t')
+			end++;
+		if (*end == '/') {
+			p = end + 1;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			if (*p == '*')
+				end = (char *)p + 1;
+			else
+				cmd = strtoul(p, &end, 10);
+		}
+		if (*end != '\0' || end == item.c_str()) {
+			//LOG_E("Invalid item '%s' in Serves of %s", item.c_str(), ext->conffile);
+			ret = EINVAL;
+			break;
+		}
+		ext->serves.push_back(std::make_pair(app, cmd));
+	}
+	ext_cfg_close(cfg);
+	return ret;
+}
+
+static void demand_free(void * data)
+{
+	free(data);
+}
+
+/* Publish the triggers of the extensions loaded on demand which are not ready */
+int ext_demand_update(void)
+{
+	std::lock_guard<std::mutex> lock(demand_lock);
+	struct demand_table * t = NULL, * old;
+	unsigned n = 0;
+
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+		if ((*li)->state.load(std::memory_order_acquire) != FD_EXT_STATE_READY)
+			n += (*li)->on_demand ? (*li)->serves.size() : 0;
+	}
+	if (n) {
+		t = (struct demand_table *)malloc(sizeof(struct demand_table) + n * sizeof(struct demand_entry));
+		if (t == NULL)
+			return ENOMEM;
+		t->count = 0;
+		for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+			struct fd_ext_info * ext = *li;
+			if (!ext->on_demand || ext->state.load(std::memory_order_acquire) == FD_EXT_STATE_READY)
+				continue;
+			for (auto it = ext->serves.cbegin(); it != ext->serves.cend(); ++it) {
+				struct demand_entry * e = &t->entries[t->count++];
+				e->app_id = it->first;
+				e->cmd_code = it->second;
+				e->ext = ext;
+			}
+		}
+	}
+	old = demand_tables.exchange(t, std::memory_order_acq_rel);
+	ext_demand_count.store(n, std::memory_order_release);
+	if (old)
+		ext_rcu_defer(demand_free, old);
+	return 0;
+}
+
+/* Verdict on a message before its hooks are called: FD_EXT_HOOK_PENDING while an extension it triggers is not ready,
+ * starting its loading, FD_EXT_HOOK_UNAVAILABLE if it failed. Called in a read-side section. */
+int ext_demand_gate(struct fd_ext_msg * msg)
+{
+	struct demand_table * t = demand_tables.load(std::memory_order_acquire);
+	int ret = FD_EXT_HOOK_CONTINUE;
+
+	if (t == NULL)
+		return ret;
+	for (unsigned i = 0; i < t->count; i++) {
+		struct demand_entry * e = &t->entries[i];
+		if ((e->app_id != FD_EXT_ANY && e->app_id != msg->app_id)
+			|| (e->cmd_code != FD_EXT_ANY && e->cmd_code != msg->cmd_code))
+			continue;
+		switch (e->ext->state.load(std::memory_order_acquire)) {
+		case FD_EXT_STATE_READY:
+			break;
+		case FD_EXT_STATE_FAILED:
+			return FD_EXT_HOOK_UNAVAILABLE;
+		case FD_EXT_STATE_IDLE:
+			ext_demand_start(e->ext);
+			/* fall through */
+		default:
+			ret = FD_EXT_HOOK_PENDING;
+		}
+	}
+	return ret;
+}
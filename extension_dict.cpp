@@ -0,0 +1,207 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Dictionary objects resolved once for the extensions.
+ *
+ * An extension declares the AVPs, commands and applications it uses; they are
+ * searched by name here and stored in a table indexed as the declarations, so
+ * the messages path reads them with a single load instead of fd_dict_search.
+ * Objects are never removed from the dictionary, so a refresh only looks up the
+ * entries still missing, stores into the same table, and the readers need no protection.
+ */
+
+#include <stdlib.h>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <string>
+#include <mutex>
+
+#include "cch_port.h"
+#include "diameter_base.h"
+#include "extension_internal.h"
+#include "dict.h"
+
+/* A table and what is needed to fill it again */
+struct dict_cache_rec {
+	struct fd_ext_dict_cache	cache;
+	std::vector<struct fd_ext_dict_decl> decls;
+	std::vector<std::string>	names;		/* copies, decls[i].name points inside */
+	unsigned			missing;	/* entries not resolved yet */
+	struct fd_ext_inst		*inst;		/* the copy of the extension which declared it */
+};
+
+static std::mutex dict_lock;
+static std::vector<struct dict_cache_rec*> dict_caches;
+
+static struct dict_object * dict_resolve(dictionary * pDictionary, const struct fd_ext_dict_decl * decl)
+{
+	struct dict_object * obj = NULL;
+	struct dict_avp_request req;
+
+	switch (decl->kind) {
+	case FD_EXT_DICT_AVP:
+		req.avp_vendor = decl->vendor;
+		req.avp_code = decl->code;
+		req.avp_name = (char *)decl->name;
+		if (decl->name)
+			pDictionary->fd_dict_search(DICT_AVP, decl->vendor ? AVP_BY_NAME_AND_VENDOR : AVP_BY_NAME,
+					decl->vendor ? (const void *)&req : (const void *)decl->name, &obj, 0);
+		else
+			pDictionary->fd_dict_search(DICT_AVP, AVP_BY_CODE_AND_VENDOR, &req, &obj, 0);
+		break;
+
+	case FD_EXT_DICT_COMMAND:
+		if (decl->name)
+			pDictionary->fd_dict_search(DICT_COMMAND, CMD_BY_NAME, decl->name, &obj, 0);
+		else
+			pDictionary->fd_dict_search(DICT_COMMAND, CMD_BY_CODE_R, &decl->code, &obj, 0);
+		break;
+
+	case FD_EXT_DICT_APPLICATION:
+		if (decl->name)
+			pDictionary->fd_dict_search(DICT_APPLICATION, APPLICATION_BY_NAME, decl->name, &obj, 0);
+		else
+			pDictionary->fd_dict_search(DICT_APPLICATION, APPLICATION_BY_ID, &decl->code, &obj, 0);
+		break;
+	}
+
+	return obj;
+}
+
+/* Resolve the entries still missing, a resolved one stays valid; called with dict_lock held */
+static void dict_fill(struct dict_cache_rec * rec)
+{
+	dictionary *pDictionary = dictionary::getInstance();
+
+	for (unsigned i = 0; i < rec->cache.count && rec->missing; i++) {
+		struct dict_object * obj;
+		if (rec->cache.objs[i] != NULL)
+			continue;
+		obj = dict_resolve(pDictionary, &rec->decls[i]);
+		if (obj != NULL) {
+			__atomic_store_n(&rec->cache.objs[i], obj, __ATOMIC_RELEASE);
+			rec->missing--;
+		}
+	}
+}
+
+void fd_ext_dict_refresh(void)
+{
+	std::lock_guard<std::mutex> lock(dict_lock);
+
+	for (auto it = dict_caches.cbegin(); it != dict_caches.cend(); ++it) {
+		if ((*it)->missing)
+			dict_fill(*it);
+	}
+}
+
+static int dict_declare(struct fd_ext_arg *self, const struct fd_ext_dict_decl *decls, unsigned count,
+			struct fd_ext_dict_cache **cache)
+{
+	struct dict_cache_rec * rec;
+
+	if (self == NULL || (decls == NULL && count) || cache == NULL)
+		return EINVAL;
+
+	rec = new(std::nothrow) dict_cache_rec();
+	if (rec == NULL)
+		return ENOMEM;
+	rec->cache.objs = (struct dict_object **)calloc(count ?: 1, sizeof(struct dict_object *));
+	if (rec->cache.objs == NULL) {
+		delete rec;
+		return ENOMEM;
+	}
+	rec->cache.count = count;
+	rec->missing = count;
+	rec->inst = ext_inst_of(self);
+	rec->decls.assign(decls, decls + count);
+	rec->names.resize(count);
+	for (unsigned i = 0; i < count; i++) {
+		if (decls[i].name) {
+			rec->names[i] = decls[i].name;
+			rec->decls[i].name = rec->names[i].c_str();
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(dict_lock);
+		dict_fill(rec);
+		dict_caches.push_back(rec);
+	}
+
+	*cache = &rec->cache;
+	return 0;
+}
+
+static int dict_new(struct fd_ext_arg *self, int type, void *data, struct dict_object *parent, struct dict_object **ref)
+{
+	dictionary *pDictionary = dictionary::getInstance();
+	struct dict_object * obj = NULL;
+	int ret;
+
+	UNUSED(error_message);
+	UNUSED(avp_value_sizes);
+	UNUSED(self);
+	ret = pDictionary->fd_dict_new((enum dict_object_type)type, data, parent, &obj);
+	if (ret == 0) {
+		ext_snap_record(type, data, parent, obj);
+		fd_ext_dict_refresh();
+	}
+	if (ref)
+		*ref = obj;
+	return ret;
+}
+
+const struct fd_ext_dict ext_dict_ops = {
+	dict_declare,
+	dict_new
+};
+
+/* Free the tables of a copy which was finalized */
+void ext_dict_release(struct fd_ext_inst * inst)
+{
+	std::lock_guard<std::mutex> lock(dict_lock);
+
+	for (auto it = dict_caches.begin(); it != dict_caches.end(); ) {
+		if ((*it)->inst == inst) {
+			free((*it)->cache.objs);
+			delete *it;
+			it = dict_caches.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
@@ -0,0 +1,456 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Hooks registered by the extensions on the messages path.
+ *
+ * For each point, the dispatch walks an immutable table built by the registration
+ * functions and published with a single pointer store. The filters of the hooks are
+ * packed together so that the scan of a table touches as few cache lines as possible,
+ * the dispatch takes no lock and allocates nothing. A replaced table is released after
+ * a grace period.
+ */
+
+#include <stdlib.h>
+#include <new>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include "extension_internal.h"
+
+/* A registration, owned by the registry */
+struct fd_ext_hook_hdl {
+	enum fd_ext_hook_point	point;
+	uint32_t		app_id;
+	uint32_t		cmd_code;
+	int			priority;
+	unsigned long		seq;		/* registration order, for the hooks with the same priority */
+	fd_ext_hook_cb		cb;
+	void			*regdata;
+	struct fd_ext_inst	*inst;		/* the copy of the extension which registered the hook */
+};
+
+/* Filter of a hook, 8 of them per cache line */
+struct hook_key {
+	uint32_t		app_id;
+	uint32_t		cmd_code;
+};
+
+struct hook_call {
+	fd_ext_hook_cb		cb;
+	void			*regdata;
+	struct fd_ext_inst	*inst;
+};
+
+/* Table of a point, in calling order; the arrays follow the header in the same allocation */
+struct hook_table {
+	unsigned		count;
+	unsigned		pending;	/* calls into extensions not ready, checked before dispatching */
+	struct hook_key		*keys;
+	struct hook_call	*calls;
+} __attribute__((aligned(64)));
+
+static std::mutex hooks_lock;	/* registrations only, the dispatch never takes it */
+static std::vector<struct fd_ext_hook_hdl*> hooks_registry[FD_EXT_HOOK_MAX];
+static unsigned long hooks_seq = 0;
+static std::atomic<struct hook_table*> hooks_tables[FD_EXT_HOOK_MAX];
+
+static bool hooks_order(const struct fd_ext_hook_hdl * a, const struct fd_ext_hook_hdl * b)
+{
+	return a->priority < b->priority || (a->priority == b->priority && a->seq < b->seq);
+}
+
+/* Build the table of the hooks registered by the copies currently serving. Called with hooks_lock held. */
+static int hooks_build(enum fd_ext_hook_point point, struct hook_table ** table)
+{
+	std::vector<struct fd_ext_hook_hdl*> live;
+	struct hook_table * t;
+	size_t keys_size, i;
+	void * mem;
+
+	*table = NULL;
+	for (auto it = hooks_registry[point].cbegin(); it != hooks_registry[point].cend(); ++it) {
+		if ((*it)->inst->ext->inst.load(std::memory_order_relaxed) == (*it)->inst)
+			live.push_back(*it);
+	}
+	if (live.empty())
+		return 0;
+	std::sort(live.begin(), live.end(), hooks_order);
+
+	keys_size = (live.size() * sizeof(struct hook_key) + 63) & ~(size_t)63;
+	if (posix_memalign(&mem, 64, sizeof(struct hook_table) + keys_size + live.size() * sizeof(struct hook_call)))
+		return ENOMEM;
+	t = new(mem) hook_table();
+	t->count = live.size();
+	t->keys = (struct hook_key *)((char *)mem + sizeof(struct hook_table));
+	t->calls = (struct hook_call *)((char *)t->keys + keys_size);
+	for (i = 0; i < live.size(); i++) {
+		t->keys[i].app_id = live[i]->app_id;
+		t->keys[i].cmd_code = live[i]->cmd_code;
+		t->calls[i].cb = live[i]->cb;
+		t->calls[i].regdata = live[i]->regdata;
+		t->calls[i].inst = live[i]->inst;
+		if (live[i]->inst->state.load(std::memory_order_acquire) != FD_EXT_STATE_READY)
+			t->pending++;
+	}
+	*table = t;
+	return 0;
+}
+
+/* Rebuild and publish the table of a point, the replaced one is returned for release. Called with hooks_lock held. */
+static int hooks_publish(enum fd_ext_hook_point point, struct hook_table ** old)
+{
+	struct hook_table * t;
+	int ret;
+
+	ret = hooks_build(point, &t);
+	if (ret)
+		return ret;
+	*old = hooks_tables[point].exchange(t, std::memory_order_acq_rel);
+	return 0;
+}
+
+static void hooks_free_table(void * table)
+{
+	free(table);
+}
+
+static int hooks_register(struct fd_ext_arg *self, enum fd_ext_hook_point point, uint32_t app_id, uint32_t cmd_code,
+			int priority, fd_ext_hook_cb cb, void *regdata, struct fd_ext_hook_hdl **hdl)
+{
+	struct fd_ext_hook_hdl * h;
+	struct hook_table * old = NULL;
+	int ret;
+
+	if (self == NULL || (unsigned)point >= FD_EXT_HOOK_MAX || cb == NULL)
+		return EINVAL;
+
+	h = new(std::nothrow) fd_ext_hook_hdl();
+	if (h == NULL)
+		return ENOMEM;
+	h->point = point;
+	h->app_id = app_id;
+	h->cmd_code = cmd_code;
+	h->priority = priority;
+	h->cb = cb;
+	h->regdata = regdata;
+	h->inst = ext_inst_of(self);
+
+	{
+		std::lock_guard<std::mutex> lock(hooks_lock);
+		h->seq = ++hooks_seq;
+		hooks_registry[point].push_back(h);
+		ret = hooks_publish(point, &old);
+		if (ret) {
+			hooks_registry[point].pop_back();
+			delete h;
+			return ret;
+		}
+	}
+
+	/* Outside of hooks_lock, a hook may be registering while we wait for it */
+	if (old)
+		ext_rcu_defer(hooks_free_table, old);
+	if (hdl)
+		*hdl = h;
+	return 0;
+}
+
+static int hooks_unregister(struct fd_ext_hook_hdl *hdl)
+{
+	struct hook_table * old = NULL;
+	int ret;
+
+	if (hdl == NULL)
+		return EINVAL;
+
+	{
+		std::lock_guard<std::mutex> lock(hooks_lock);
+		std::vector<struct fd_ext_hook_hdl*> & reg = hooks_registry[hdl->point];
+		auto it = std::find(reg.begin(), reg.end(), hdl);
+		if (it == reg.end())
+			return ENOENT;
+		size_t pos = it - reg.begin();
+		reg.erase(it);
+		ret = hooks_publish(hdl->point, &old);
+		if (ret) {
+			/* the table published still calls it: registered as before, the capacity is unchanged */
+			reg.insert(reg.begin() + pos, hdl);
+			return ret;
+		}
+	}
+
+	/* The tables hold copies of the registration, it is not needed by the dispatch */
+	delete hdl;
+	if (old)
+		ext_rcu_defer(hooks_free_table, old);
+	return 0;
+}
+
+const struct fd_ext_hooks ext_hooks_ops = {
+	hooks_register,
+	hooks_unregister
+};
+
+/* Publish the tables again after copies of extensions were switched */
+int ext_hooks_update(void)
+{
+	std::vector<struct hook_table*> old;
+	int ret = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(hooks_lock);
+		for (int point = 0; point < FD_EXT_HOOK_MAX && !ret; point++) {
+			struct hook_table * t = NULL;
+			ret = hooks_publish((enum fd_ext_hook_point)point, &t);
+			if (t)
+				old.push_back(t);
+		}
+	}
+
+	for (auto it = old.cbegin(); it != old.cend(); ++it)
+		ext_rcu_defer(hooks_free_table, *it);
+	return ret;
+}
+
+/* Publish again the tables which gate the dispatch, after extensions became ready */
+void ext_hooks_ready(void)
+{
+	std::vector<struct hook_table*> old;
+
+	{
+		std::lock_guard<std::mutex> lock(hooks_lock);
+		for (int point = 0; point < FD_EXT_HOOK_MAX; point++) {
+			struct hook_table * t = hooks_tables[point].load(std::memory_order_relaxed);
+			if (t == NULL || !t->pending)
+				continue;
+			t = NULL;
+			/* on failure, the table in place still gates correctly */
+			if (hooks_publish((enum fd_ext_hook_point)point, &t) == 0 && t)
+				old.push_back(t);
+		}
+	}
+
+	for (auto it = old.cbegin(); it != old.cend(); ++it)
+		ext_rcu_defer(hooks_free_table, *it);
+}
+
+/* The hooks a copy registered, by point and in registration order, for its hosting out of process */
+void ext_hooks_list(struct fd_ext_inst * inst, std::vector<struct ext_hook_desc> & descs)
+{
+	std::lock_guard<std::mutex> lock(hooks_lock);
+
+	for (int point = 0; point < FD_EXT_HOOK_MAX; point++) {
+		for (auto it = hooks_registry[point].cbegin(); it != hooks_registry[point].cend(); ++it) {
+			struct ext_hook_desc d;
+			if ((*it)->inst != inst)
+				continue;
+			d.point = (*it)->point;
+			d.app_id = (*it)->app_id;
+			d.cmd_code = (*it)->cmd_code;
+			d.priority = (*it)->priority;
+			d.cb = (*it)->cb;
+			d.regdata = (*it)->regdata;
+			descs.push_back(d);
+		}
+	}
+}
+
+/* Forget the registrations left by a copy which was finalized */
+void ext_hooks_release(struct fd_ext_inst * inst)
+{
+	std::lock_guard<std::mutex> lock(hooks_lock);
+
+	for (int point = 0; point < FD_EXT_HOOK_MAX; point++) {
+		std::vector<struct fd_ext_hook_hdl*> & reg = hooks_registry[point];
+		for (auto it = reg.begin(); it != reg.end(); ) {
+			if ((*it)->inst == inst) {
+				delete *it;
+				it = reg.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+}
+
+/* Fill the fields of the message from its header */
+int fd_ext_msg_parse(struct fd_ext_msg *msg, uint8_t *data, size_t len)
+{
+	if (len < 20 || data[0] != 1 || (((size_t)data[1] << 16) | (data[2] << 8) | data[3]) > len)
+		return EINVAL;
+
+	msg->len = ((size_t)data[1] << 16) | (data[2] << 8) | data[3];
+	msg->flags = data[4];
+	msg->cmd_code = ((uint32_t)data[5] << 16) | (data[6] << 8) | data[7];
+	msg->app_id = ((uint32_t)data[8] << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+	msg->hbh_id = ((uint32_t)data[12] << 24) | (data[13] << 16) | (data[14] << 8) | data[15];
+	msg->e2e_id = ((uint32_t)data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19];
+	msg->data = data;
+	return 0;
+}
+
+/* Verdict on a message some hooks of extensions not ready may match, before any hook is called */
+static int hooks_gate(struct hook_table * t, struct fd_ext_msg * msg)
+{
+	int ret = FD_EXT_HOOK_CONTINUE;
+
+	for (unsigned i = 0; i < t->count; i++) {
+		if ((t->keys[i].app_id != FD_EXT_ANY && t->keys[i].app_id != msg->app_id)
+			|| (t->keys[i].cmd_code != FD_EXT_ANY && t->keys[i].cmd_code != msg->cmd_code))
+			continue;
+		switch (t->calls[i].inst->state.load(std::memory_order_acquire)) {
+		case FD_EXT_STATE_READY:
+			break;
+		case FD_EXT_STATE_FAILED:
+			return FD_EXT_HOOK_UNAVAILABLE;
+		default:
+			ret = FD_EXT_HOOK_PENDING;
+		}
+	}
+	return ret;
+}
+
+int fd_ext_hook_dispatch(enum fd_ext_hook_point point, struct fd_ext_msg *msg)
+{
+	struct hook_table * t;
+	int ret = FD_EXT_HOOK_CONTINUE;
+	uint64_t start;
+
+	if ((unsigned)point >= FD_EXT_HOOK_MAX)
+		return ret;
+
+	fd_ext_rcu_read_lock();
+	t = hooks_tables[point].load(std::memory_order_acquire);
+	if (ext_demand_count.load(std::memory_order_relaxed))
+		ret = ext_demand_gate(msg);
+	if (t && t->pending && ret == FD_EXT_HOOK_CONTINUE)
+		ret = hooks_gate(t, msg);
+	/* as received, before the hooks; a message held is captured when it is dispatched again */
+	if (point == FD_EXT_HOOK_MSG_RECEIVED && ret != FD_EXT_HOOK_PENDING && ext_capture_on.load(std::memory_order_relaxed))
+		ext_capture_record(msg);
+	if (t && ret == FD_EXT_HOOK_CONTINUE) {
+		/* the end of a call is the start of the next one, filtering included */
+		start = ext_now_ns();
+		for (unsigned i = 0; i < t->count; i++) {
+			uint64_t end;
+			if ((t->keys[i].app_id != FD_EXT_ANY && t->keys[i].app_id != msg->app_id)
+				|| (t->keys[i].cmd_code != FD_EXT_ANY && t->keys[i].cmd_code != msg->cmd_code))
+				continue;
+			struct fd_ext_inst * inst = t->calls[i].inst;
+			ret = (*t->calls[i].cb)(point, msg, t->calls[i].regdata, inst->thread_init ? ext_thread_ctx(inst) : NULL);
+			end = ext_now_ns();
+			ext_stats_record(inst->ext->idx, end - start);
+			start = end;
+			if (ret != FD_EXT_HOOK_CONTINUE)
+				break;
+		}
+	}
+	fd_ext_rcu_read_unlock();
+	return ret;
+}
+
+/* Calls of a hook on the messages of a batch still undecided which it matches, in chunks of FD_EXT_BATCH_MAX */
+static void hooks_call_batch(enum fd_ext_hook_point point, const struct hook_key * key, const struct hook_call * call,
+				struct fd_ext_msg ** msgs, int * verdicts, unsigned count)
+{
+	struct fd_ext_inst * inst = call->inst;
+	struct fd_ext_msg * sub[FD_EXT_BATCH_MAX];
+	int subv[FD_EXT_BATCH_MAX];
+	unsigned pos[FD_EXT_BATCH_MAX], n = 0, k;
+	void * ctx;
+	uint64_t start;
+
+	for (k = 0; k < count; k++) {
+		if (verdicts[k] != FD_EXT_HOOK_CONTINUE
+			|| (key->app_id != FD_EXT_ANY && key->app_id != msgs[k]->app_id)
+			|| (key->cmd_code != FD_EXT_ANY && key->cmd_code != msgs[k]->cmd_code))
+			continue;
+		sub[n] = msgs[k];
+		subv[n] = FD_EXT_HOOK_CONTINUE;
+		pos[n++] = k;
+	}
+	if (n == 0)
+		return;
+
+	ctx = inst->thread_init ? ext_thread_ctx(inst) : NULL;
+	start = ext_now_ns();
+	if (inst->batch == NULL || (*inst->batch)(point, call->cb, call->regdata, sub, subv, n, ctx) == ENOTSUP) {
+		/* one call per message */
+		for (k = 0; k < n; k++)
+			subv[k] = (*call->cb)(point, sub[k], call->regdata, ctx);
+	}
+	/* accounted as n calls of the average duration */
+	start = (ext_now_ns() - start) / n;
+	for (k = 0; k < n; k++) {
+		verdicts[pos[k]] = subv[k];
+		ext_stats_record(inst->ext->idx, start);
+	}
+}
+
+int fd_ext_hook_dispatch_batch(enum fd_ext_hook_point point, struct fd_ext_msg **msgs, int *verdicts, unsigned count)
+{
+	struct hook_table * t;
+	unsigned done = 0;
+
+	if ((unsigned)point >= FD_EXT_HOOK_MAX)
+		return EINVAL;
+
+	fd_ext_rcu_read_lock();
+	t = hooks_tables[point].load(std::memory_order_acquire);
+	for (unsigned k = 0; k < count; k++) {
+		verdicts[k] = ext_demand_count.load(std::memory_order_relaxed) ? ext_demand_gate(msgs[k]) : FD_EXT_HOOK_CONTINUE;
+		if (t && t->pending && verdicts[k] == FD_EXT_HOOK_CONTINUE)
+			verdicts[k] = hooks_gate(t, msgs[k]);
+	}
+	if (point == FD_EXT_HOOK_MSG_RECEIVED && ext_capture_on.load(std::memory_order_relaxed)) {
+		for (unsigned k = 0; k < count; k++) {
+			if (verdicts[k] != FD_EXT_HOOK_PENDING)
+				ext_capture_record(msgs[k]);
+		}
+	}
+	/* hook by hook, each message seeing the hooks in the same order as with fd_ext_hook_dispatch */
+	for (unsigned b = 0; t && b < count; b += FD_EXT_BATCH_MAX) {
+		unsigned n = std::min(count - b, (unsigned)FD_EXT_BATCH_MAX);
+		for (unsigned i = 0; i < t->count; i++)
+			hooks_call_batch(point, &t->keys[i], &t->calls[i], msgs + b, verdicts + b, n);
+	}
+	fd_ext_rcu_read_unlock();
+
+	for (unsigned k = 0; k < count; k++)
+		done += verdicts[k] != FD_EXT_HOOK_CONTINUE;
+	return done;
+}
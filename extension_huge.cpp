@@ -0,0 +1,263 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Text of the extensions on huge pages.
+ *
+ * The executable segments of the extensions are mapped from their files with 4K pages,
+ * each one costing an iTLB entry in the message path. fd_ext_huge_text copies the part of
+ * each executable segment covering whole 2M-aligned ranges into anonymous memory backed
+ * by transparent huge pages, then moves it in place of the original with mremap, which
+ * replaces the pages atomically: a thread running the code meanwhile finds the same
+ * instructions. The addresses do not change, so a segment gets huge pages only where it
+ * spans an aligned 2M range. The extensions are linked with 2M segment alignment
+ * (EXT_LDOPTS): their text starts on a 2M boundary and the loader reserves the rest of
+ * that 2M as an inaccessible mapping of the file, so the last, partial 2M of the text is
+ * moved too, the padding becoming zeroes. dlclose unmaps the whole object as before.
+ * Without transparent huge pages, nothing is changed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "extension_internal.h"
+
+#define HUGE_SIZE	(2UL << 20)
+#define SMALL_SIZE	4096UL
+
+/* Extensions remapped at the end of fd_ext_load: empty, "all", or a list of names */
+static std::string huge_names;
+
+struct huge_seg {
+	uintptr_t	start;
+	uintptr_t	end;
+};
+
+void ext_huge_configure(const char * names)
+{
+	huge_names = names;
+}
+
+static int huge_selected(struct fd_ext_info * ext, const char * names)
+{
+	std::vector<struct fd_ext_cfg_view> items;
+	struct fd_ext_cfg_view list = { names, strlen(names) };
+
+	if (!strcasecmp(names, "all"))
+		return 1;
+	ext_cfg_split(list, ',', items);
+	for (auto it = items.cbegin(); it != items.cend(); ++it) {
+		if (ext->ext_name && strlen(ext->ext_name) == it->len && !strncasecmp(ext->ext_name, it->ptr, it->len))
+			return 1;
+	}
+	return 0;
+}
+
+static int huge_available(void)
+{
+	char buf[128] = "";
+	FILE * f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+	if (f == NULL)
+		return 0;
+	if (fgets(buf, sizeof(buf), f) == NULL)
+		buf[0] = '\0';
+	fclose(f);
+	return strstr(buf, "[never]") == NULL && buf[0] != '\0';
+}
+
+/* Whether [from, to) is only the inaccessible padding the loader reserved after the text at 'text', in the same object */
+static int huge_padding(uintptr_t text, uintptr_t from, uintptr_t to)
+{
+	FILE * f = fopen("/proc/self/maps", "r");
+	char line[512], dev[32], file[32] = "";
+	unsigned long inode, object = 0;
+	uintptr_t covered = from;
+
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) && covered < to) {
+		unsigned long start, end;
+		char perms[8];
+		if (sscanf(line, "%lx-%lx %7s %*x %31s %lu", &start, &end, perms, dev, &inode) != 5)
+			continue;
+		if (start <= text && text < end) {
+			snprintf(file, sizeof(file), "%s", dev);
+			object = inode;
+		}
+		/* the maps are sorted, the text comes first */
+		if (end <= covered || start >= to)
+			continue;
+		if (start > covered || strcmp(perms, "---p") || !object || inode != object || strcmp(dev, file))
+			break;
+		covered = end;
+	}
+	fclose(f);
+	return covered >= to;
+}
+
+/* Move a copy of the range, on huge pages, in place of it; only the first 'used' bytes are copied, the rest is zeroes */
+static int huge_remap(uintptr_t start, size_t len, size_t used)
+{
+	void * area = mmap(NULL, len + HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	uintptr_t copy;
+
+	if (area == MAP_FAILED)
+		return errno;
+	/* keep the aligned part only */
+	copy = ((uintptr_t)area + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1);
+	if (copy > (uintptr_t)area)
+		munmap(area, copy - (uintptr_t)area);
+	munmap((void *)(copy + len), (uintptr_t)area + HUGE_SIZE - copy);
+
+	if (madvise((void *)copy, len, MADV_HUGEPAGE)) {
+		int ret = errno;
+		munmap((void *)copy, len);
+		return ret;
+	}
+	memcpy((void *)copy, (const void *)start, used);
+	if (mprotect((void *)copy, len, PROT_READ | PROT_EXEC)
+			|| mremap((void *)copy, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, (void *)start) == MAP_FAILED) {
+		int ret = errno;
+		munmap((void *)copy, len);
+		return ret;
+	}
+	return 0;
+}
+
+/* Huge pages backing the ranges, from /proc/self/smaps */
+static unsigned huge_count(const std::vector<struct huge_seg> & ranges)
+{
+	FILE * f = fopen("/proc/self/smaps", "r");
+	char line[512];
+	unsigned long kb = 0;
+	int inside = 0;
+
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long start, end, v;
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			inside = 0;
+			for (auto it = ranges.cbegin(); it != ranges.cend(); ++it)
+				inside |= start >= it->start && end <= it->end;
+		} else if (inside && sscanf(line, "AnonHugePages: %lu kB", &v) == 1) {
+			kb += v;
+		}
+	}
+	fclose(f);
+	return kb / (HUGE_SIZE >> 10);
+}
+
+int fd_ext_huge_text(const char *names, struct fd_ext_huge_report *report)
+{
+	std::vector<struct huge_seg> segs, moved;
+	std::vector<unsigned long> moved_text;		/* small pages of text in each moved range */
+	unsigned long small = 0, left;
+
+	memset(report, 0, sizeof(*report));
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+		struct fd_ext_inst * inst = (*li)->inst.load(std::memory_order_acquire);
+		if (inst == NULL || !huge_selected(*li, names))
+			continue;
+		for (auto it = inst->text.cbegin(); it != inst->text.cend(); ++it) {
+			struct huge_seg s;
+			s.start = it->first & ~(SMALL_SIZE - 1);
+			s.end = (it->second + SMALL_SIZE - 1) & ~(SMALL_SIZE - 1);
+			segs.push_back(s);
+		}
+	}
+
+	report->segments = segs.size();
+	for (auto it = segs.cbegin(); it != segs.cend(); ++it)
+		small += (it->end - it->start) / SMALL_SIZE;
+	report->small_pages_before = small;
+	if (!huge_available()) {
+		report->small_pages_after = small;
+		report->status = ENOTSUP;
+		return ENOTSUP;
+	}
+
+	for (auto it = segs.cbegin(); it != segs.cend(); ++it) {
+		struct huge_seg h;
+		int ret;
+		uintptr_t used;
+		h.start = (it->start + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1);
+		h.end = it->end & ~(HUGE_SIZE - 1);
+		used = h.end - h.start;
+		/* the last 2M, partly text and partly padding */
+		if (it->end > h.end && h.end >= h.start && huge_padding(it->start, it->end, h.end + HUGE_SIZE)) {
+			used = it->end - h.start;
+			h.end += HUGE_SIZE;
+		}
+		if (h.end <= h.start)
+			continue;
+		ret = huge_remap(h.start, h.end - h.start, used);
+		if (ret != 0) {
+			//LOG_E("Text at %p could not be remapped on huge pages: %s", (void *)h.start, strerror(ret));
+			report->status = ret;
+			continue;
+		}
+		moved.push_back(h);
+		moved_text.push_back((used + SMALL_SIZE - 1) / SMALL_SIZE);
+	}
+
+	/* the kernel may still have given small pages; the padding is not text */
+	left = small;
+	for (size_t i = 0; i < moved.size(); i++) {
+		unsigned huge = huge_count(std::vector<struct huge_seg>(1, moved[i]));
+		unsigned long text = std::min(moved_text[i], (unsigned long)huge * (HUGE_SIZE / SMALL_SIZE));
+		report->huge_pages += huge;
+		left -= std::min(left, text);
+	}
+	report->small_pages_after = left;
+	return report->status;
+}
+
+/* The step of fd_ext_load, before any message is dispatched */
+void ext_huge_load(void)
+{
+	struct fd_ext_huge_report report;
+
+	if (huge_names.empty())
+		return;
+	fd_ext_huge_text(huge_names.c_str(), &report);
+	//LOG_N("Text of the extensions: %u segments, %u small pages before, %u after, %u huge pages",
+	//	report.segments, report.small_pages_before, report.small_pages_after, report.huge_pages);
+}
@@ -0,0 +1,237 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Definitions shared by the files implementing the extensions management, not part of the extensions API */
+
+#ifndef _EXTENSION_INTERNAL_H
+#define _EXTENSION_INTERNAL_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "extension.h"
+
+/* Maximum number of extensions, they are numbered in the configuration order */
+#define EXT_MAX		256
+
+struct fd_ext_info;
+struct ext_cfg;
+struct ext_oop;
+
+/* One loaded copy of an extension; fd_ext_reload replaces it as a whole */
+struct fd_ext_inst {
+	struct fd_ext_info	*ext;		/* the extension this copy belongs to */
+	void			*handler;	/* object returned by dlopen() */
+	const char		**depends;	/* fd_ext_depends array of this copy (if provided) */
+	int			(*init)(int, int, fd_ext_arg *);	/* address of the fd_ext_init entry point */
+	void			(*fini)(void);	/* optional address of the fd_ext_fini callback */
+	int			(*thread_init)(struct fd_ext_arg *, void *);	/* optional per-thread entry points */
+	void			(*thread_fini)(struct fd_ext_arg *, void *);
+	int			(*batch)(enum fd_ext_hook_point, fd_ext_hook_cb, void *,
+					struct fd_ext_msg **, int *, unsigned, void *);	/* optional batch entry point */
+	int			init_called;	/* fd_ext_init was invoked, so fd_ext_fini must be called too */
+	std::atomic<int>	state;		/* enum fd_ext_state, gates the dispatch to its hooks */
+	int			ready_early;	/* ready() was called before fd_ext_init returned FD_EXT_PENDING */
+	int			ready_status;
+	std::atomic<struct ext_cfg*> cfg;	/* its configuration file, once accessed */
+	struct ext_oop		*oop;		/* its helper process, when hosted out of process */
+	std::atomic<int>	timers_closed;	/* finalized, no more timer nor job */
+	uintptr_t		base;		/* load address of the object */
+	std::vector<std::pair<uintptr_t, uintptr_t> > text;	/* its executable segments, from dl_iterate_phdr */
+	struct fd_ext_arg	args;		/* valid as long as the copy is loaded, the extension may keep a pointer on it */
+};
+
+/* List of extensions to load, from the configuration parsing */
+struct fd_ext_info {
+	char 		*filename;	/* extension filename. must be a dynamic library with fd_ext_init symbol. */
+	char 		*conffile;	/* optional configuration file name for the extension */
+	char		*ext_name;	/* points to the extension name, either inside depends, or basename(filename) */
+	int		free_ext_name;	/* must be freed if it was malloc'd */
+	unsigned	idx;		/* position in the configuration, indexes the per-thread statistics */
+	int		manifest;	/* name and dependencies from its manifest, set before it is opened */
+	int		on_demand;	/* opened by the first message it serves, see extension_demand.cpp */
+	std::vector<std::pair<uint32_t, uint32_t> > serves;	/* Application-Id, Command-Code */
+	int		oop;		/* hosted out of process, see extension_oop.cpp */
+	std::string	oop_cpus;	/* CPUs of its helper, empty if not pinned */
+	const struct fd_ext_static *stat;	/* linked into the daemon, see extension_static.cpp */
+
+	/* the copy currently serving, read under fd_ext_rcu_read_lock */
+	std::atomic<struct fd_ext_inst*> inst;
+
+	/* dependency graph, built by check_dependencies */
+	std::vector<struct fd_ext_info*> deps;		/* extensions this one depends on */
+	std::vector<struct fd_ext_info*> dependents;	/* extensions depending on this one */
+	int		pending_deps;	/* dependencies not ready yet (scheduler state) */
+	std::atomic<int> state;		/* enum fd_ext_state of the copy serving */
+
+	/* timing, in nanoseconds */
+	uint64_t	open_ns;	/* dlopen + symbols resolution */
+	uint64_t	init_start;
+	uint64_t	init_ns;	/* fd_ext_init */
+	uint64_t	ready_ns;	/* from the call of fd_ext_init to the readiness */
+	uint64_t	fini_ns;	/* fd_ext_fini of the last copy finalized */
+	unsigned	reloads;	/* copies replaced by fd_ext_reload */
+	uint64_t	path_ns;	/* longest chain of initializations ending with this extension */
+	struct fd_ext_info *path_prev;	/* previous extension on that chain */
+
+	/* round trips to the helper, when hosted out of process */
+	std::atomic<uint64_t> oop_calls;
+	std::atomic<uint64_t> oop_rtt_ns;
+	std::atomic<uint32_t> oop_depth_peak;	/* requests in flight on a channel */
+};
+
+/* extension.cpp */
+extern std::list<struct fd_ext_info*> ext_list;
+extern std::mutex ext_list_lock;
+int fd_ext_add(const char * filename, const char * conffile);
+void ext_demand_start(struct fd_ext_info * ext);
+
+/* extension_rcu.cpp */
+int ext_rcu_in_read(void);
+void ext_rcu_defer(void (*fn)(void *), void *data);
+void ext_rcu_barrier(void);
+
+/* extension_hooks.cpp */
+struct ext_hook_desc {
+	enum fd_ext_hook_point	point;
+	uint32_t		app_id;
+	uint32_t		cmd_code;
+	int			priority;
+	fd_ext_hook_cb		cb;
+	void			*regdata;
+};
+extern const struct fd_ext_hooks ext_hooks_ops;
+int ext_hooks_update(void);
+void ext_hooks_ready(void);
+void ext_hooks_release(struct fd_ext_inst * inst);
+void ext_hooks_list(struct fd_ext_inst * inst, std::vector<struct ext_hook_desc> & descs);
+
+/* extension_dict.cpp */
+extern const struct fd_ext_dict ext_dict_ops;
+void ext_dict_release(struct fd_ext_inst * inst);
+
+/* extension_snapshot.cpp */
+extern int ext_snap_warm;
+void ext_snap_configure(const char * path);
+void ext_snap_open(void);
+void ext_snap_record(int type, void * data, struct dict_object * parent, struct dict_object * obj);
+int ext_snap_save(void);
+
+/* extension_alloc.cpp */
+extern const struct fd_ext_alloc ext_alloc_ops;
+void ext_alloc_limit(unsigned idx, uint64_t bytes);
+void ext_alloc_stats(unsigned idx, struct fd_ext_stats * stats);
+
+/* extension_capture.cpp */
+extern std::atomic<int> ext_capture_on;
+void ext_capture_record(struct fd_ext_msg * msg);
+
+/* extension_config.cpp */
+extern const struct fd_ext_config ext_config_ops;
+struct ext_cfg * ext_cfg_open(const char * path);
+void ext_cfg_close(struct ext_cfg * cfg);
+int ext_cfg_find(struct ext_cfg * cfg, const char * section, const char * key, struct fd_ext_cfg_view * value);
+void ext_cfg_split(struct fd_ext_cfg_view value, char delim, std::vector<struct fd_ext_cfg_view> & items);
+void ext_config_unwatch(struct fd_ext_inst * inst);
+void ext_config_release(struct fd_ext_inst * inst);
+void ext_config_stop(void);
+void ext_config_leave(void);
+
+/* extension_demand.cpp */
+extern std::atomic<unsigned> ext_demand_count;
+int ext_demand_configure(struct fd_ext_info * ext);
+int ext_demand_update(void);
+int ext_demand_gate(struct fd_ext_msg * msg);
+
+/* extension_huge.cpp */
+void ext_huge_configure(const char * names);
+void ext_huge_load(void);
+
+/* extension_manifest.cpp */
+int ext_manifest_order(void);
+void ext_index_add(struct fd_ext_info * ext);
+struct fd_ext_info * ext_index_find(const char * name);
+void ext_index_clear(void);
+
+/* extension_oop.cpp */
+void ext_oop_configure(const char * helper, unsigned chans, unsigned depth, unsigned slot_size, unsigned timeout_ms);
+int ext_oop_open(struct fd_ext_inst * inst);
+void ext_oop_close(struct fd_ext_inst * inst);
+
+/* extension_session.cpp */
+extern const struct fd_ext_sessions ext_session_ops;
+void ext_session_configure(unsigned buckets);
+uint64_t ext_session_count(unsigned idx);
+void ext_session_release(unsigned idx);
+void ext_session_stop(void);
+void ext_session_leave(void);
+
+/* extension_static.cpp */
+const struct fd_ext_static * ext_static_find(const char * name);
+int ext_static_open(struct fd_ext_inst * inst);
+
+/* extension_timer.cpp */
+extern const struct fd_ext_timers ext_timer_ops;
+void ext_timer_configure(unsigned wheels, unsigned executors);
+void ext_timer_release(struct fd_ext_inst * inst);
+void ext_timer_stop(void);
+void ext_timer_leave(void);
+
+/* extension_thread.cpp */
+void * ext_thread_ctx(struct fd_ext_inst * inst);
+void ext_thread_release(struct fd_ext_inst * inst);
+
+/* extension_stats.cpp */
+void ext_stats_record(unsigned idx, uint64_t ns);
+void ext_stats_clear(unsigned idx);
+
+static inline struct fd_ext_inst * ext_inst_of(struct fd_ext_arg * args)
+{
+	return (struct fd_ext_inst *)((char *)args - offsetof(struct fd_ext_inst, args));
+}
+
+static inline uint64_t ext_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* _EXTENSION_INTERNAL_H */
@@ -0,0 +1,276 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Manifests of the extensions.
+ *
+ * EXTENSION_ENTRY also emits the name and the dependencies of the extension, with the
+ * version of the API it was built for, in a note of the .fdx (section .note.fdext, owner
+ * "fdext"); FD_EXT_SERVICES adds the services it needs. fd_ext_load reads the notes of
+ * all the files, mapped and not loaded, indexes the extensions by name, and orders them
+ * so that each one comes after its dependencies, keeping the configuration order
+ * otherwise; a missing dependency, a cycle, another API version or an unknown service is
+ * reported before any extension is loaded. When an extension has no manifest (built
+ * with an older extension.h), the configuration order is kept and the dependencies are
+ * resolved as the extensions are opened, as before. The manifest of an extension linked
+ * into the daemon is its descriptor (see extension_static.cpp).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "extension_internal.h"
+
+/* Services of the daemon an extension may declare with FD_EXT_SERVICES */
+static const char * const manifest_services[] = { "hooks", "dict_cache", "alloc", "config", "ready", "thread", "batch", "timer", "session", NULL };
+
+/* Extensions by lower-case name, the first one of a name is kept */
+static std::unordered_map<std::string, struct fd_ext_info*> manifest_index;
+
+static std::string manifest_key(const char * name)
+{
+	std::string key(name);
+
+	for (size_t i = 0; i < key.size(); i++)
+		key[i] = tolower((unsigned char)key[i]);
+	return key;
+}
+
+void ext_index_add(struct fd_ext_info * ext)
+{
+	if (ext->ext_name)
+		manifest_index.emplace(manifest_key(ext->ext_name), ext);
+}
+
+struct fd_ext_info * ext_index_find(const char * name)
+{
+	auto it = manifest_index.find(manifest_key(name));
+
+	return it == manifest_index.end() ? NULL : it->second;
+}
+
+void ext_index_clear(void)
+{
+	manifest_index.clear();
+}
+
+/* The strings of a note, up to the empty one or the end of the description */
+static void manifest_strings(const char * p, const char * end, std::vector<std::string> & out)
+{
+	while (p < end && *p) {
+		size_t len = strnlen(p, end - p);
+		out.push_back(std::string(p, len));
+		p += len + 1;
+	}
+}
+
+/* Walk the notes of the SHT_NOTE sections, for ELF32 and ELF64 */
+template <typename Ehdr, typename Shdr, typename Nhdr>
+static int manifest_notes(const uint8_t * base, size_t size, uint32_t * version, std::vector<std::string> & names,
+				std::vector<std::string> & services)
+{
+	const Ehdr * eh = (const Ehdr *)base;
+	int found = 0;
+
+	if (size < sizeof(Ehdr) || eh->e_shentsize != sizeof(Shdr) || eh->e_shoff > size
+			|| (size - eh->e_shoff) / sizeof(Shdr) < eh->e_shnum)
+		return EINVAL;
+	for (unsigned s = 0; s < eh->e_shnum; s++) {
+		const Shdr * sh = (const Shdr *)(base + eh->e_shoff) + s;
+		size_t off;
+
+		if (sh->sh_type != SHT_NOTE || sh->sh_offset > size || size - sh->sh_offset < sh->sh_size)
+			continue;
+		for (off = 0; off + sizeof(Nhdr) <= sh->sh_size; ) {
+			const Nhdr * nh = (const Nhdr *)(base + sh->sh_offset + off);
+			size_t name = off + sizeof(Nhdr);
+			size_t desc = name + ((nh->n_namesz + 3) & ~3U);
+			size_t next = desc + ((nh->n_descsz + 3) & ~3U);
+			const char * d = (const char *)base + sh->sh_offset + desc;
+
+			if (next > sh->sh_size)
+				break;
+			off = next;
+			if (nh->n_namesz != sizeof(FD_EXT_NOTE_NAME) || memcmp(base + sh->sh_offset + name, FD_EXT_NOTE_NAME, nh->n_namesz))
+				continue;
+			if (nh->n_type == FD_EXT_NOTE_MANIFEST && nh->n_descsz > sizeof(uint32_t)) {
+				memcpy(version, d, sizeof(uint32_t));
+				manifest_strings(d + sizeof(uint32_t), d + nh->n_descsz, names);
+				found = 1;
+			} else if (nh->n_type == FD_EXT_NOTE_SERVICES) {
+				manifest_strings(d, d + nh->n_descsz, services);
+			}
+		}
+	}
+	return found ? 0 : ENOENT;
+}
+
+/* Read the manifest of the file of the extension; names[0] is its name, the others its dependencies. ENOENT if it has none. */
+static int manifest_read(struct fd_ext_info * ext, std::vector<std::string> & names)
+{
+	std::vector<std::string> services;
+	uint32_t version = 0;
+	struct stat st;
+	void * map;
+	int fd, ret;
+
+	/* The manifest of an extension linked in is its descriptor */
+	if (ext->stat) {
+		for (const char * const * d = ext->stat->depends; *d; d++)
+			names.push_back(*d);
+		for (const char * const * sv = ext->stat->services; sv && *sv; sv++)
+			services.push_back(*sv);
+		version = ext->stat->version;
+		goto check;
+	}
+
+	fd = open(ext->filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno;
+	if (fstat(fd, &st) < 0 || st.st_size < EI_NIDENT) {
+		close(fd);
+		return EINVAL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return errno;
+
+	if (memcmp(map, ELFMAG, SELFMAG))
+		ret = EINVAL;
+	else if (((const uint8_t *)map)[EI_CLASS] == ELFCLASS32)
+		ret = manifest_notes<Elf32_Ehdr, Elf32_Shdr, Elf32_Nhdr>((const uint8_t *)map, st.st_size, &version, names, services);
+	else
+		ret = manifest_notes<Elf64_Ehdr, Elf64_Shdr, Elf64_Nhdr>((const uint8_t *)map, st.st_size, &version, names, services);
+	munmap(map, st.st_size);
+	if (ret != 0)
+		return ret;
+
+check:
+	if (names.empty() || version != FD_EXT_NOTE_VERSION) {
+		//LOG_F("Extension %s was built for another version of the API", ext->filename);
+		return EINVAL;
+	}
+	for (auto it = services.cbegin(); it != services.cend(); ++it) {
+		const char * const * s;
+		for (s = manifest_services; *s && strcasecmp(*s, it->c_str()); s++)
+			;
+		if (*s == NULL) {
+			//LOG_F("Extension %s needs the service %s, not provided", ext->filename, it->c_str());
+			return ENOTSUP;
+		}
+	}
+	return 0;
+}
+
+/* Read all the manifests, set the names and the dependency graph, and order ext_list; nothing is opened */
+int ext_manifest_order(void)
+{
+	std::vector<std::vector<std::string> > names(ext_list.size());
+	std::priority_queue<std::pair<unsigned, struct fd_ext_info*>, std::vector<std::pair<unsigned, struct fd_ext_info*> >,
+			std::greater<std::pair<unsigned, struct fd_ext_info*> > > ready;
+	std::list<struct fd_ext_info*> order;
+	size_t pos = 0;
+	int all = 1;
+
+	manifest_index.clear();
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li, ++pos) {
+		int ret = manifest_read(*li, names[pos]);
+		if (ret == ENOENT)
+			all = 0;
+		else if (ret != 0)
+			return ret;
+	}
+	/* Without all the manifests, the extensions are opened in the configuration order */
+	if (!all)
+		return 0;
+
+	pos = 0;
+	std::unique_lock<std::mutex> lock(ext_list_lock);
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li, ++pos) {
+		struct fd_ext_info * ext = *li;
+		if (ext->free_ext_name)
+			free(ext->ext_name);
+		ext->ext_name = strdup(names[pos][0].c_str());
+		if (ext->ext_name == NULL)
+			return ENOMEM;
+		ext->free_ext_name = 1;
+		ext->manifest = 1;
+		ext_index_add(ext);
+	}
+
+	pos = 0;
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li, ++pos) {
+		struct fd_ext_info * ext = *li;
+		for (size_t i = 1; i < names[pos].size(); i++) {
+			struct fd_ext_info * dep = ext_index_find(names[pos][i].c_str());
+			if (dep == NULL) {
+				//LOG_F("Error: extension [%s] depends on [%s] which is not in the configuration.", ext->ext_name, names[pos][i].c_str());
+				return ESRCH;
+			}
+			ext->deps.push_back(dep);
+			dep->dependents.push_back(ext);
+		}
+		ext->pending_deps = ext->deps.size();
+		if (ext->pending_deps == 0)
+			ready.push(std::make_pair(ext->idx, ext));
+	}
+
+	/* Each one after its dependencies, the earliest in the configuration first */
+	while (!ready.empty()) {
+		struct fd_ext_info * ext = ready.top().second;
+		ready.pop();
+		order.push_back(ext);
+		for (auto it = ext->dependents.cbegin(); it != ext->dependents.cend(); ++it) {
+			if (--(*it)->pending_deps == 0)
+				ready.push(std::make_pair((*it)->idx, *it));
+		}
+	}
+	if (order.size() != ext_list.size()) {
+		//LOG_F("Error: the dependencies of the extensions form a cycle.");
+		return ELOOP;
+	}
+	ext_list.swap(order);
+	return 0;
+}
@@ -0,0 +1,719 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Hosting of extensions out of process.
+ *
+ * An extension listed in [OutOfProcess] of extensions.cfg is not opened by the daemon:
+ * its fd_ext_init runs fdx_host, a helper process built from these same sources, which
+ * loads the .fdx alone with fd_ext_load, then reports the hooks the extension registered.
+ * The daemon registers a proxy for each of them, with the same filter and priority, so
+ * that the order of the hooks is unchanged.
+ *
+ * The messages go through channels in a memory shared with the helper: a ring of requests
+ * and a ring of responses, each one with a single producer and a single consumer. A
+ * daemon thread holds a channel for the messages of a dispatch, the helper serves all the
+ * channels from a single thread, polling then sleeping on a futex. A request carries the
+ * offset of the payload in the shared memory: messages built in it are not copied, the
+ * others are copied once into the slot of the request. The verdicts come back in order.
+ *
+ * When the helper exits, or does not answer within OopTimeout, it is killed and the
+ * messages for the extension get FD_EXT_HOOK_UNAVAILABLE. The dictionary of the helper is
+ * its own, and the hooks registered after fd_ext_init are not proxied.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+#include <new>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "extension_internal.h"
+
+#define OOP_MAX_HOOKS	64
+#define OOP_MAX_CHANS	64
+#define OOP_SPIN	4000		/* polls before sleeping */
+#define OOP_NO_PAYLOAD	(~(uint64_t)0)	/* the message did not fit in the slot */
+
+/* State of the helper, in the shared memory */
+enum { OOP_STARTING = 0, OOP_READY, OOP_FAILED, OOP_STOP };
+
+struct oop_hook_desc {
+	int32_t		point;
+	uint32_t	app_id;
+	uint32_t	cmd_code;
+	int32_t		priority;
+};
+
+struct oop_req {
+	uint32_t	hook;		/* index in oop_shm.hooks */
+	uint32_t	len;
+	uint64_t	off;		/* of the payload, from the start of the shared memory */
+	uint32_t	app_id;
+	uint32_t	cmd_code;
+	uint32_t	hbh_id;
+	uint32_t	e2e_id;
+	uint32_t	flags;
+	uint64_t	sent_ns;	/* when the daemon queued it, for the round trip; the helper ignores it */
+};
+
+struct oop_rsp {
+	int32_t		verdict;
+};
+
+/* One direction of a channel, the producer writes tail and the consumer head */
+struct oop_ring {
+	std::atomic<uint32_t>	tail __attribute__((aligned(64)));
+	std::atomic<uint32_t>	waiting;	/* the consumer sleeps on tail */
+	std::atomic<uint32_t>	head __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct oop_chan {
+	struct oop_ring		req;
+	struct oop_ring		rsp;
+};
+
+/* Start of the shared memory, followed by the channels, the requests, the responses and the slots */
+struct oop_shm {
+	std::atomic<uint32_t>	state;
+	int32_t			status;		/* error of the helper when it failed */
+	uint32_t		nchans;
+	uint32_t		depth;		/* entries of each ring, a power of 2 */
+	uint32_t		slot_size;
+	uint32_t		nhooks;
+	struct oop_hook_desc	hooks[OOP_MAX_HOOKS];
+	std::atomic<uint32_t>	doorbell __attribute__((aligned(64)));	/* incremented with each batch of requests */
+	std::atomic<uint32_t>	sleeping;	/* the helper sleeps on doorbell */
+} __attribute__((aligned(64)));
+
+struct oop_layout {
+	size_t		req;
+	size_t		rsp;
+	size_t		slots;
+	size_t		size;
+};
+
+/* regdata of a proxy */
+struct oop_hook {
+	struct ext_oop	*oop;
+	uint32_t	idx;
+};
+
+/* The helper of a copy, on the daemon side */
+struct ext_oop {
+	struct fd_ext_inst		*inst;
+	struct oop_shm			*shm;
+	struct oop_layout		layout;
+	int				fd;
+	pid_t				pid;
+	std::atomic<int>		failed;
+	std::unique_ptr<std::mutex[]>	locks;		/* of the channels */
+	std::mutex			reap_lock;
+	struct oop_hook			hooks[OOP_MAX_HOOKS];
+};
+
+/* Configuration, from fd_ext_initialize */
+static std::string oop_helper;
+static uint32_t oop_nchans = 4;
+static uint32_t oop_depth = 256;
+static uint32_t oop_slot_size = 65536;
+static uint64_t oop_timeout_ns = 1000000000ULL;
+
+/* The channel of a daemon thread */
+static std::atomic<unsigned> oop_thread_seq(0);
+static thread_local unsigned oop_thread_id = ~0u;
+
+/* Polls before sleeping, none when both sides share a single CPU */
+static unsigned oop_spin_limit(void)
+{
+	static const unsigned limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? OOP_SPIN : 0;
+	return limit;
+}
+
+static inline void oop_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void oop_futex_wait(std::atomic<uint32_t> * addr, uint32_t val, long ns)
+{
+	struct timespec ts = { ns / 1000000000L, ns % 1000000000L };
+	syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void oop_futex_wake(std::atomic<uint32_t> * addr)
+{
+	syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void oop_compute_layout(uint32_t nchans, uint32_t depth, uint32_t slot_size, struct oop_layout * l)
+{
+	size_t n = (size_t)nchans * depth;
+
+	l->req = sizeof(struct oop_shm) + nchans * sizeof(struct oop_chan);
+	l->rsp = l->req + n * sizeof(struct oop_req);
+	l->slots = (l->rsp + n * sizeof(struct oop_rsp) + 4095) & ~(size_t)4095;
+	l->size = l->slots + n * slot_size;
+}
+
+static inline struct oop_chan * oop_chan_at(struct oop_shm * shm, uint32_t c)
+{
+	return (struct oop_chan *)(shm + 1) + c;
+}
+
+void ext_oop_configure(const char * helper, unsigned chans, unsigned depth, unsigned slot_size, unsigned timeout_ms)
+{
+	oop_helper = helper;
+	if (chans)
+		oop_nchans = chans < OOP_MAX_CHANS ? chans : OOP_MAX_CHANS;
+	if (depth) {
+		for (oop_depth = 1; oop_depth < depth && oop_depth < (1U << 20); oop_depth <<= 1)
+			;
+	}
+	if (slot_size)
+		oop_slot_size = (slot_size + 63) & ~63U;
+	if (timeout_ms)
+		oop_timeout_ns = timeout_ms * 1000000ULL;
+}
+
+/* The helper does not serve anymore: the messages for the extension are rejected from now on */
+static void oop_fail(struct ext_oop * oop)
+{
+	std::lock_guard<std::mutex> lock(oop->reap_lock);
+
+	if (oop->failed.exchange(1))
+		return;
+	//LOG_E("Extension %s hosted out of process stopped answering", oop->inst->ext->ext_name);
+	if (oop->pid > 0)
+		kill(oop->pid, SIGKILL);
+	oop->inst->state.store(FD_EXT_STATE_FAILED, std::memory_order_release);
+	oop->inst->ext->state.store(FD_EXT_STATE_FAILED, std::memory_order_release);
+}
+
+static int oop_alive(struct ext_oop * oop)
+{
+	std::lock_guard<std::mutex> lock(oop->reap_lock);
+	int status;
+
+	if (oop->pid > 0 && waitpid(oop->pid, &status, WNOHANG) == oop->pid)
+		oop->pid = -1;
+	return oop->pid > 0;
+}
+
+/* Wait for the responses after head; returns the tail, or head if the helper failed */
+static uint32_t oop_wait_rsp(struct ext_oop * oop, struct oop_chan * ch, uint32_t head)
+{
+	uint64_t deadline = 0;
+
+	for (unsigned spin = 0; ; spin++) {
+		uint32_t tail = ch->rsp.tail.load(std::memory_order_acquire);
+		if (tail != head)
+			return tail;
+		if (oop->failed.load(std::memory_order_relaxed))
+			return head;
+		if (spin < oop_spin_limit()) {
+			oop_relax();
+			continue;
+		}
+		if (deadline == 0) {
+			deadline = ext_now_ns() + oop_timeout_ns;
+		} else if (ext_now_ns() > deadline || !oop_alive(oop)) {
+			oop_fail(oop);
+			return head;
+		}
+		ch->rsp.waiting.store(1, std::memory_order_seq_cst);
+		if (ch->rsp.tail.load(std::memory_order_seq_cst) == head)
+			oop_futex_wait(&ch->rsp.tail, head, 1000000);
+		ch->rsp.waiting.store(0, std::memory_order_relaxed);
+	}
+}
+
+/* Pass the messages to a hook of the helper, with as many in flight as the ring holds, and collect the verdicts */
+static void oop_call(struct ext_oop * oop, uint32_t hook, struct fd_ext_msg ** msgs, int * verdicts, unsigned count)
+{
+	struct oop_shm * shm = oop->shm;
+	struct fd_ext_info * ext = oop->inst->ext;
+	uint32_t depth = shm->depth, c, tail, head, peak = 0;
+	struct oop_chan * ch;
+	struct oop_req * reqs;
+	struct oop_rsp * rsps;
+	char * slots;
+	unsigned sent = 0, recv = 0;
+	uint64_t rtt = 0;
+
+	if (oop_thread_id == ~0u)
+		oop_thread_id = oop_thread_seq.fetch_add(1, std::memory_order_relaxed);
+	c = oop_thread_id % shm->nchans;
+	ch = oop_chan_at(shm, c);
+	reqs = (struct oop_req *)((char *)shm + oop->layout.req) + (size_t)c * depth;
+	rsps = (struct oop_rsp *)((char *)shm + oop->layout.rsp) + (size_t)c * depth;
+	slots = (char *)shm + oop->layout.slots + (size_t)c * depth * shm->slot_size;
+
+	std::lock_guard<std::mutex> lock(oop->locks[c]);
+	tail = ch->req.tail.load(std::memory_order_relaxed);
+	head = ch->rsp.head.load(std::memory_order_relaxed);
+	while (recv < count) {
+		uint32_t rtail;
+		uint64_t now;
+
+		if (sent < count && tail - head < depth) {
+			now = ext_now_ns();
+			for (; sent < count && tail - head < depth; sent++, tail++) {
+				struct fd_ext_msg * m = msgs[sent];
+				struct oop_req * r = &reqs[tail & (depth - 1)];
+				r->hook = hook;
+				r->len = m->len;
+				r->app_id = m->app_id;
+				r->cmd_code = m->cmd_code;
+				r->hbh_id = m->hbh_id;
+				r->e2e_id = m->e2e_id;
+				r->flags = m->flags;
+				r->sent_ns = now;
+				if (m->data >= (uint8_t *)shm && m->data + m->len <= (uint8_t *)shm + oop->layout.size) {
+					r->off = m->data - (uint8_t *)shm;
+				} else if (m->len <= shm->slot_size) {
+					char * slot = slots + (size_t)(tail & (depth - 1)) * shm->slot_size;
+					memcpy(slot, m->data, m->len);
+					r->off = slot - (char *)shm;
+				} else {
+					r->off = OOP_NO_PAYLOAD;
+				}
+			}
+			ch->req.tail.store(tail, std::memory_order_release);
+			shm->doorbell.fetch_add(1, std::memory_order_seq_cst);
+			if (shm->sleeping.load(std::memory_order_seq_cst))
+				oop_futex_wake(&shm->doorbell);
+			if (tail - head > peak)
+				peak = tail - head;
+		}
+
+		rtail = oop_wait_rsp(oop, ch, head);
+		if (rtail == head) {
+			for (; recv < count; recv++)
+				verdicts[recv] = FD_EXT_HOOK_UNAVAILABLE;
+			break;
+		}
+		now = ext_now_ns();
+		for (; head != rtail; head++, recv++) {
+			verdicts[recv] = rsps[head & (depth - 1)].verdict;
+			rtt += now - reqs[head & (depth - 1)].sent_ns;
+		}
+		ch->rsp.head.store(head, std::memory_order_release);
+	}
+
+	ext->oop_calls.fetch_add(count, std::memory_order_relaxed);
+	ext->oop_rtt_ns.fetch_add(rtt, std::memory_order_relaxed);
+	if (peak > ext->oop_depth_peak.load(std::memory_order_relaxed))
+		ext->oop_depth_peak.store(peak, std::memory_order_relaxed);
+}
+
+/* Proxy of a hook of the helper */
+static int oop_hook_cb(enum fd_ext_hook_point point, struct fd_ext_msg * msg, void * regdata, void * ctx)
+{
+	struct oop_hook * h = (struct oop_hook *)regdata;
+	int verdict;
+
+	(void)point;
+	(void)ctx;
+	if (h->oop->failed.load(std::memory_order_relaxed))
+		return FD_EXT_HOOK_UNAVAILABLE;
+	oop_call(h->oop, h->idx, &msg, &verdict, 1);
+	return verdict;
+}
+
+/* fd_ext_hook_batch of the proxies: one round of the rings for the whole batch */
+static int oop_batch(enum fd_ext_hook_point point, fd_ext_hook_cb cb, void * regdata,
+			struct fd_ext_msg ** msgs, int * verdicts, unsigned count, void * ctx)
+{
+	struct oop_hook * h = (struct oop_hook *)regdata;
+
+	(void)point;
+	(void)cb;
+	(void)ctx;
+	if (h->oop->failed.load(std::memory_order_relaxed)) {
+		for (unsigned k = 0; k < count; k++)
+			verdicts[k] = FD_EXT_HOOK_UNAVAILABLE;
+		return 0;
+	}
+	oop_call(h->oop, h->idx, msgs, verdicts, count);
+	return 0;
+}
+
+/* Close the descriptors from 3 up but keep, in the forked child: only async-signal-safe calls */
+static void oop_close_fds(int keep, long max_fd)
+{
+#ifdef SYS_close_range
+	if ((keep <= 3 || syscall(SYS_close_range, 3, keep - 1, 0) == 0)
+			&& syscall(SYS_close_range, keep + 1, ~0U, 0) == 0)
+		return;
+#endif
+	for (long fd = 3; fd < max_fd; fd++) {
+		if (fd != keep)
+			close(fd);
+	}
+}
+
+/* Start the helper; returns once it loaded the extension, or failed to */
+static int oop_spawn(struct ext_oop * oop)
+{
+	struct fd_ext_info * ext = oop->inst->ext;
+	std::string fd = std::to_string(oop->fd);
+	std::vector<const char *> argv;
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	pid_t pid;
+
+	argv.push_back(oop_helper.c_str());
+	argv.push_back("-f");
+	argv.push_back(fd.c_str());
+	argv.push_back("-x");
+	argv.push_back(ext->filename);
+	argv.push_back("-c");
+	argv.push_back(ext->conffile);
+	if (!ext->oop_cpus.empty()) {
+		argv.push_back("-C");
+		argv.push_back(ext->oop_cpus.c_str());
+	}
+	argv.push_back(NULL);
+
+	pid = fork();
+	if (pid < 0)
+		return errno;
+	if (pid == 0) {
+		/* the shared memory is the only descriptor it inherits, with the standard ones */
+		fcntl(oop->fd, F_SETFD, 0);
+		oop_close_fds(oop->fd, max_fd);
+		execv(argv[0], (char * const *)argv.data());
+		_exit(127);
+	}
+	oop->pid = pid;
+
+	/* its fd_ext_init may take long, it answers unless it exits */
+	for (;;) {
+		uint32_t state = oop->shm->state.load(std::memory_order_acquire);
+		if (state == OOP_READY)
+			return 0;
+		if (state == OOP_FAILED)
+			return oop->shm->status ?: EINVAL;
+		if (!oop_alive(oop))
+			return ECHILD;
+		oop_futex_wait(&oop->shm->state, state, 10000000);
+	}
+}
+
+/* fd_ext_init of an extension hosted out of process */
+static int oop_init(int major, int minor, struct fd_ext_arg * args)
+{
+	struct fd_ext_inst * inst = ext_inst_of(args);
+	struct ext_oop * oop = inst->oop;
+	struct oop_shm * shm;
+	void * map;
+	int ret;
+
+	(void)major;
+	(void)minor;
+	oop_compute_layout(oop_nchans, oop_depth, oop_slot_size, &oop->layout);
+	oop->fd = memfd_create(inst->ext->ext_name, MFD_CLOEXEC);
+	if (oop->fd < 0)
+		return errno;
+	if (ftruncate(oop->fd, oop->layout.size) < 0)
+		return errno;
+	map = mmap(NULL, oop->layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, oop->fd, 0);
+	if (map == MAP_FAILED)
+		return errno;
+	/* the memory is zeroed, the atomics are in their initial state */
+	shm = oop->shm = (struct oop_shm *)map;
+	shm->nchans = oop_nchans;
+	shm->depth = oop_depth;
+	shm->slot_size = oop_slot_size;
+	oop->locks.reset(new(std::nothrow) std::mutex[oop_nchans]);
+	if (!oop->locks)
+		return ENOMEM;
+
+	ret = oop_spawn(oop);
+	if (ret != 0) {
+		//LOG_E("Helper of extension %s failed: %s", inst->ext->ext_name, strerror(ret));
+		return ret;
+	}
+
+	/* the proxies, in the order the extension registered its hooks */
+	for (uint32_t i = 0; i < shm->nhooks; i++) {
+		oop->hooks[i].oop = oop;
+		oop->hooks[i].idx = i;
+		ret = args->hooks->hook_register(args, (enum fd_ext_hook_point)shm->hooks[i].point, shm->hooks[i].app_id,
+				shm->hooks[i].cmd_code, shm->hooks[i].priority, oop_hook_cb, &oop->hooks[i], NULL);
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+}
+
+/* Instead of dlopen: the entry points of the copy are those of the proxy */
+int ext_oop_open(struct fd_ext_inst * inst)
+{
+	struct ext_oop * oop = new(std::nothrow) ext_oop();
+
+	if (oop == NULL)
+		return ENOMEM;
+	if (oop_helper.empty()) {
+		delete oop;
+		return EINVAL;
+	}
+	oop->inst = inst;
+	oop->fd = -1;
+	oop->pid = -1;
+	inst->oop = oop;
+	inst->init = oop_init;
+	inst->batch = oop_batch;
+	return 0;
+}
+
+/* Stop the helper of the copy, its proxies are no longer called */
+void ext_oop_close(struct fd_ext_inst * inst)
+{
+	struct ext_oop * oop = inst->oop;
+
+	if (oop == NULL)
+		return;
+	if (oop->shm) {
+		oop->shm->state.store(OOP_STOP, std::memory_order_seq_cst);
+		oop->shm->doorbell.fetch_add(1, std::memory_order_seq_cst);
+		oop_futex_wake(&oop->shm->doorbell);
+	}
+	/* fd_ext_fini of the extension runs in the helper, it is given the time of a call */
+	for (uint64_t deadline = ext_now_ns() + oop_timeout_ns; oop_alive(oop) && ext_now_ns() < deadline; )
+		usleep(1000);
+	if (oop->pid > 0) {
+		kill(oop->pid, SIGKILL);
+		waitpid(oop->pid, NULL, 0);
+	}
+	if (oop->shm)
+		munmap(oop->shm, oop->layout.size);
+	if (oop->fd >= 0)
+		close(oop->fd);
+	inst->oop = NULL;
+	delete oop;
+}
+
+/* CPUs of the helper, as "0-3,6" */
+static int oop_pin(const char * cpus)
+{
+	cpu_set_t set;
+	const char * p = cpus;
+
+	CPU_ZERO(&set);
+	while (*p) {
+		char * end;
+		unsigned long first = strtoul(p, &end, 10), last = first;
+		if (end == p)
+			return EINVAL;
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		for (unsigned long c = first; c <= last && c < CPU_SETSIZE; c++)
+			CPU_SET(c, &set);
+		p = *end == ',' ? end + 1 : end;
+		if (*end && *end != ',')
+			return EINVAL;
+	}
+	return sched_setaffinity(0, sizeof(set), &set) ? errno : 0;
+}
+
+/* Serve the requests of all the channels until the daemon stops the helper */
+static void oop_serve(struct oop_shm * shm, const struct oop_layout * l, struct fd_ext_inst * inst,
+			const std::vector<struct ext_hook_desc> & hooks)
+{
+	uint32_t depth = shm->depth;
+	unsigned idle = 0;
+
+	for (;;) {
+		int work = 0;
+
+		for (uint32_t c = 0; c < shm->nchans; c++) {
+			struct oop_chan * ch = oop_chan_at(shm, c);
+			struct oop_req * reqs = (struct oop_req *)((char *)shm + l->req) + (size_t)c * depth;
+			struct oop_rsp * rsps = (struct oop_rsp *)((char *)shm + l->rsp) + (size_t)c * depth;
+			uint32_t head = ch->req.head.load(std::memory_order_relaxed);
+			uint32_t tail = ch->req.tail.load(std::memory_order_acquire);
+			uint32_t rtail = ch->rsp.tail.load(std::memory_order_relaxed);
+			void * ctx;
+
+			if (head == tail)
+				continue;
+			fd_ext_rcu_read_lock();
+			ctx = inst->thread_init ? ext_thread_ctx(inst) : NULL;
+			for (; head != tail; head++, rtail++) {
+				struct oop_req * r = &reqs[head & (depth - 1)];
+				int verdict = FD_EXT_HOOK_UNAVAILABLE;
+				if (r->hook < hooks.size() && r->off != OOP_NO_PAYLOAD && r->off + r->len <= l->size) {
+					struct fd_ext_msg msg;
+					memset(&msg, 0, sizeof(msg));
+					msg.app_id = r->app_id;
+					msg.cmd_code = r->cmd_code;
+					msg.hbh_id = r->hbh_id;
+					msg.e2e_id = r->e2e_id;
+					msg.flags = r->flags;
+					msg.data = (uint8_t *)shm + r->off;
+					msg.len = r->len;
+					verdict = (*hooks[r->hook].cb)(hooks[r->hook].point, &msg, hooks[r->hook].regdata, ctx);
+					fd_ext_msg_release(&msg);
+				}
+				rsps[rtail & (depth - 1)].verdict = verdict;
+			}
+			fd_ext_rcu_read_unlock();
+			ch->req.head.store(head, std::memory_order_release);
+			ch->rsp.tail.store(rtail, std::memory_order_seq_cst);
+			if (ch->rsp.waiting.load(std::memory_order_seq_cst))
+				oop_futex_wake(&ch->rsp.tail);
+			work = 1;
+		}
+
+		if (shm->state.load(std::memory_order_acquire) == OOP_STOP)
+			return;
+		if (work) {
+			idle = 0;
+			continue;
+		}
+		if (++idle < oop_spin_limit()) {
+			oop_relax();
+			continue;
+		}
+
+		/* sleep until the next doorbell, unless requests arrived meanwhile */
+		shm->sleeping.store(1, std::memory_order_seq_cst);
+		uint32_t bell = shm->doorbell.load(std::memory_order_seq_cst);
+		int pending = 0;
+		for (uint32_t c = 0; c < shm->nchans && !pending; c++) {
+			struct oop_chan * ch = oop_chan_at(shm, c);
+			pending = ch->req.head.load(std::memory_order_relaxed) != ch->req.tail.load(std::memory_order_seq_cst);
+		}
+		if (!pending)
+			oop_futex_wait(&shm->doorbell, bell, 100000000);
+		shm->sleeping.store(0, std::memory_order_relaxed);
+		idle = 0;
+	}
+}
+
+static int oop_helper_fail(struct oop_shm * shm, int status)
+{
+	shm->status = status;
+	shm->state.store(OOP_FAILED, std::memory_order_seq_cst);
+	oop_futex_wake(&shm->state);
+	return 1;
+}
+
+/* main() of fdx_host: fdx_host -f <fd> -x <file.fdx> -c <file.cfg> [-C <cpus>] */
+int fd_ext_oop_main(int argc, char **argv)
+{
+	const char * fdx = NULL, * cfg = NULL, * cpus = NULL;
+	std::vector<struct ext_hook_desc> hooks;
+	struct oop_layout layout;
+	struct oop_shm * shm;
+	struct fd_ext_info * ext;
+	struct fd_ext_inst * inst;
+	struct stat st;
+	int fd = -1, opt, ret, state;
+	void * map;
+
+	while ((opt = getopt(argc, argv, "f:x:c:C:")) != -1) {
+		switch (opt) {
+		case 'f': fd = atoi(optarg); break;
+		case 'x': fdx = optarg; break;
+		case 'c': cfg = optarg; break;
+		case 'C': cpus = optarg; break;
+		default: return 2;
+		}
+	}
+	if (fd < 0 || fdx == NULL || cfg == NULL || fstat(fd, &st) < 0)
+		return 2;
+
+	/* it does not outlive the daemon */
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() == 1)
+		return 1;
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return 1;
+	shm = (struct oop_shm *)map;
+	oop_compute_layout(shm->nchans, shm->depth, shm->slot_size, &layout);
+	if (layout.size > (size_t)st.st_size || shm->nchans > OOP_MAX_CHANS || (shm->depth & (shm->depth - 1)))
+		return oop_helper_fail(shm, EINVAL);
+
+	if (cpus && (ret = oop_pin(cpus)) != 0)
+		return oop_helper_fail(shm, ret);
+	if (fd_ext_add(fdx, cfg) != 0)
+		return oop_helper_fail(shm, EINVAL);
+	if ((ret = fd_ext_load()) != 0)
+		return oop_helper_fail(shm, ret);
+
+	/* an extension completing in the background is waited for */
+	ext = ext_list.front();
+	while ((state = ext->state.load(std::memory_order_acquire)) == FD_EXT_STATE_LOADING || state == FD_EXT_STATE_PENDING)
+		usleep(1000);
+	if (state != FD_EXT_STATE_READY)
+		return oop_helper_fail(shm, EINVAL);
+
+	inst = ext->inst.load(std::memory_order_acquire);
+	ext_hooks_list(inst, hooks);
+	if (hooks.size() > OOP_MAX_HOOKS)
+		return oop_helper_fail(shm, E2BIG);
+	for (size_t i = 0; i < hooks.size(); i++) {
+		shm->hooks[i].point = hooks[i].point;
+		shm->hooks[i].app_id = hooks[i].app_id;
+		shm->hooks[i].cmd_code = hooks[i].cmd_code;
+		shm->hooks[i].priority = hooks[i].priority;
+	}
+	shm->nhooks = hooks.size();
+	shm->state.store(OOP_READY, std::memory_order_seq_cst);
+	oop_futex_wake(&shm->state);
+
+	oop_serve(shm, &layout, inst, hooks);
+	fd_ext_term();
+	return 0;
+}
@@ -0,0 +1,540 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Sampling profiler of the extensions.
+ *
+ * fd_ext_profile_start arms ITIMER_PROF: SIGPROF is delivered to the threads consuming
+ * CPU, hz times per second of CPU. The handler walks the frame pointers of the
+ * interrupted thread (reading the stack with process_vm_readv, which fails instead of
+ * faulting on a broken chain) and counts the stack in a table allocated beforehand, with
+ * no lock and no allocation. A sample belongs to the extension of the innermost frame
+ * inside an extension, from the executable segments recorded when the extensions were
+ * opened, and is "self" when the interrupted instruction is in the extension itself.
+ *
+ * fd_ext_profile_stop writes the CPU share of each extension, then the stacks of each
+ * extension, folded (one line per stack, the frames of the extension from the outermost,
+ * then the samples), symbolized from the symbol table of the .fdx. The extensions must be
+ * built with frame pointers for their stacks to have more than one frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ucontext.h>
+#include <semaphore.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "extension_internal.h"
+
+#define PROF_DEPTH	24		/* frames kept per sample */
+#define PROF_ENTRIES	16384		/* distinct stacks, a power of 2 */
+#define PROF_PROBES	32
+#define PROF_NONE	EXT_MAX		/* the samples outside the extensions */
+
+struct prof_entry {
+	std::atomic<uint64_t>	key;		/* hash of the stack, 0 when free */
+	std::atomic<uint32_t>	count;
+	uint32_t		ext;
+	uint32_t		depth;
+	uintptr_t		pc[PROF_DEPTH];
+};
+
+/* Code of an extension, sorted by start for the handler */
+struct prof_range {
+	uintptr_t	start;
+	uintptr_t	end;
+	uintptr_t	base;
+	unsigned	idx;
+};
+
+/* State of a profiling, read by the handler */
+struct prof_state {
+	struct prof_entry		*entries;
+	struct prof_range		*ranges;
+	unsigned			nranges;
+	std::atomic<uint64_t>		samples[EXT_MAX + 1];
+	std::atomic<uint64_t>		self[EXT_MAX + 1];
+	std::atomic<uint64_t>		total;
+	std::atomic<uint64_t>		dropped;	/* the table was full */
+};
+
+static std::mutex prof_lock;		/* start and stop */
+static struct prof_state * prof_cur;	/* set while profiling */
+static std::atomic<struct prof_state*> prof_active(NULL);
+static std::atomic<int> prof_inflight(0);
+static int prof_installed = 0;	/* the handler stays, a SIGPROF may still be pending after the stop */
+static unsigned prof_hz;
+static uint64_t prof_start_ns;
+
+/* profiling on signal */
+static sem_t prof_sem;
+static std::string prof_path;
+static unsigned prof_seconds;
+static int prof_thread_started = 0;
+
+/* The extension the address belongs to, PROF_NONE if none */
+static const struct prof_range * prof_find(const struct prof_state * st, uintptr_t pc)
+{
+	unsigned lo = 0, hi = st->nranges;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (pc < st->ranges[mid].start)
+			hi = mid;
+		else if (pc >= st->ranges[mid].end)
+			lo = mid + 1;
+		else
+			return &st->ranges[mid];
+	}
+	return NULL;
+}
+
+/* Read the memory of the process, failing on an unmapped address */
+static int prof_read(uintptr_t addr, void * buf, size_t len)
+{
+	struct iovec local = { buf, len }, remote = { (void *)addr, len };
+
+	return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == (ssize_t)len ? 0 : -1;
+}
+
+static int prof_frames(ucontext_t * uc, uintptr_t * pc)
+{
+	uintptr_t fp, sp, frame[2];
+	int depth = 0;
+
+#if defined(__x86_64__)
+	pc[depth++] = uc->uc_mcontext.gregs[REG_RIP];
+	fp = uc->uc_mcontext.gregs[REG_RBP];
+	sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__i386__)
+	pc[depth++] = uc->uc_mcontext.gregs[REG_EIP];
+	fp = uc->uc_mcontext.gregs[REG_EBP];
+	sp = uc->uc_mcontext.gregs[REG_ESP];
+#elif defined(__aarch64__)
+	pc[depth++] = uc->uc_mcontext.pc;
+	fp = uc->uc_mcontext.regs[29];
+	sp = uc->uc_mcontext.sp;
+#else
+	(void)uc;
+	return 0;
+#endif
+	/* each frame: the previous frame pointer, then the return address; the chain goes up the stack */
+	while (depth < PROF_DEPTH && fp >= sp && !(fp & (sizeof(uintptr_t) - 1)) && fp - sp < (8U << 20)) {
+		if (prof_read(fp, frame, sizeof(frame)) || frame[1] == 0)
+			break;
+		pc[depth++] = frame[1];
+		sp = fp + sizeof(frame);
+		fp = frame[0];
+	}
+	return depth;
+}
+
+static void prof_on_sigprof(int signo, siginfo_t * info, void * ctx)
+{
+	struct prof_state * st;
+	uintptr_t pc[PROF_DEPTH];
+	uint64_t h = 14695981039346656037ULL;
+	unsigned ext = PROF_NONE;
+	int depth, saved = errno;
+
+	(void)signo;
+	(void)info;
+	prof_inflight.fetch_add(1, std::memory_order_acquire);
+	st = prof_active.load(std::memory_order_acquire);
+	if (st == NULL || (depth = prof_frames((ucontext_t *)ctx, pc)) == 0)
+		goto out;
+
+	for (int i = 0; i < depth; i++) {
+		const struct prof_range * r = prof_find(st, pc[i]);
+		if (r != NULL && ext == PROF_NONE) {
+			ext = r->idx;
+			if (i == 0)
+				st->self[ext].fetch_add(1, std::memory_order_relaxed);
+		}
+		h = (h ^ pc[i]) * 1099511628211ULL;
+	}
+	st->samples[ext].fetch_add(1, std::memory_order_relaxed);
+	st->total.fetch_add(1, std::memory_order_relaxed);
+
+	/* the stacks of the extensions only */
+	if (ext != PROF_NONE) {
+		h |= 1;
+		for (unsigned p = 0; p < PROF_PROBES; p++) {
+			struct prof_entry * e = &st->entries[(h + p) & (PROF_ENTRIES - 1)];
+			uint64_t key = e->key.load(std::memory_order_relaxed);
+			if (key == 0) {
+				if (!e->key.compare_exchange_strong(key, h, std::memory_order_relaxed)) {
+					if (key != h)
+						continue;
+				} else {
+					e->ext = ext;
+					e->depth = depth;
+					memcpy(e->pc, pc, depth * sizeof(pc[0]));
+				}
+			} else if (key != h) {
+				continue;
+			}
+			e->count.fetch_add(1, std::memory_order_relaxed);
+			goto out;
+		}
+		st->dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+out:
+	prof_inflight.fetch_sub(1, std::memory_order_release);
+	errno = saved;
+}
+
+int fd_ext_profile_start(unsigned hz)
+{
+	std::lock_guard<std::mutex> lock(prof_lock);
+	struct prof_state * st;
+	std::vector<struct prof_range> ranges;
+	struct sigaction sa;
+	struct itimerval it;
+	void * map;
+
+#if !defined(__x86_64__) && !defined(__i386__) && !defined(__aarch64__)
+	return ENOTSUP;
+#endif
+	if (prof_cur != NULL)
+		return EBUSY;
+	if (hz == 0 || hz > 10000)
+		return EINVAL;
+
+	/* the code of the copies serving now */
+	std::unique_lock<std::mutex> llock(ext_list_lock);
+	fd_ext_rcu_read_lock();
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+		struct fd_ext_inst * inst = (*li)->inst.load(std::memory_order_acquire);
+		if (inst == NULL)
+			continue;
+		for (auto it = inst->text.cbegin(); it != inst->text.cend(); ++it) {
+			struct prof_range r = { it->first, it->second, inst->base, (*li)->idx };
+			ranges.push_back(r);
+		}
+	}
+	fd_ext_rcu_read_unlock();
+	llock.unlock();
+	std::sort(ranges.begin(), ranges.end(), [](const struct prof_range & a, const struct prof_range & b) { return a.start < b.start; });
+
+	st = new(std::nothrow) prof_state();
+	if (st == NULL)
+		return ENOMEM;
+	map = mmap(NULL, PROF_ENTRIES * sizeof(struct prof_entry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		delete st;
+		return ENOMEM;
+	}
+	st->entries = (struct prof_entry *)map;
+	st->ranges = new(std::nothrow) prof_range[ranges.size() ?: 1];
+	if (st->ranges == NULL) {
+		munmap(map, PROF_ENTRIES * sizeof(struct prof_entry));
+		delete st;
+		return ENOMEM;
+	}
+	std::copy(ranges.begin(), ranges.end(), st->ranges);
+	st->nranges = ranges.size();
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = prof_on_sigprof;
+	sa.sa_flags = SA_RESTART | SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	if (!prof_installed && sigaction(SIGPROF, &sa, NULL)) {
+		int ret = errno;
+		delete [] st->ranges;
+		munmap(map, PROF_ENTRIES * sizeof(struct prof_entry));
+		delete st;
+		return ret;
+	}
+	prof_installed = 1;
+	prof_active.store(st, std::memory_order_release);
+	it.it_interval.tv_sec = 1 / hz;
+	it.it_interval.tv_usec = 1000000 / hz % 1000000;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_PROF, &it, NULL)) {
+		int ret = errno;
+		prof_active.store(NULL, std::memory_order_release);
+		while (prof_inflight.load(std::memory_order_acquire))
+			sched_yield();
+		delete [] st->ranges;
+		munmap(map, PROF_ENTRIES * sizeof(struct prof_entry));
+		delete st;
+		return ret;
+	}
+
+	prof_cur = st;
+	prof_hz = hz;
+	prof_start_ns = ext_now_ns();
+	return 0;
+}
+
+/* Symbols of a .fdx, by address in the file */
+struct prof_syms {
+	std::vector<std::pair<uintptr_t, std::string> > syms;	/* start, name */
+	std::vector<uintptr_t> ends;
+};
+
+template <typename Ehdr, typename Shdr, typename Sym>
+static void prof_syms_load(const uint8_t * base, size_t size, struct prof_syms * out)
+{
+	const Ehdr * eh = (const Ehdr *)base;
+	std::vector<std::pair<std::pair<uintptr_t, uintptr_t>, std::string> > syms;
+
+	if (size < sizeof(Ehdr) || eh->e_shentsize != sizeof(Shdr) || eh->e_shoff > size
+			|| (size - eh->e_shoff) / sizeof(Shdr) < eh->e_shnum)
+		return;
+	for (int pass = 0; pass < 2 && syms.empty(); pass++) {
+		/* the full table when not stripped, the dynamic one otherwise */
+		unsigned type = pass ? SHT_DYNSYM : SHT_SYMTAB;
+		for (unsigned s = 0; s < eh->e_shnum; s++) {
+			const Shdr * sh = (const Shdr *)(base + eh->e_shoff) + s;
+			const Shdr * str;
+			if (sh->sh_type != type || sh->sh_link >= eh->e_shnum || sh->sh_offset > size || size - sh->sh_offset < sh->sh_size)
+				continue;
+			str = (const Shdr *)(base + eh->e_shoff) + sh->sh_link;
+			if (str->sh_offset > size || size - str->sh_offset < str->sh_size)
+				continue;
+			for (size_t k = 0; k < sh->sh_size / sizeof(Sym); k++) {
+				const Sym * sym = (const Sym *)(base + sh->sh_offset) + k;
+				if ((sym->st_info & 0xf) != STT_FUNC || sym->st_value == 0 || sym->st_name >= str->sh_size)
+					continue;
+				syms.push_back(std::make_pair(std::make_pair((uintptr_t)sym->st_value, (uintptr_t)(sym->st_value + (sym->st_size ?: 1))),
+						std::string((const char *)base + str->sh_offset + sym->st_name,
+							strnlen((const char *)base + str->sh_offset + sym->st_name, str->sh_size - sym->st_name))));
+			}
+		}
+	}
+	std::sort(syms.begin(), syms.end());
+	for (auto it = syms.cbegin(); it != syms.cend(); ++it) {
+		out->syms.push_back(std::make_pair(it->first.first, it->second));
+		out->ends.push_back(it->first.second);
+	}
+}
+
+static void prof_syms_open(const char * path, struct prof_syms * out)
+{
+	struct stat st;
+	void * map;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0 || st.st_size < EI_NIDENT) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+	if (!memcmp(map, ELFMAG, SELFMAG)) {
+		if (((const uint8_t *)map)[EI_CLASS] == ELFCLASS32)
+			prof_syms_load<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym>((const uint8_t *)map, st.st_size, out);
+		else
+			prof_syms_load<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym>((const uint8_t *)map, st.st_size, out);
+	}
+	munmap(map, st.st_size);
+}
+
+static std::string prof_symbol(const struct prof_syms * s, uintptr_t off)
+{
+	auto it = std::upper_bound(s->syms.cbegin(), s->syms.cend(), std::make_pair(off, std::string("\xff")));
+	char buf[32];
+
+	if (it != s->syms.cbegin()) {
+		size_t k = it - s->syms.cbegin() - 1;
+		if (off < s->ends[k])
+			return s->syms[k].second;
+	}
+	snprintf(buf, sizeof(buf), "0x%lx", (unsigned long)off);
+	return buf;
+}
+
+/* Stop the profiling and write the report into path */
+int fd_ext_profile_stop(const char *path)
+{
+	std::lock_guard<std::mutex> lock(prof_lock);
+	struct prof_state * st = prof_cur;
+	struct itimerval it;
+	std::map<std::string, uint64_t> folded;
+	std::vector<struct prof_syms> syms(EXT_MAX);
+	std::vector<std::string> names(EXT_MAX + 1), files(EXT_MAX);
+	std::vector<int> loaded(EXT_MAX, 0);
+	std::string tmp = std::string(path ? path : "") + ".tmp";
+	double seconds;
+	FILE * f;
+	int ret = 0;
+
+	if (st == NULL)
+		return ENOENT;
+
+	/* no more samples, and none still being counted */
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_PROF, &it, NULL);
+	prof_active.store(NULL, std::memory_order_release);
+	while (prof_inflight.load(std::memory_order_acquire))
+		sched_yield();
+	prof_cur = NULL;
+	seconds = (ext_now_ns() - prof_start_ns) / 1e9;
+
+	/* copies, the list may change while the report is written */
+	{
+		std::lock_guard<std::mutex> llock(ext_list_lock);
+		for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+			names[(*li)->idx] = (*li)->ext_name ?: (*li)->filename;
+			files[(*li)->idx] = (*li)->filename;
+		}
+	}
+	names[PROF_NONE] = "[daemon]";
+
+	for (unsigned i = 0; i < PROF_ENTRIES; i++) {
+		struct prof_entry * e = &st->entries[i];
+		std::string line;
+		if (e->key.load(std::memory_order_relaxed) == 0 || e->ext >= EXT_MAX)
+			continue;
+		if (!loaded[e->ext]) {
+			if (!files[e->ext].empty())
+				prof_syms_open(files[e->ext].c_str(), &syms[e->ext]);
+			loaded[e->ext] = 1;
+		}
+		/* the frames inside the extension, from the outermost */
+		line = names[e->ext];
+		for (int k = e->depth - 1; k >= 0; k--) {
+			const struct prof_range * r = prof_find(st, e->pc[k]);
+			if (r == NULL || r->idx != e->ext)
+				continue;
+			line += ";" + prof_symbol(&syms[e->ext], e->pc[k] - r->base);
+		}
+		folded[line] += e->count.load(std::memory_order_relaxed);
+	}
+
+	if (path == NULL || (f = fopen(tmp.c_str(), "w")) == NULL) {
+		ret = path ? errno : 0;
+	} else {
+		uint64_t total = st->total.load(std::memory_order_relaxed);
+		fprintf(f, "# hz=%u seconds=%.1f samples=%llu dropped=%llu\n", prof_hz, seconds,
+			(unsigned long long)total, (unsigned long long)st->dropped.load(std::memory_order_relaxed));
+		for (unsigned idx = 0; idx <= EXT_MAX; idx++) {
+			uint64_t n = st->samples[idx].load(std::memory_order_relaxed);
+			if (n == 0)
+				continue;
+			fprintf(f, "%s samples=%llu share=%.2f%% self=%.2f%%\n", names[idx].c_str(), (unsigned long long)n,
+				100.0 * n / total, 100.0 * st->self[idx].load(std::memory_order_relaxed) / total);
+		}
+		fprintf(f, "# folded stacks\n");
+		for (auto it = folded.cbegin(); it != folded.cend(); ++it)
+			fprintf(f, "%s %llu\n", it->first.c_str(), (unsigned long long)it->second);
+		if (fclose(f)) {
+			ret = errno;
+			unlink(tmp.c_str());
+		} else if (rename(tmp.c_str(), path)) {
+			ret = errno;
+		}
+	}
+
+	delete [] st->ranges;
+	munmap(st->entries, PROF_ENTRIES * sizeof(struct prof_entry));
+	delete st;
+	return ret;
+}
+
+static void prof_on_signal(int signo)
+{
+	(void)signo;
+	sem_post(&prof_sem);
+}
+
+/* Profiling cannot be started from the signal handler */
+static void prof_runner(void)
+{
+	for (;;) {
+		std::string path;
+		unsigned seconds;
+
+		if (sem_wait(&prof_sem))
+			continue;
+		{
+			std::lock_guard<std::mutex> lock(prof_lock);
+			path = prof_path;
+			seconds = prof_seconds;
+		}
+		if (fd_ext_profile_start(100))
+			continue;
+		sleep(seconds);
+		fd_ext_profile_stop(path.c_str());
+	}
+}
+
+/* Profile for seconds at 100 Hz each time signo is received, and write the report into path */
+int fd_ext_profile_signal(int signo, const char *path, unsigned seconds)
+{
+	struct sigaction sa;
+
+	if (path == NULL || seconds == 0 || signo == SIGPROF)
+		return EINVAL;
+
+	{
+		std::lock_guard<std::mutex> lock(prof_lock);
+		prof_path = path;
+		prof_seconds = seconds;
+		if (!prof_thread_started) {
+			if (sem_init(&prof_sem, 0, 0))
+				return errno;
+			std::thread(prof_runner).detach();
+			prof_thread_started = 1;
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = prof_on_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(signo, &sa, NULL))
+		return errno;
+	return 0;
+}
@@ -0,0 +1,190 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Grace periods for the code and data of the extensions.
+ *
+ * The threads calling into an extension do so between fd_ext_rcu_read_lock and
+ * fd_ext_rcu_read_unlock. Those only touch a counter owned by the calling thread,
+ * so the message path never waits. fd_ext_rcu_synchronize returns once every
+ * thread that was inside such a section when it was called has left it; after
+ * that, what was unpublished before the call (an extension copy, a hooks table)
+ * can no longer be in use and may be released.
+ */
+
+#include <stdlib.h>
+#include <sched.h>
+#include <new>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#include "extension_internal.h"
+
+/* One per thread, alone on its cache line as it is written on every read-side section */
+struct rcu_reader {
+	std::atomic<unsigned long>	ctr;		/* 0 when quiescent, else the grace period counter seen when entering */
+	unsigned			nesting;	/* read-side sections may be nested */
+	int				in_use;		/* owned by a live thread */
+} __attribute__((aligned(64)));
+
+/* Releases the reader of the thread when it exits */
+struct rcu_thread {
+	struct rcu_reader *reader;
+	~rcu_thread();
+};
+
+/* A release postponed by ext_rcu_defer */
+struct rcu_deferred {
+	void	(*fn)(void *);
+	void	*data;
+};
+
+static std::atomic<unsigned long> rcu_gp(1);
+static std::mutex rcu_lock;			/* protects rcu_readers, serializes the grace periods */
+static std::vector<struct rcu_reader*> rcu_readers;
+static thread_local struct rcu_thread rcu_self;
+static std::mutex rcu_defer_lock;
+static std::vector<struct rcu_deferred> rcu_defer_list;
+
+rcu_thread::~rcu_thread()
+{
+	if (reader) {
+		std::lock_guard<std::mutex> lock(rcu_lock);
+		reader->ctr.store(0, std::memory_order_release);
+		reader->nesting = 0;
+		reader->in_use = 0;
+		reader = NULL;
+	}
+}
+
+/* First read-side section of the thread */
+static struct rcu_reader * rcu_register(void)
+{
+	std::lock_guard<std::mutex> lock(rcu_lock);
+	struct rcu_reader * r = NULL;
+
+	for (auto it = rcu_readers.begin(); it != rcu_readers.end(); ++it) {
+		if (!(*it)->in_use) {
+			r = *it;
+			break;
+		}
+	}
+	if (r == NULL) {
+		void * mem;
+		if (posix_memalign(&mem, 64, sizeof(struct rcu_reader)))
+			abort();
+		r = new(mem) rcu_reader();
+		r->ctr.store(0, std::memory_order_relaxed);
+		rcu_readers.push_back(r);
+	}
+	r->nesting = 0;
+	r->in_use = 1;
+	rcu_self.reader = r;
+	return r;
+}
+
+void fd_ext_rcu_read_lock(void)
+{
+	struct rcu_reader * r = rcu_self.reader;
+
+	if (r == NULL)
+		r = rcu_register();
+	if (r->nesting++ == 0) {
+		r->ctr.store(rcu_gp.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		/* the counter must be visible before the protected pointers are read */
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+}
+
+void fd_ext_rcu_read_unlock(void)
+{
+	struct rcu_reader * r = rcu_self.reader;
+
+	if (--r->nesting == 0)
+		r->ctr.store(0, std::memory_order_release);
+}
+
+/* Must not be called inside a read-side section */
+void fd_ext_rcu_synchronize(void)
+{
+	std::lock_guard<std::mutex> lock(rcu_lock);
+	unsigned long gp;
+
+	/* the pointers unpublished by the caller must be visible before the readers are checked */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	gp = rcu_gp.fetch_add(1) + 1;
+
+	for (auto it = rcu_readers.cbegin(); it != rcu_readers.cend(); ++it) {
+		unsigned long c;
+		unsigned spin = 0;
+		while ((c = (*it)->ctr.load(std::memory_order_acquire)) != 0 && c < gp) {
+			if (++spin > 100)
+				sched_yield();
+		}
+	}
+}
+
+int ext_rcu_in_read(void)
+{
+	return rcu_self.reader && rcu_self.reader->nesting;
+}
+
+/* Run the releases queued so far, after a grace period */
+void ext_rcu_barrier(void)
+{
+	std::vector<struct rcu_deferred> list;
+
+	{
+		std::lock_guard<std::mutex> lock(rcu_defer_lock);
+		list.swap(rcu_defer_list);
+	}
+	if (list.empty())
+		return;
+	fd_ext_rcu_synchronize();
+	for (auto it = list.cbegin(); it != list.cend(); ++it)
+		(*it->fn)(it->data);
+}
+
+/* Call fn(data) once no reader can see data anymore; inside a read-side section, this waits for the next barrier */
+void ext_rcu_defer(void (*fn)(void *), void *data)
+{
+	{
+		std::lock_guard<std::mutex> lock(rcu_defer_lock);
+		struct rcu_deferred d = { fn, data };
+		rcu_defer_list.push_back(d);
+	}
+	if (!ext_rcu_in_read())
+		ext_rcu_barrier();
+}
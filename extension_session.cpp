@@ -0,0 +1,459 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Session state of the extensions.
+ *
+ * One hash table, shared by all the extensions, keeps the state each extension stores
+ * for a Session-Id; the key is the Session-Id and the index of the extension, so each
+ * one has its own namespace. The state is copied inline into the entry, a single block
+ * taken from the memory service of the extension (extension_alloc.cpp), so that it is
+ * charged to it and shows in its statistics.
+ *
+ * The buckets are singly-linked lists read without lock in the read-side sections the
+ * hooks run in; the writers take the lock of a stripe of buckets, publish the entries
+ * with release stores, and retire those they replace or remove. A thread of the store
+ * frees the retired entries by batches after a grace period, and removes the entries
+ * past their TTL every second; an expired entry is not returned meanwhile. The number of
+ * buckets is fixed (SessionBuckets in extensions.cfg, 65536 by default). The entries of
+ * an extension are removed by fd_ext_term.
+ */
+
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "extension_internal.h"
+
+#define SESS_STRIPES		256
+#define SESS_SWEEP_MS		1000
+#define SESS_RETIRE_BATCH	4096		/* retired entries which wake the thread up before its period */
+#define SESS_AVP_SESSION_ID	263
+
+/* The state follows the header, 16 bytes aligned, then the Session-Id */
+struct sess_entry {
+	std::atomic<struct sess_entry*>	next;
+	uint64_t			hash;
+	std::atomic<uint64_t>		expires;	/* ext_now_ns(), 0 if it does not expire */
+	uint32_t			ns;		/* index of the extension */
+	uint32_t			sid_len;
+	uint32_t			size;
+} __attribute__((aligned(16)));
+
+struct sess_stripe {
+	std::mutex	lock;
+} __attribute__((aligned(64)));
+
+struct sess_table {
+	std::atomic<struct sess_entry*>	*buckets;
+	uint64_t			mask;
+	struct sess_stripe		stripes[SESS_STRIPES];
+};
+
+static unsigned sess_nbuckets = 65536;
+static std::atomic<struct sess_table*> sess_table;
+static std::atomic<int64_t> sess_count[EXT_MAX];
+
+static std::mutex sess_lock;			/* creation of the table, the retired entries and the thread */
+/* never destroyed: the sweeper left running for an abandoned extension (ext_session_leave) waits on it at exit */
+static std::condition_variable & sess_cond = *new std::condition_variable();
+static std::vector<struct sess_entry*> sess_retired;
+static std::thread sess_thread;
+static int sess_stop;
+
+void ext_session_configure(unsigned buckets)
+{
+	sess_nbuckets = 1;
+	while (sess_nbuckets < buckets && sess_nbuckets < (1U << 30))
+		sess_nbuckets <<= 1;
+}
+
+static inline void * sess_state(struct sess_entry * e)
+{
+	return e + 1;
+}
+
+static inline char * sess_sid(struct sess_entry * e)
+{
+	return (char *)(e + 1) + ((e->size + 15) & ~15U);
+}
+
+static uint64_t sess_hash(unsigned ns, const char * sid, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)sid[i];
+		h *= 1099511628211ULL;
+	}
+	return h ^ ((ns + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+static inline int sess_expired(struct sess_entry * e, uint64_t now)
+{
+	uint64_t exp = e->expires.load(std::memory_order_relaxed);
+	return exp && exp <= now;
+}
+
+static inline int sess_match(struct sess_entry * e, uint64_t h, unsigned ns, const char * sid, size_t len)
+{
+	return e->hash == h && e->ns == ns && e->sid_len == len && !memcmp(sess_sid(e), sid, len);
+}
+
+static void sess_free_batch(void * data)
+{
+	std::vector<struct sess_entry*> * batch = (std::vector<struct sess_entry*> *)data;
+
+	for (auto it = batch->begin(); it != batch->end(); ++it)
+		ext_alloc_ops.mem_free(*it);
+	delete batch;
+}
+
+/* Unlinked already, freed once no reader can see it */
+static void sess_retire(struct sess_entry * e)
+{
+	sess_count[e->ns].fetch_sub(1, std::memory_order_relaxed);
+	std::lock_guard<std::mutex> lock(sess_lock);
+	sess_retired.push_back(e);
+	if (sess_retired.size() == SESS_RETIRE_BATCH)
+		sess_cond.notify_one();
+}
+
+/* Hand the retired entries to a grace period; outside of any read-side section */
+static void sess_flush(void)
+{
+	std::vector<struct sess_entry*> * batch = new std::vector<struct sess_entry*>();
+
+	{
+		std::lock_guard<std::mutex> lock(sess_lock);
+		batch->swap(sess_retired);
+	}
+	if (batch->empty()) {
+		delete batch;
+		return;
+	}
+	ext_rcu_defer(sess_free_batch, batch);
+}
+
+/* Remove the entries past their TTL, or those of an extension when ns is not EXT_MAX */
+static void sess_sweep(struct sess_table * t, unsigned ns)
+{
+	uint64_t now = ext_now_ns();
+
+	for (uint64_t b = 0; b <= t->mask; b++) {
+		std::atomic<struct sess_entry*> * prev = &t->buckets[b];
+		struct sess_entry * e;
+
+		if (prev->load(std::memory_order_relaxed) == NULL)
+			continue;
+		std::lock_guard<std::mutex> lock(t->stripes[b & (SESS_STRIPES - 1)].lock);
+		while ((e = prev->load(std::memory_order_relaxed)) != NULL) {
+			if (ns == EXT_MAX ? sess_expired(e, now) : e->ns == ns) {
+				prev->store(e->next.load(std::memory_order_relaxed), std::memory_order_release);
+				sess_retire(e);
+			} else {
+				prev = &e->next;
+			}
+		}
+	}
+}
+
+static void sess_run(void)
+{
+	std::unique_lock<std::mutex> lock(sess_lock);
+	auto next = std::chrono::steady_clock::now() + std::chrono::milliseconds(SESS_SWEEP_MS);
+
+	while (!sess_stop) {
+		sess_cond.wait_until(lock, next);
+		if (sess_stop)
+			break;
+		lock.unlock();
+		if (std::chrono::steady_clock::now() >= next) {
+			sess_sweep(sess_table.load(std::memory_order_acquire), EXT_MAX);
+			next = std::chrono::steady_clock::now() + std::chrono::milliseconds(SESS_SWEEP_MS);
+		}
+		sess_flush();
+		lock.lock();
+	}
+}
+
+/* The table, created on the first store */
+static struct sess_table * sess_open(void)
+{
+	struct sess_table * t = sess_table.load(std::memory_order_acquire);
+
+	if (t != NULL)
+		return t;
+	std::lock_guard<std::mutex> lock(sess_lock);
+	if ((t = sess_table.load(std::memory_order_relaxed)) != NULL)
+		return t;
+	t = new (std::nothrow) struct sess_table();
+	if (t == NULL)
+		return NULL;
+	t->buckets = new (std::nothrow) std::atomic<struct sess_entry*>[sess_nbuckets]();
+	if (t->buckets == NULL) {
+		delete t;
+		return NULL;
+	}
+	t->mask = sess_nbuckets - 1;
+	sess_stop = 0;
+	sess_thread = std::thread(sess_run);
+	sess_table.store(t, std::memory_order_release);
+	return t;
+}
+
+/* A new entry of the extension, its state zeroed */
+static struct sess_entry * sess_new(struct fd_ext_arg * self, uint64_t h, const char * sid, size_t len, size_t size, uint64_t ttl_ms)
+{
+	size_t ssize = (size + 15) & ~(size_t)15;
+	struct sess_entry * e = (struct sess_entry *)ext_alloc_ops.mem_alloc(self, sizeof(*e) + ssize + len);
+
+	if (e == NULL)
+		return NULL;
+	new (&e->next) std::atomic<struct sess_entry*>(NULL);
+	new (&e->expires) std::atomic<uint64_t>(ttl_ms ? ext_now_ns() + ttl_ms * 1000000ULL : 0);
+	e->hash = h;
+	e->ns = ext_inst_of(self)->ext->idx;
+	e->sid_len = len;
+	e->size = size;
+	memset(sess_state(e), 0, ssize);
+	memcpy(sess_sid(e), sid, len);
+	sess_count[e->ns].fetch_add(1, std::memory_order_relaxed);
+	return e;
+}
+
+/* The Session-Id AVP of the message, its first AVP normally */
+static int sess_id(struct fd_ext_msg * msg, struct fd_ext_cfg_view * sid)
+{
+	size_t off = 20;
+
+	while (msg->data && off + 8 <= msg->len) {
+		const uint8_t * avp = msg->data + off;
+		uint32_t code = ((uint32_t)avp[0] << 24) | (avp[1] << 16) | (avp[2] << 8) | avp[3];
+		uint32_t alen = (avp[5] << 16) | (avp[6] << 8) | avp[7];
+		size_t hdr = (avp[4] & 0x80) ? 12 : 8;
+
+		if (alen < hdr || alen > msg->len - off)
+			return EINVAL;
+		if (code == SESS_AVP_SESSION_ID && hdr == 8) {
+			sid->ptr = (const char *)avp + hdr;
+			sid->len = alen - hdr;
+			return 0;
+		}
+		off += (alen + 3) & ~3U;
+	}
+	return ENOENT;
+}
+
+static const void * sess_get(struct fd_ext_arg * self, const char * sid, size_t len, size_t * size)
+{
+	struct sess_table * t = sess_table.load(std::memory_order_acquire);
+	unsigned ns = ext_inst_of(self)->ext->idx;
+	uint64_t h = sess_hash(ns, sid, len);
+	struct sess_entry * e;
+
+	if (t == NULL)
+		return NULL;
+	for (e = t->buckets[h & t->mask].load(std::memory_order_acquire); e; e = e->next.load(std::memory_order_acquire)) {
+		if (sess_match(e, h, ns, sid, len)) {
+			if (sess_expired(e, ext_now_ns()))
+				return NULL;
+			if (size)
+				*size = e->size;
+			return sess_state(e);
+		}
+	}
+	return NULL;
+}
+
+/* Under the lock of the stripe: the link to the entry of the session, or to the end of the bucket */
+static std::atomic<struct sess_entry*> * sess_find(struct sess_table * t, uint64_t h, unsigned ns, const char * sid, size_t len)
+{
+	std::atomic<struct sess_entry*> * prev = &t->buckets[h & t->mask];
+	struct sess_entry * e;
+
+	while ((e = prev->load(std::memory_order_relaxed)) != NULL && !sess_match(e, h, ns, sid, len))
+		prev = &e->next;
+	return prev;
+}
+
+/* Publish e in place of the entry prev links to, if any */
+static void sess_replace(std::atomic<struct sess_entry*> * prev, struct sess_entry * e)
+{
+	struct sess_entry * old = prev->load(std::memory_order_relaxed);
+
+	e->next.store(old ? old->next.load(std::memory_order_relaxed) : NULL, std::memory_order_relaxed);
+	prev->store(e, std::memory_order_release);
+	if (old)
+		sess_retire(old);
+}
+
+static int sess_put(struct fd_ext_arg * self, const char * sid, size_t len, const void * state, size_t size, uint64_t ttl_ms)
+{
+	struct sess_table * t = sess_open();
+	unsigned ns = ext_inst_of(self)->ext->idx;
+	uint64_t h = sess_hash(ns, sid, len);
+	struct sess_entry * e;
+
+	if (t == NULL)
+		return ENOMEM;
+	if (sid == NULL || len == 0 || size > UINT32_MAX || len > UINT32_MAX)
+		return EINVAL;
+	e = sess_new(self, h, sid, len, size, ttl_ms);
+	if (e == NULL)
+		return ENOMEM;
+	if (size)
+		memcpy(sess_state(e), state, size);
+
+	std::lock_guard<std::mutex> lock(t->stripes[h & t->mask & (SESS_STRIPES - 1)].lock);
+	sess_replace(sess_find(t, h, ns, sid, len), e);
+	return 0;
+}
+
+static int sess_update(struct fd_ext_arg * self, const char * sid, size_t len, size_t size, uint64_t ttl_ms,
+			void (*cb)(void * state, int created, void * data), void * data)
+{
+	struct sess_table * t = sess_open();
+	unsigned ns = ext_inst_of(self)->ext->idx;
+	uint64_t h = sess_hash(ns, sid, len);
+	std::atomic<struct sess_entry*> * prev;
+	struct sess_entry * e, * old;
+
+	if (t == NULL)
+		return ENOMEM;
+	if (sid == NULL || len == 0 || cb == NULL || size > UINT32_MAX || len > UINT32_MAX)
+		return EINVAL;
+
+	std::lock_guard<std::mutex> lock(t->stripes[h & t->mask & (SESS_STRIPES - 1)].lock);
+	prev = sess_find(t, h, ns, sid, len);
+	old = prev->load(std::memory_order_relaxed);
+	if (old != NULL && old->size == size && !sess_expired(old, ext_now_ns())) {
+		old->expires.store(ttl_ms ? ext_now_ns() + ttl_ms * 1000000ULL : 0, std::memory_order_relaxed);
+		(*cb)(sess_state(old), 0, data);
+		return 0;
+	}
+
+	/* absent, expired or of another size: a new entry, with what fits of the previous state */
+	e = sess_new(self, h, sid, len, size, ttl_ms);
+	if (e == NULL)
+		return ENOMEM;
+	if (old != NULL && !sess_expired(old, ext_now_ns()))
+		memcpy(sess_state(e), sess_state(old), old->size < size ? old->size : size);
+	(*cb)(sess_state(e), old == NULL || sess_expired(old, ext_now_ns()), data);
+	sess_replace(prev, e);
+	return 0;
+}
+
+static int sess_remove(struct fd_ext_arg * self, const char * sid, size_t len)
+{
+	struct sess_table * t = sess_table.load(std::memory_order_acquire);
+	unsigned ns = ext_inst_of(self)->ext->idx;
+	uint64_t h = sess_hash(ns, sid, len);
+	std::atomic<struct sess_entry*> * prev;
+	struct sess_entry * e;
+
+	if (t == NULL)
+		return ENOENT;
+
+	std::lock_guard<std::mutex> lock(t->stripes[h & t->mask & (SESS_STRIPES - 1)].lock);
+	prev = sess_find(t, h, ns, sid, len);
+	if ((e = prev->load(std::memory_order_relaxed)) == NULL)
+		return ENOENT;
+	prev->store(e->next.load(std::memory_order_relaxed), std::memory_order_release);
+	sess_retire(e);
+	return sess_expired(e, ext_now_ns()) ? ENOENT : 0;
+}
+
+const struct fd_ext_sessions ext_session_ops = {
+	sess_id,
+	sess_get,
+	sess_put,
+	sess_update,
+	sess_remove
+};
+
+uint64_t ext_session_count(unsigned idx)
+{
+	int64_t n = sess_count[idx].load(std::memory_order_relaxed);
+	return n > 0 ? n : 0;
+}
+
+/* fd_ext_term: the namespace of the extension is emptied */
+void ext_session_release(unsigned idx)
+{
+	struct sess_table * t = sess_table.load(std::memory_order_acquire);
+
+	if (t != NULL && sess_count[idx].load(std::memory_order_relaxed) > 0)
+		sess_sweep(t, idx);
+}
+
+/* An abandoned copy may still use the store: the sweeper runs until the process exits */
+void ext_session_leave(void)
+{
+	std::lock_guard<std::mutex> lock(sess_lock);
+
+	if (sess_thread.joinable())
+		sess_thread.detach();
+}
+
+/* Then the retired entries are freed, and the table once empty; it stays if an extension still running has entries */
+void ext_session_stop(void)
+{
+	struct sess_table * t = sess_table.load(std::memory_order_acquire);
+
+	if (t == NULL)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(sess_lock);
+		sess_stop = 1;
+		sess_cond.notify_all();
+	}
+	sess_thread.join();
+	sess_flush();
+	for (unsigned i = 0; i < EXT_MAX; i++) {
+		if (sess_count[i].load(std::memory_order_relaxed) > 0) {
+			std::lock_guard<std::mutex> lock(sess_lock);
+			sess_stop = 0;
+			sess_thread = std::thread(sess_run);
+			return;
+		}
+	}
+	sess_table.store(NULL, std::memory_order_release);
+	fd_ext_rcu_synchronize();
+	delete [] t->buckets;
+	delete t;
+}
@@ -0,0 +1,613 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Snapshot of the dictionary objects added by the extensions, for warm starts.
+ *
+ * The objects created through the dict_new service while fd_ext_load runs are
+ * journaled. Once all extensions are initialized, the journal is written into a
+ * versioned file, keyed by a hash of the loaded .fdx and .cfg files. References to
+ * other objects are stored as an index in the journal or as a search key (code,
+ * name), never as pointers, so the file does not depend on where the dictionary
+ * lives. On the next start with the same key, the file is mapped and replayed
+ * before any extension is initialized, and the extensions are told with
+ * fd_ext_arg.warm_start that their dict_new work is already done.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+
+#include "cch_port.h"
+#include "diameter_base.h"
+#include "extension_internal.h"
+#include "dict.h"
+
+#define SNAP_MAGIC	"FDXDICT"
+#define SNAP_VERSION	1
+
+struct snap_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	count;		/* records following the header */
+	uint64_t	key;		/* hash of the extensions and their configuration */
+	uint64_t	size;		/* of the whole file */
+};
+
+/* How a referenced object is found again */
+enum snap_ref_kind {
+	SNAP_REF_NONE = 0,
+	SNAP_REF_JOURNAL,		/* created by the record number 'code' */
+	SNAP_REF_VENDOR,		/* by id */
+	SNAP_REF_APPLICATION,		/* by id */
+	SNAP_REF_TYPE,			/* by name */
+	SNAP_REF_AVP,			/* by code and vendor */
+	SNAP_REF_COMMAND,		/* by name */
+};
+
+struct snap_ref {
+	uint32_t	kind;
+	uint32_t	code;
+	uint32_t	vendor;
+	uint32_t	name_off;	/* in the strings of the record */
+	uint32_t	name_len;
+};
+
+/* One fd_dict_new; the strings follow the fixed part, records are 8 bytes aligned */
+struct snap_rec {
+	uint32_t	size;
+	uint32_t	type;		/* enum dict_object_type */
+	struct snap_ref	parent;
+	struct snap_ref	avp;		/* rule_avp of the rules */
+	uint32_t	u[5];		/* integer fields of the data, depending on the type */
+	uint32_t	name_off;
+	uint32_t	name_len;
+	uint32_t	os_off;		/* octetstring value of the enumerated values */
+	uint32_t	os_len;
+	uint8_t		value[8];	/* other values of the enumerated values */
+};
+
+static std::mutex snap_lock;
+static std::string snap_path;		/* empty when disabled */
+static uint64_t snap_key;
+static int snap_recording = 0;
+static int snap_broken = 0;		/* something was journaled which cannot be replayed */
+static std::vector<std::vector<uint8_t> > snap_journal;
+static std::unordered_map<struct dict_object*, uint32_t> snap_objects;	/* object created -> record */
+int ext_snap_warm = 0;
+
+static uint64_t snap_hash(uint64_t h, const void * data, size_t len)
+{
+	const uint8_t * p = (const uint8_t *)data;
+
+	/* FNV-1a */
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t snap_hash_file(uint64_t h, const char * path)
+{
+	struct stat st;
+	void * map;
+	int fd;
+
+	h = snap_hash(h, path, strlen(path) + 1);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return snap_hash(h, "", 1);
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			h = snap_hash(h, map, st.st_size);
+			munmap(map, st.st_size);
+		}
+	}
+	close(fd);
+	return h;
+}
+
+/* Called by fd_ext_initialize, an empty path disables the snapshot */
+void ext_snap_configure(const char * path)
+{
+	std::lock_guard<std::mutex> lock(snap_lock);
+	snap_path = path;
+}
+
+/* Append a string to the record being built, returns its offset */
+static uint32_t snap_str(std::vector<uint8_t> & rec, const void * s, size_t len)
+{
+	uint32_t off = rec.size();
+	rec.insert(rec.end(), (const uint8_t *)s, (const uint8_t *)s + len);
+	return off;
+}
+
+/* How to find obj again. Called with snap_lock held. */
+static int snap_ref(std::vector<uint8_t> & rec, size_t ref_off, struct dict_object * obj)
+{
+	dictionary *pDictionary = dictionary::getInstance();
+	enum dict_object_type type;
+	struct snap_ref ref;
+	union {
+		struct dict_vendor_data		vendor;
+		struct dict_application_data	application;
+		struct dict_type_data		type;
+		struct dict_avp_data		avp;
+		struct dict_cmd_data		cmd;
+	} data;
+
+	memset(&ref, 0, sizeof(ref));
+	if (obj != NULL) {
+		auto it = snap_objects.find(obj);
+		if (it != snap_objects.end()) {
+			ref.kind = SNAP_REF_JOURNAL;
+			ref.code = it->second;
+		} else {
+			/* from the base dictionary */
+			if (pDictionary->fd_dict_gettype(obj, &type) || pDictionary->fd_dict_getval(obj, &data))
+				return EINVAL;
+			switch (type) {
+			case DICT_VENDOR:
+				ref.kind = SNAP_REF_VENDOR;
+				ref.code = data.vendor.vendor_id;
+				break;
+			case DICT_APPLICATION:
+				ref.kind = SNAP_REF_APPLICATION;
+				ref.code = data.application.application_id;
+				break;
+			case DICT_TYPE:
+				ref.kind = SNAP_REF_TYPE;
+				ref.name_len = strlen(data.type.type_name);
+				ref.name_off = snap_str(rec, data.type.type_name, ref.name_len);
+				break;
+			case DICT_AVP:
+				ref.kind = SNAP_REF_AVP;
+				ref.code = data.avp.avp_code;
+				ref.vendor = data.avp.avp_vendor;
+				break;
+			case DICT_COMMAND:
+				ref.kind = SNAP_REF_COMMAND;
+				ref.name_len = strlen(data.cmd.cmd_name);
+				ref.name_off = snap_str(rec, data.cmd.cmd_name, ref.name_len);
+				break;
+			default:
+				return ENOTSUP;
+			}
+		}
+	}
+	memcpy(&rec[ref_off], &ref, sizeof(ref));
+	return 0;
+}
+
+/* Journal an object created with the dict_new service */
+void ext_snap_record(int type, void * data, struct dict_object * parent, struct dict_object * obj)
+{
+	std::lock_guard<std::mutex> lock(snap_lock);
+	dictionary *pDictionary = dictionary::getInstance();
+	std::vector<uint8_t> rec(sizeof(struct snap_rec), 0);
+	struct snap_rec r;
+	const char * name = NULL;
+	int ret;
+
+	if (!snap_recording || snap_broken || obj == NULL)
+		return;
+
+	memset(&r, 0, sizeof(r));
+	r.type = type;
+	switch (type) {
+	case DICT_VENDOR: {
+		struct dict_vendor_data * d = (struct dict_vendor_data *)data;
+		r.u[0] = d->vendor_id;
+		name = d->vendor_name;
+		break;
+	}
+	case DICT_APPLICATION: {
+		struct dict_application_data * d = (struct dict_application_data *)data;
+		r.u[0] = d->application_id;
+		name = d->application_name;
+		break;
+	}
+	case DICT_TYPE: {
+		struct dict_type_data * d = (struct dict_type_data *)data;
+		/* the callbacks live in the extension, they cannot be written down */
+		if (d->type_interpret || d->type_encode || d->type_dump) {
+			snap_broken = 1;
+			return;
+		}
+		r.u[0] = d->type_base;
+		name = d->type_name;
+		break;
+	}
+	case DICT_ENUMVAL: {
+		struct dict_enumval_data * d = (struct dict_enumval_data *)data;
+		struct dict_type_data t;
+		if (parent == NULL || pDictionary->fd_dict_getval(parent, &t)) {
+			snap_broken = 1;
+			return;
+		}
+		if (t.type_base == AVP_TYPE_OCTETSTRING) {
+			r.os_len = d->enum_value.os.len;
+			r.os_off = snap_str(rec, d->enum_value.os.data, r.os_len);
+		} else {
+			memcpy(r.value, &d->enum_value, sizeof(r.value));
+		}
+		name = d->enum_name;
+		break;
+	}
+	case DICT_AVP: {
+		struct dict_avp_data * d = (struct dict_avp_data *)data;
+		r.u[0] = d->avp_code;
+		r.u[1] = d->avp_vendor;
+		r.u[2] = d->avp_flag_mask;
+		r.u[3] = d->avp_flag_val;
+		r.u[4] = d->avp_basetype;
+		name = d->avp_name;
+		break;
+	}
+	case DICT_COMMAND: {
+		struct dict_cmd_data * d = (struct dict_cmd_data *)data;
+		r.u[0] = d->cmd_code;
+		r.u[1] = d->cmd_flag_mask;
+		r.u[2] = d->cmd_flag_val;
+		name = d->cmd_name;
+		break;
+	}
+	case DICT_RULE: {
+		struct dict_rule_data * d = (struct dict_rule_data *)data;
+		r.u[0] = d->rule_position;
+		r.u[1] = d->rule_order;
+		r.u[2] = d->rule_min;
+		r.u[3] = d->rule_max;
+		if (snap_ref(rec, offsetof(struct snap_rec, avp), d->rule_avp)) {
+			snap_broken = 1;
+			return;
+		}
+		break;
+	}
+	default:
+		snap_broken = 1;
+		return;
+	}
+	if (name) {
+		r.name_len = strlen(name);
+		r.name_off = snap_str(rec, name, r.name_len);
+	}
+	ret = snap_ref(rec, offsetof(struct snap_rec, parent), parent);
+	if (ret) {
+		snap_broken = 1;
+		return;
+	}
+
+	/* the references were written into rec, keep them */
+	memcpy(&r.parent, &rec[offsetof(struct snap_rec, parent)], sizeof(r.parent));
+	memcpy(&r.avp, &rec[offsetof(struct snap_rec, avp)], sizeof(r.avp));
+	rec.resize((rec.size() + 7) & ~(size_t)7, 0);
+	r.size = rec.size();
+	memcpy(&rec[0], &r, sizeof(r));
+
+	snap_objects[obj] = snap_journal.size();
+	snap_journal.push_back(rec);
+}
+
+/* Find a referenced object while replaying */
+static struct dict_object * snap_resolve(const struct snap_rec * r, const struct snap_ref * ref,
+					const std::vector<struct dict_object*> & created)
+{
+	dictionary *pDictionary = dictionary::getInstance();
+	struct dict_object * obj = NULL;
+	struct dict_avp_request req;
+	std::string name((const char *)r + ref->name_off, ref->name_len);
+
+	switch (ref->kind) {
+	case SNAP_REF_JOURNAL:
+		return ref->code < created.size() ? created[ref->code] : NULL;
+	case SNAP_REF_VENDOR:
+		pDictionary->fd_dict_search(DICT_VENDOR, VENDOR_BY_ID, &ref->code, &obj, 0);
+		break;
+	case SNAP_REF_APPLICATION:
+		pDictionary->fd_dict_search(DICT_APPLICATION, APPLICATION_BY_ID, &ref->code, &obj, 0);
+		break;
+	case SNAP_REF_TYPE:
+		pDictionary->fd_dict_search(DICT_TYPE, TYPE_BY_NAME, name.c_str(), &obj, 0);
+		break;
+	case SNAP_REF_AVP:
+		req.avp_vendor = ref->vendor;
+		req.avp_code = ref->code;
+		req.avp_name = NULL;
+		pDictionary->fd_dict_search(DICT_AVP, AVP_BY_CODE_AND_VENDOR, &req, &obj, 0);
+		break;
+	case SNAP_REF_COMMAND:
+		pDictionary->fd_dict_search(DICT_COMMAND, CMD_BY_NAME, name.c_str(), &obj, 0);
+		break;
+	}
+	return obj;
+}
+
+/* A reference of the record number i, to an earlier record or to an object already in the dictionary */
+static int snap_check_ref(const struct snap_rec * r, const struct snap_ref * ref, uint32_t i, struct dict_object ** out)
+{
+	static const std::vector<struct dict_object*> none;
+
+	*out = NULL;
+	if (ref->kind == SNAP_REF_NONE)
+		return 0;
+	if (r->size < ref->name_off || r->size - ref->name_off < ref->name_len)
+		return EINVAL;
+	if (ref->kind == SNAP_REF_JOURNAL)
+		return ref->code < i ? 0 : EINVAL;
+	*out = snap_resolve(r, ref, none);
+	return *out ? 0 : ENOENT;
+}
+
+/* Create the objects of the snapshot. All the records are checked and the references to the objects
+ * which are not in the snapshot resolved first, so that nothing is created from a snapshot which
+ * cannot be replayed; *created_count tells how many objects were created when an error is returned. */
+static int snap_replay(const uint8_t * map, size_t size, uint32_t * created_count)
+{
+	dictionary *pDictionary = dictionary::getInstance();
+	const struct snap_header * hdr = (const struct snap_header *)map;
+	std::vector<struct dict_object*> created;
+	std::vector<struct dict_object*> parents, avps;
+	std::vector<size_t> offs;
+	size_t off = sizeof(*hdr);
+	int ret;
+
+	*created_count = 0;
+	/* each record takes at least its fixed part */
+	if (hdr->count > (size - sizeof(*hdr)) / sizeof(struct snap_rec))
+		return EINVAL;
+	parents.resize(hdr->count);
+	avps.resize(hdr->count);
+	offs.resize(hdr->count);
+	for (uint32_t i = 0; i < hdr->count; i++) {
+		const struct snap_rec * r = (const struct snap_rec *)(map + off);
+
+		if (off + sizeof(*r) > size || r->size < sizeof(*r) || off + r->size > size
+				|| r->name_off > r->size || r->size - r->name_off < r->name_len
+				|| r->os_off > r->size || r->size - r->os_off < r->os_len)
+			return EINVAL;
+		switch (r->type) {
+		case DICT_VENDOR:
+		case DICT_APPLICATION:
+		case DICT_TYPE:
+		case DICT_ENUMVAL:
+		case DICT_AVP:
+		case DICT_COMMAND:
+			break;
+		case DICT_RULE:
+			if (r->avp.kind == SNAP_REF_NONE)
+				return EINVAL;
+			break;
+		default:
+			return EINVAL;
+		}
+		ret = snap_check_ref(r, &r->parent, i, &parents[i]);
+		if (ret == 0 && r->type == DICT_RULE)
+			ret = snap_check_ref(r, &r->avp, i, &avps[i]);
+		if (ret)
+			return ret;
+		offs[i] = off;
+		off += r->size;
+	}
+
+	for (uint32_t i = 0; i < hdr->count; i++) {
+		const struct snap_rec * r = (const struct snap_rec *)(map + offs[i]);
+		struct dict_object * parent = parents[i], * obj = NULL;
+		std::string name, os;
+		union {
+			struct dict_vendor_data		vendor;
+			struct dict_application_data	application;
+			struct dict_type_data		type;
+			struct dict_enumval_data	enumval;
+			struct dict_avp_data		avp;
+			struct dict_cmd_data		cmd;
+			struct dict_rule_data		rule;
+		} data;
+
+		name.assign((const char *)r + r->name_off, r->name_len);
+		os.assign((const char *)r + r->os_off, r->os_len);
+		if (r->parent.kind == SNAP_REF_JOURNAL)
+			parent = created[r->parent.code];
+
+		memset(&data, 0, sizeof(data));
+		switch (r->type) {
+		case DICT_VENDOR:
+			data.vendor.vendor_id = r->u[0];
+			data.vendor.vendor_name = (char *)name.c_str();
+			break;
+		case DICT_APPLICATION:
+			data.application.application_id = r->u[0];
+			data.application.application_name = (char *)name.c_str();
+			break;
+		case DICT_TYPE:
+			data.type.type_base = (enum dict_avp_basetype)r->u[0];
+			data.type.type_name = (char *)name.c_str();
+			break;
+		case DICT_ENUMVAL:
+			data.enumval.enum_name = (char *)name.c_str();
+			if (r->os_len) {
+				data.enumval.enum_value.os.data = (uint8_t *)os.data();
+				data.enumval.enum_value.os.len = os.size();
+			} else {
+				memcpy(&data.enumval.enum_value, r->value, sizeof(r->value));
+			}
+			break;
+		case DICT_AVP:
+			data.avp.avp_code = r->u[0];
+			data.avp.avp_vendor = r->u[1];
+			data.avp.avp_flag_mask = r->u[2];
+			data.avp.avp_flag_val = r->u[3];
+			data.avp.avp_basetype = (enum dict_avp_basetype)r->u[4];
+			data.avp.avp_name = (char *)name.c_str();
+			break;
+		case DICT_COMMAND:
+			data.cmd.cmd_code = r->u[0];
+			data.cmd.cmd_flag_mask = r->u[1];
+			data.cmd.cmd_flag_val = r->u[2];
+			data.cmd.cmd_name = (char *)name.c_str();
+			break;
+		case DICT_RULE:
+			data.rule.rule_position = (enum rule_position)r->u[0];
+			data.rule.rule_order = r->u[1];
+			data.rule.rule_min = r->u[2];
+			data.rule.rule_max = r->u[3];
+			data.rule.rule_avp = r->avp.kind == SNAP_REF_JOURNAL ? created[r->avp.code] : avps[i];
+			break;
+		}
+
+		ret = pDictionary->fd_dict_new((enum dict_object_type)r->type, &data, parent, &obj);
+		if (ret)
+			return ret;
+		created.push_back(obj);
+		*created_count = created.size();
+	}
+	return 0;
+}
+
+/* Called by fd_ext_load before any extension is initialized: compute the key, replay the snapshot if it matches */
+void ext_snap_open(void)
+{
+	std::lock_guard<std::mutex> lock(snap_lock);
+	struct snap_header hdr;
+	std::string path;
+	struct stat st;
+	void * map;
+	uint32_t created;
+	int fd, ret;
+
+	ext_snap_warm = 0;
+	snap_recording = 0;
+	snap_broken = 0;
+	snap_journal.clear();
+	snap_objects.clear();
+	if (snap_path.empty())
+		return;
+
+	snap_key = snap_hash(0xcbf29ce484222325ULL, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+	ret = FD_PROJECT_VERSION_MAJOR << 16 | FD_PROJECT_VERSION_MINOR;
+	snap_key = snap_hash(snap_key, &ret, sizeof(ret));
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+		snap_key = snap_hash_file(snap_key, (*li)->filename);
+		snap_key = snap_hash_file(snap_key, (*li)->conffile);
+	}
+
+	path = snap_path;
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		snap_recording = 1;
+		return;
+	}
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(hdr) || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+			|| memcmp(hdr.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) || hdr.version != SNAP_VERSION
+			|| hdr.key != snap_key || hdr.size != (uint64_t)st.st_size) {
+		/* stale, it will be replaced */
+		close(fd);
+		snap_recording = 1;
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		snap_recording = 1;
+		return;
+	}
+	ret = snap_replay((const uint8_t *)map, st.st_size, &created);
+	munmap(map, st.st_size);
+	if (ret) {
+		//TRACE_ERROR("Replay of the dictionary snapshot %s failed: %s, cold start", path.c_str(), strerror(ret));
+		/* Nothing was created: this start is journaled and replaces the file. Otherwise the dict_new calls
+		 * of the extensions fail on the objects already there and the journal would miss them: the file is
+		 * removed, the next start is cold and journaled. */
+		if (created == 0)
+			snap_recording = 1;
+		else
+			unlink(path.c_str());
+		return;
+	}
+	ext_snap_warm = 1;
+}
+
+/* Called by fd_ext_load once all extensions are initialized */
+int ext_snap_save(void)
+{
+	std::lock_guard<std::mutex> lock(snap_lock);
+	struct snap_header hdr;
+	std::string path, tmp;
+	int fd, ret = 0;
+
+	if (!snap_recording)
+		return 0;
+	snap_recording = 0;
+	if (snap_broken)
+		return ENOTSUP;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+	hdr.version = SNAP_VERSION;
+	hdr.count = snap_journal.size();
+	hdr.key = snap_key;
+	hdr.size = sizeof(hdr);
+	for (auto it = snap_journal.cbegin(); it != snap_journal.cend(); ++it)
+		hdr.size += it->size();
+
+	path = snap_path;
+	tmp = path + ".tmp";
+	fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return errno;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		ret = errno ?: EIO;
+	for (auto it = snap_journal.cbegin(); !ret && it != snap_journal.cend(); ++it) {
+		if (write(fd, it->data(), it->size()) != (ssize_t)it->size())
+			ret = errno ?: EIO;
+	}
+	if (close(fd) && !ret)
+		ret = errno;
+	if (!ret && rename(tmp.c_str(), path.c_str()))
+		ret = errno;
+	if (ret)
+		unlink(tmp.c_str());
+	snap_journal.clear();
+	snap_objects.clear();
+	return ret;
+}
@@ -0,0 +1,92 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Extensions linked into the daemon.
+ *
+ * An extension built with -DFD_EXT_STATIC=<name> ('make static' in extensions/makefile)
+ * is archived, not linked into a .fdx: EXTENSION_ENTRY places a descriptor with the
+ * addresses of its entry points (renamed <name>_fd_ext_init, ...) in the section
+ * fd_ext_registry, and the linker gathers the descriptors of all the archives linked into
+ * the daemon between __start_fd_ext_registry and __stop_fd_ext_registry. An extension of
+ * the configuration found in the registry takes the place of its .fdx: its manifest and
+ * its entry points come from the descriptor, nothing is dlopened, and the calls into it
+ * need no PLT nor GOT. It cannot be reloaded; hosted out of process, the helper still
+ * loads the .fdx.
+ */
+
+#include <strings.h>
+
+#include "extension_internal.h"
+
+/* Defined by the linker when at least one descriptor is linked in */
+extern "C" {
+extern const struct fd_ext_static __start_fd_ext_registry[] __attribute__((weak, visibility("hidden")));
+extern const struct fd_ext_static __stop_fd_ext_registry[] __attribute__((weak, visibility("hidden")));
+}
+
+/* The descriptor of the extension of that name, NULL if it is not linked in */
+const struct fd_ext_static * ext_static_find(const char * name)
+{
+	const struct fd_ext_static * d;
+
+	for (d = __start_fd_ext_registry; d != NULL && d < __stop_fd_ext_registry; d++) {
+		if (!strcasecmp(d->name, name))
+			return d;
+	}
+	return NULL;
+}
+
+/* Instead of dlopen: the entry points of the copy are those of the descriptor */
+int ext_static_open(struct fd_ext_inst * inst)
+{
+	const struct fd_ext_static * d = inst->ext->stat;
+
+	if (d->version != FD_EXT_NOTE_VERSION || d->init == NULL) {
+		//LOG_F("Extension %s linked in was built for another version of the API", d->name);
+		return EINVAL;
+	}
+	if (d->thread_fini != NULL && d->thread_init == NULL) {
+		//TRACE_ERROR("Extension %s has fd_ext_thread_fini but no fd_ext_thread_init", d->name);
+		return EINVAL;
+	}
+	inst->handler = NULL;
+	inst->depends = (const char **)d->depends;
+	inst->init = d->init;
+	inst->fini = d->fini;
+	inst->thread_init = d->thread_init;
+	inst->thread_fini = d->thread_fini;
+	inst->batch = d->batch;
+	return 0;
+}
@@ -0,0 +1,306 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Statistics of the extensions.
+ *
+ * The loading times are recorded by the loader. The calls into the extensions are
+ * counted per thread, each thread only writes its own counters so the messages path
+ * shares no cache line; the counters of all threads are added when they are read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <new>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+#include "extension_internal.h"
+
+/* Counters of an extension for a thread, written only by that thread */
+struct stats_ctr {
+	std::atomic<uint64_t>	calls;
+	std::atomic<uint64_t>	ns;
+	std::atomic<uint64_t>	hist[FD_EXT_STATS_BUCKETS];
+};
+
+/* Counters of a thread, kept when it exits so that the totals do not go backward */
+struct stats_thread {
+	std::atomic<struct stats_ctr*>	ctr[EXT_MAX];
+	int				in_use;
+};
+
+/* Gives the counters of the thread back when it exits */
+struct stats_self {
+	struct stats_thread *t;
+	~stats_self();
+};
+
+static std::mutex stats_lock;		/* protects stats_threads and the dump configuration */
+static std::vector<struct stats_thread*> stats_threads;
+static thread_local struct stats_self stats_me;
+
+/* dump on signal */
+static sem_t stats_sem;
+static std::string stats_path;
+static int stats_dumper_started = 0;
+
+stats_self::~stats_self()
+{
+	if (t) {
+		std::lock_guard<std::mutex> lock(stats_lock);
+		t->in_use = 0;
+		t = NULL;
+	}
+}
+
+static struct stats_thread * stats_register(void)
+{
+	std::lock_guard<std::mutex> lock(stats_lock);
+	struct stats_thread * t = NULL;
+
+	for (auto it = stats_threads.begin(); it != stats_threads.end(); ++it) {
+		if (!(*it)->in_use) {
+			t = *it;
+			break;
+		}
+	}
+	if (t == NULL) {
+		t = new(std::nothrow) stats_thread();
+		if (t == NULL)
+			return NULL;
+		stats_threads.push_back(t);
+	}
+	t->in_use = 1;
+	stats_me.t = t;
+	return t;
+}
+
+/* Single writer: no atomic read-modify-write needed */
+static inline void stats_add(std::atomic<uint64_t> & c, uint64_t v)
+{
+	c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+/* Account a call of ns nanoseconds into the extension */
+void ext_stats_record(unsigned idx, uint64_t ns)
+{
+	struct stats_thread * t = stats_me.t;
+	struct stats_ctr * c;
+	unsigned b;
+
+	if (t == NULL && (t = stats_register()) == NULL)
+		return;
+	c = t->ctr[idx].load(std::memory_order_relaxed);
+	if (c == NULL) {
+		/* first call of this thread into the extension */
+		c = new(std::nothrow) stats_ctr();
+		if (c == NULL)
+			return;
+		t->ctr[idx].store(c, std::memory_order_release);
+	}
+
+	b = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (b >= FD_EXT_STATS_BUCKETS)
+		b = FD_EXT_STATS_BUCKETS - 1;
+	stats_add(c->calls, 1);
+	stats_add(c->ns, ns);
+	stats_add(c->hist[b], 1);
+}
+
+/* The index is given to a new extension, after fd_ext_term: it does not inherit the calls of the previous one */
+void ext_stats_clear(unsigned idx)
+{
+	std::lock_guard<std::mutex> lock(stats_lock);
+
+	for (auto it = stats_threads.cbegin(); it != stats_threads.cend(); ++it) {
+		struct stats_ctr * c = (*it)->ctr[idx].load(std::memory_order_acquire);
+		if (c == NULL)
+			continue;
+		c->calls.store(0, std::memory_order_relaxed);
+		c->ns.store(0, std::memory_order_relaxed);
+		for (int b = 0; b < FD_EXT_STATS_BUCKETS; b++)
+			c->hist[b].store(0, std::memory_order_relaxed);
+	}
+}
+
+static void stats_merge(struct fd_ext_info * ext, struct fd_ext_stats * stats)
+{
+	std::lock_guard<std::mutex> lock(stats_lock);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->open_ns = ext->open_ns;
+	stats->init_ns = ext->init_ns;
+	stats->fini_ns = ext->fini_ns;
+	stats->state = ext->state.load(std::memory_order_relaxed);
+	stats->ready_ns = ext->ready_ns;
+	stats->reloads = ext->reloads;
+	stats->oop_calls = ext->oop_calls.load(std::memory_order_relaxed);
+	stats->oop_rtt_ns = ext->oop_rtt_ns.load(std::memory_order_relaxed);
+	stats->oop_depth_peak = ext->oop_depth_peak.load(std::memory_order_relaxed);
+	ext_alloc_stats(ext->idx, stats);
+	stats->sessions = ext_session_count(ext->idx);
+	for (auto it = stats_threads.cbegin(); it != stats_threads.cend(); ++it) {
+		struct stats_ctr * c = (*it)->ctr[ext->idx].load(std::memory_order_acquire);
+		if (c == NULL)
+			continue;
+		stats->calls += c->calls.load(std::memory_order_relaxed);
+		stats->call_ns += c->ns.load(std::memory_order_relaxed);
+		for (int b = 0; b < FD_EXT_STATS_BUCKETS; b++)
+			stats->hist[b] += c->hist[b].load(std::memory_order_relaxed);
+	}
+}
+
+/* Upper bound of the bucket holding the q-quantile of the calls */
+static uint64_t stats_quantile(const struct fd_ext_stats * stats, double q)
+{
+	uint64_t seen = 0;
+
+	for (int b = 0; b < FD_EXT_STATS_BUCKETS; b++) {
+		seen += stats->hist[b];
+		if (seen && seen >= q * stats->calls)
+			return 2ULL << b;
+	}
+	return 0;
+}
+
+int fd_ext_stats_get(const char *name, struct fd_ext_stats *stats)
+{
+	std::lock_guard<std::mutex> lock(ext_list_lock);
+
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+		if ((*li)->ext_name && !strcasecmp((*li)->ext_name, name)) {
+			stats_merge(*li, stats);
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+static const char * const stats_states[] = { "loading", "pending", "ready", "failed", "idle" };
+
+/* One line per extension, times in microseconds except the call percentiles, in nanoseconds, memory in bytes */
+int fd_ext_stats_dump(const char *path)
+{
+	std::string tmp = std::string(path) + ".tmp";
+	FILE * f = fopen(tmp.c_str(), "w");
+
+	if (f == NULL)
+		return errno;
+	std::unique_lock<std::mutex> lock(ext_list_lock);
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+		struct fd_ext_info * ext = *li;
+		struct fd_ext_stats st;
+
+		stats_merge(ext, &st);
+		fprintf(f, "%s state=%s open_us=%llu init_us=%llu ready_us=%llu fini_us=%llu reloads=%u calls=%llu avg_ns=%llu p50_ns=%llu p99_ns=%llu p999_ns=%llu mem_live=%lld mem_peak=%lld mem_limit=%llu mem_limit_hits=%u mem_allocs=%llu oop_rtt_avg_ns=%llu oop_depth_peak=%u sessions=%llu hist=",
+			ext->ext_name ?: ext->filename, stats_states[st.state],
+			(unsigned long long)st.open_ns / 1000, (unsigned long long)st.init_ns / 1000, (unsigned long long)st.ready_ns / 1000,
+			(unsigned long long)st.fini_ns / 1000, st.reloads, (unsigned long long)st.calls,
+			(unsigned long long)(st.calls ? st.call_ns / st.calls : 0),
+			(unsigned long long)stats_quantile(&st, 0.5), (unsigned long long)stats_quantile(&st, 0.99),
+			(unsigned long long)stats_quantile(&st, 0.999), (long long)st.mem_live, (long long)st.mem_peak,
+			(unsigned long long)st.mem_limit, st.mem_limit_hits, (unsigned long long)st.mem_allocs,
+			(unsigned long long)(st.oop_calls ? st.oop_rtt_ns / st.oop_calls : 0), st.oop_depth_peak,
+			(unsigned long long)st.sessions);
+		for (int b = 0; b < FD_EXT_STATS_BUCKETS; b++)
+			fprintf(f, "%s%llu", b ? "," : "", (unsigned long long)st.hist[b]);
+		fprintf(f, "\n");
+	}
+	lock.unlock();
+	if (fclose(f)) {
+		unlink(tmp.c_str());
+		return errno;
+	}
+	if (rename(tmp.c_str(), path))
+		return errno;
+	return 0;
+}
+
+static void stats_on_signal(int signo)
+{
+	(void)signo;
+	sem_post(&stats_sem);
+}
+
+/* The dump cannot be done from the signal handler */
+static void stats_dumper(void)
+{
+	for (;;) {
+		std::string path;
+
+		if (sem_wait(&stats_sem))
+			continue;
+		{
+			std::lock_guard<std::mutex> lock(stats_lock);
+			path = stats_path;
+		}
+		fd_ext_stats_dump(path.c_str());
+	}
+}
+
+/* Write the statistics into path each time signo is received */
+int fd_ext_stats_signal(int signo, const char *path)
+{
+	struct sigaction sa;
+
+	if (path == NULL)
+		return EINVAL;
+
+	{
+		std::lock_guard<std::mutex> lock(stats_lock);
+		stats_path = path;
+		if (!stats_dumper_started) {
+			if (sem_init(&stats_sem, 0, 0))
+				return errno;
+			std::thread(stats_dumper).detach();
+			stats_dumper_started = 1;
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stats_on_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(signo, &sa, NULL))
+		return errno;
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Per-thread contexts of the extensions.
+ *
+ * An extension exporting fd_ext_thread_init gets a cache-line-aligned slot of
+ * FD_EXT_THREAD_SLOT bytes for each thread calling its hooks, passed back as the
+ * ctx argument of the hooks. The slots of a thread are created when it calls
+ * fd_ext_thread_attach, or on the first call into each extension, and given back
+ * with fd_ext_thread_fini when the thread detaches or exits. The slots of a copy
+ * being finalized are released by the finalizing thread, after the grace period
+ * and before fd_ext_fini, the other threads no longer use them then.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <vector>
+#include <mutex>
+
+#include "extension_internal.h"
+
+/* Slot of an extension for a thread, the context comes first and is the only part the extension sees */
+struct ext_slot {
+	unsigned char		ctx[FD_EXT_THREAD_SLOT];
+	struct fd_ext_inst	*inst;		/* the copy which initialized it */
+	int			failed;		/* fd_ext_thread_init returned an error, the hooks get no context */
+} __attribute__((aligned(64)));
+
+/* Slots of a thread; the lock is only taken to create or release slots */
+struct ext_thread {
+	std::atomic<struct ext_slot*>	slots[EXT_MAX];
+	std::mutex			lock;
+};
+
+/* Detaches the thread when it exits */
+struct ext_thread_holder {
+	~ext_thread_holder();
+};
+
+static std::mutex thread_lock;			/* protects thread_list */
+static std::vector<struct ext_thread*> thread_list;
+static thread_local struct ext_thread * ext_thread_self = NULL;
+static thread_local struct ext_thread_holder thread_holder;
+
+ext_thread_holder::~ext_thread_holder()
+{
+	fd_ext_thread_detach();
+}
+
+static struct ext_thread * thread_register(void)
+{
+	struct ext_thread * t = new(std::nothrow) ext_thread();
+
+	if (t == NULL)
+		return NULL;
+	for (unsigned i = 0; i < EXT_MAX; i++)
+		t->slots[i].store(NULL, std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lock(thread_lock);
+		thread_list.push_back(t);
+	}
+	ext_thread_self = t;
+	(void)&thread_holder;	/* constructs the holder, so that its destructor runs at exit */
+	return t;
+}
+
+/* Give the slot back to the copy which initialized it. Called with the lock of the thread held. */
+static void thread_slot_release(struct ext_thread * t, unsigned idx)
+{
+	struct ext_slot * s = t->slots[idx].load(std::memory_order_relaxed);
+
+	if (s == NULL)
+		return;
+	t->slots[idx].store(NULL, std::memory_order_release);
+	if (!s->failed && s->inst->thread_fini)
+		(*s->inst->thread_fini)(&s->inst->args, s->ctx);
+	free(s);
+}
+
+/* First call of the thread into this copy of the extension */
+static void * thread_ctx_new(struct fd_ext_inst * inst)
+{
+	struct ext_thread * t = ext_thread_self;
+	unsigned idx = inst->ext->idx;
+	struct ext_slot * s;
+	void * mem;
+
+	if (t == NULL && (t = thread_register()) == NULL)
+		return NULL;
+
+	std::lock_guard<std::mutex> lock(t->lock);
+	s = t->slots[idx].load(std::memory_order_relaxed);
+	if (s && s->inst == inst)
+		return s->failed ? NULL : s->ctx;
+
+	/* The slot of a copy replaced by fd_ext_reload; that copy stays loaded while this thread is in its read-side section */
+	thread_slot_release(t, idx);
+
+	if (posix_memalign(&mem, 64, sizeof(struct ext_slot)))
+		return NULL;
+	s = new(mem) ext_slot();
+	memset(s->ctx, 0, sizeof(s->ctx));
+	s->inst = inst;
+	s->failed = (*inst->thread_init)(&inst->args, s->ctx) != 0;
+	t->slots[idx].store(s, std::memory_order_release);
+	return s->failed ? NULL : s->ctx;
+}
+
+/* Context of the calling thread for the copy, which has thread_init, NULL if it could not be created */
+void * ext_thread_ctx(struct fd_ext_inst * inst)
+{
+	struct ext_thread * t = ext_thread_self;
+
+	if (t) {
+		struct ext_slot * s = t->slots[inst->ext->idx].load(std::memory_order_acquire);
+		if (s && s->inst == inst)
+			return s->failed ? NULL : s->ctx;
+	}
+	return thread_ctx_new(inst);
+}
+
+/* Create the slots of the calling thread for all the extensions loaded */
+int fd_ext_thread_attach(void)
+{
+	std::vector<struct fd_ext_inst*> insts;
+	int ret = 0;
+
+	/* The copies stay loaded in the read-side section; their fd_ext_thread_init are called without the list lock,
+	 * which they may take through the statistics */
+	std::unique_lock<std::mutex> lock(ext_list_lock);
+	fd_ext_rcu_read_lock();
+	for (auto li = ext_list.cbegin(); li != ext_list.cend(); ++li) {
+		struct fd_ext_inst * inst = (*li)->inst.load(std::memory_order_acquire);
+		if (inst && inst->thread_init)
+			insts.push_back(inst);
+	}
+	lock.unlock();
+	for (auto it = insts.cbegin(); it != insts.cend(); ++it) {
+		if (ext_thread_ctx(*it) == NULL && !ret)
+			ret = ENOMEM;
+	}
+	fd_ext_rcu_read_unlock();
+	return ret;
+}
+
+/* Release the slots of the calling thread, also done when it exits */
+void fd_ext_thread_detach(void)
+{
+	struct ext_thread * t = ext_thread_self;
+
+	if (t == NULL)
+		return;
+	/* While it is still listed, so that ext_thread_release waits for these fd_ext_thread_fini before the copy is finalized */
+	{
+		std::lock_guard<std::mutex> lock(t->lock);
+		for (unsigned i = 0; i < EXT_MAX; i++)
+			thread_slot_release(t, i);
+	}
+	{
+		std::lock_guard<std::mutex> lock(thread_lock);
+		for (auto it = thread_list.begin(); it != thread_list.end(); ++it) {
+			if (*it == t) {
+				thread_list.erase(it);
+				break;
+			}
+		}
+	}
+	ext_thread_self = NULL;
+	delete t;
+}
+
+/* The copy is being finalized, no thread runs it anymore: release its slots in all threads */
+void ext_thread_release(struct fd_ext_inst * inst)
+{
+	std::lock_guard<std::mutex> lock(thread_lock);
+
+	for (auto it = thread_list.cbegin(); it != thread_list.cend(); ++it) {
+		std::lock_guard<std::mutex> tlock((*it)->lock);
+		struct ext_slot * s = (*it)->slots[inst->ext->idx].load(std::memory_order_relaxed);
+		if (s && s->inst == inst)
+			thread_slot_release(*it, inst->ext->idx);
+	}
+}
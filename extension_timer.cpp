@@ -0,0 +1,496 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Timers and deferred work of the extensions.
+ *
+ * The timers are kept in hierarchical timing wheels: 4 levels of 256 slots with a tick
+ * of 1 ms, the timers of a slot of the upper levels being moved down when the level
+ * below wraps; starting and cancelling a timer are O(1) whatever their number. Each wheel
+ * has its thread, which runs the callbacks of its expired timers; a thread starting
+ * timers always uses the same wheel, the threads being spread over the wheels
+ * (TimerThreads in extensions.cfg, one per CPU by default), so that few threads share
+ * the lock of a wheel. An empty wheel skips the ticks it was idle. The timers are nodes
+ * of an array with the slots as heads, linked by index; a timer is identified by its
+ * wheel, its node and the generation of the node, so that cancelling one which expired
+ * already is detected.
+ *
+ * The deferred jobs are run by a small pool of threads shared by all the extensions
+ * (ExecutorThreads, 2 by default). The threads are started on the first use.
+ *
+ * Each timer and job belongs to the copy of the extension which started it: when it is
+ * finalized, before fd_ext_fini, those still pending are cancelled, those running are
+ * waited for, and no new one is accepted.
+ */
+
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "extension_internal.h"
+
+#define TIMER_TICK_NS		1000000ULL
+#define TIMER_LEVELS		4
+#define TIMER_SLOT_BITS		8
+#define TIMER_SLOTS		(1U << TIMER_SLOT_BITS)
+#define TIMER_HEADS		(TIMER_LEVELS * TIMER_SLOTS)
+#define TIMER_MAX_TICKS		((1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1)
+#define TIMER_NONE		0xffffffffU
+
+/* A timer, or the head of a slot (the first TIMER_HEADS nodes) */
+struct timer_node {
+	uint64_t		expires;	/* tick */
+	uint64_t		period;		/* ticks, 0 for a single shot */
+	fd_ext_timer_cb		cb;
+	void			*data;
+	struct fd_ext_inst	*owner;		/* NULL when free */
+	uint32_t		prev;
+	uint32_t		next;		/* also links the free nodes */
+	uint32_t		gen;		/* changes when the node is freed */
+};
+
+/* A callback taken from the wheel, run outside of its lock */
+struct timer_fired {
+	fd_ext_timer_cb		cb;
+	void			*data;
+	struct fd_ext_inst	*owner;
+};
+
+struct timer_wheel {
+	std::mutex			lock;
+	std::condition_variable		cond;
+	std::vector<struct timer_node>	nodes;
+	uint32_t			free_list;
+	uint64_t			base;		/* ext_now_ns() of tick 0 */
+	uint64_t			cur;		/* next tick to process */
+	uint64_t			wake;		/* tick the thread sleeps until, 0 while it runs */
+	size_t				count;		/* timers started */
+	std::deque<struct timer_fired>	fired;
+	struct fd_ext_inst		*running;	/* owner of the callback being run */
+	std::thread			thread;
+	int				stop;
+};
+
+struct timer_job {
+	fd_ext_timer_cb		cb;
+	void			*data;
+	struct fd_ext_inst	*owner;
+};
+
+static std::mutex timer_start_lock;		/* starts and stops the threads */
+static unsigned timer_nwheels = 1, timer_nexec = 2;
+static std::vector<struct timer_wheel*> timer_wheels;
+static std::atomic<int> timer_started(0);
+
+static std::mutex exec_lock;
+/* never destroyed: the executors left running for an abandoned extension (ext_timer_leave) wait on it at exit */
+static std::condition_variable & exec_cond = *new std::condition_variable();
+static std::deque<struct timer_job> exec_queue;
+static std::vector<struct fd_ext_inst*> exec_running;	/* per thread of the pool */
+static std::vector<std::thread> exec_threads;
+static int exec_stop;
+
+static std::atomic<unsigned> timer_next_wheel(0);
+static thread_local int timer_wheel_idx = -1;
+static thread_local struct fd_ext_inst * timer_current;	/* owner of the callback this thread runs */
+
+void ext_timer_configure(unsigned wheels, unsigned executors)
+{
+	timer_nwheels = wheels ?: std::thread::hardware_concurrency() ?: 1;
+	timer_nexec = executors ?: 2;
+}
+
+static void timer_link(struct timer_wheel * w, uint32_t head, uint32_t idx)
+{
+	struct timer_node * n = &w->nodes[idx];
+
+	n->prev = w->nodes[head].prev;
+	n->next = head;
+	w->nodes[n->prev].next = idx;
+	w->nodes[head].prev = idx;
+}
+
+static void timer_unlink(struct timer_wheel * w, uint32_t idx)
+{
+	struct timer_node * n = &w->nodes[idx];
+
+	w->nodes[n->prev].next = n->next;
+	w->nodes[n->next].prev = n->prev;
+}
+
+/* The slot of the timer, on the lowest level its delay fits in */
+static void timer_add(struct timer_wheel * w, uint32_t idx)
+{
+	struct timer_node * n = &w->nodes[idx];
+	uint64_t delta;
+	unsigned level;
+
+	if (n->expires < w->cur)
+		n->expires = w->cur;
+	delta = n->expires - w->cur;
+	if (delta > TIMER_MAX_TICKS)
+		n->expires = w->cur + (delta = TIMER_MAX_TICKS);
+	for (level = 0; level < TIMER_LEVELS - 1 && delta >= (1ULL << ((level + 1) * TIMER_SLOT_BITS)); level++)
+		;
+	timer_link(w, level * TIMER_SLOTS + ((n->expires >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1)), idx);
+}
+
+static void timer_free(struct timer_wheel * w, uint32_t idx)
+{
+	struct timer_node * n = &w->nodes[idx];
+
+	n->owner = NULL;
+	n->cb = NULL;
+	if (++n->gen == 0)
+		n->gen = 1;
+	n->next = w->free_list;
+	w->free_list = idx;
+	w->count--;
+}
+
+/* Move the timers of the current slot of a level down, as the level below wraps */
+static void timer_cascade(struct timer_wheel * w, unsigned level)
+{
+	uint32_t head = level * TIMER_SLOTS + ((w->cur >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1));
+
+	while (w->nodes[head].next != head) {
+		uint32_t idx = w->nodes[head].next;
+		timer_unlink(w, idx);
+		timer_add(w, idx);
+	}
+}
+
+/* Nothing to expire in the ticks an empty wheel was idle: it goes to the current one at once */
+static void timer_skip_idle(struct timer_wheel * w)
+{
+	uint64_t now = (ext_now_ns() - w->base) / TIMER_TICK_NS;
+
+	if (w->count == 0 && w->cur <= now)
+		w->cur = now + 1;
+}
+
+/* Process one tick: the timers of the slot expire, the periodic ones are started again */
+static void timer_tick(struct timer_wheel * w)
+{
+	uint32_t head = w->cur & (TIMER_SLOTS - 1);
+
+	for (unsigned level = 1; level < TIMER_LEVELS; level++) {
+		if ((w->cur >> ((level - 1) * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1))
+			break;
+		timer_cascade(w, level);
+	}
+	while (w->nodes[head].next != head) {
+		uint32_t idx = w->nodes[head].next;
+		struct timer_node * n = &w->nodes[idx];
+		struct timer_fired f = { n->cb, n->data, n->owner };
+
+		timer_unlink(w, idx);
+		w->fired.push_back(f);
+		if (n->period) {
+			n->expires = w->cur + n->period;
+			timer_add(w, idx);
+		} else {
+			timer_free(w, idx);
+		}
+	}
+	w->cur++;
+}
+
+static void timer_run(struct timer_wheel * w)
+{
+	std::unique_lock<std::mutex> lock(w->lock);
+
+	while (!w->stop) {
+		uint64_t now = (ext_now_ns() - w->base) / TIMER_TICK_NS;
+		uint64_t next;
+
+		timer_skip_idle(w);
+		while (w->cur <= now)
+			timer_tick(w);
+		while (!w->fired.empty()) {
+			struct timer_fired f = w->fired.front();
+			w->fired.pop_front();
+			w->running = timer_current = f.owner;
+			lock.unlock();
+			(*f.cb)(f.data);
+			lock.lock();
+			w->running = timer_current = NULL;
+			w->cond.notify_all();
+		}
+
+		/* Until the next slot with timers, at most a turn of the first level */
+		if (w->count == 0) {
+			w->wake = UINT64_MAX;
+			w->cond.wait(lock);
+			w->wake = 0;
+			continue;
+		}
+		for (next = w->cur; next < w->cur + TIMER_SLOTS - 1; next++) {
+			uint32_t head = next & (TIMER_SLOTS - 1);
+			if (w->nodes[head].next != head)
+				break;
+			if (next > w->cur && !(next & (TIMER_SLOTS - 1)))
+				break;	/* cascades */
+		}
+		now = ext_now_ns();
+		if (w->base + next * TIMER_TICK_NS > now) {
+			w->wake = next;
+			w->cond.wait_for(lock, std::chrono::nanoseconds(w->base + next * TIMER_TICK_NS - now));
+			w->wake = 0;
+		}
+	}
+}
+
+static void exec_run(unsigned idx)
+{
+	std::unique_lock<std::mutex> lock(exec_lock);
+
+	for (;;) {
+		while (exec_queue.empty() && !exec_stop)
+			exec_cond.wait(lock);
+		if (exec_queue.empty())
+			return;
+		struct timer_job j = exec_queue.front();
+		exec_queue.pop_front();
+		exec_running[idx] = timer_current = j.owner;
+		lock.unlock();
+		(*j.cb)(j.data);
+		lock.lock();
+		exec_running[idx] = timer_current = NULL;
+		exec_cond.notify_all();
+	}
+}
+
+/* The threads, on the first timer or job */
+static void timer_start_threads(void)
+{
+	std::lock_guard<std::mutex> lock(timer_start_lock);
+
+	if (timer_started.load(std::memory_order_acquire))
+		return;
+	for (unsigned i = 0; i < timer_nwheels; i++) {
+		struct timer_wheel * w = new struct timer_wheel();
+		w->nodes.resize(TIMER_HEADS);
+		for (uint32_t h = 0; h < TIMER_HEADS; h++)
+			w->nodes[h].prev = w->nodes[h].next = h;
+		w->free_list = TIMER_NONE;
+		w->base = ext_now_ns();
+		timer_wheels.push_back(w);
+		w->thread = std::thread(timer_run, w);
+	}
+	exec_stop = 0;
+	exec_running.assign(timer_nexec, NULL);
+	for (unsigned i = 0; i < timer_nexec; i++)
+		exec_threads.push_back(std::thread(exec_run, i));
+	timer_started.store(1, std::memory_order_release);
+}
+
+static int timer_start(struct fd_ext_arg * self, uint64_t delay_ms, uint64_t period_ms, fd_ext_timer_cb cb, void * data, uint64_t * id)
+{
+	struct fd_ext_inst * inst = ext_inst_of(self);
+	struct timer_wheel * w;
+	struct timer_node * n;
+	uint32_t idx;
+	unsigned wi;
+
+	if (cb == NULL)
+		return EINVAL;
+	if (!timer_started.load(std::memory_order_acquire))
+		timer_start_threads();
+	if (timer_wheel_idx < 0)
+		timer_wheel_idx = timer_next_wheel++;
+	wi = timer_wheel_idx % timer_wheels.size();
+	w = timer_wheels[wi];
+
+	std::lock_guard<std::mutex> lock(w->lock);
+	if (inst->timers_closed.load(std::memory_order_relaxed))
+		return ECANCELED;
+	if (w->free_list != TIMER_NONE) {
+		idx = w->free_list;
+		w->free_list = w->nodes[idx].next;
+	} else {
+		if (w->nodes.size() >= TIMER_NONE)
+			return ENOMEM;
+		idx = w->nodes.size();
+		w->nodes.push_back(timer_node());
+		w->nodes[idx].gen = 1;
+	}
+	n = &w->nodes[idx];
+	n->cb = cb;
+	n->data = data;
+	n->owner = inst;
+	n->period = (period_ms * 1000000ULL + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+	/* from the current time, the wheel may be late by the callbacks it is running */
+	timer_skip_idle(w);
+	n->expires = (ext_now_ns() - w->base + delay_ms * 1000000ULL + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+	w->count++;
+	timer_add(w, idx);
+	if (id)
+		*id = ((uint64_t)wi << 56) | ((uint64_t)(n->gen & 0xffffff) << 32) | idx;
+	/* it may expire before the thread planned to wake up */
+	if (n->expires < w->wake)
+		w->cond.notify_all();
+	return 0;
+}
+
+static int timer_cancel(struct fd_ext_arg * self, uint64_t id)
+{
+	unsigned wi = id >> 56;
+	uint32_t gen = (id >> 32) & 0xffffff, idx = (uint32_t)id;
+	struct timer_wheel * w;
+
+	if (!timer_started.load(std::memory_order_acquire) || wi >= timer_wheels.size())
+		return ENOENT;
+	w = timer_wheels[wi];
+
+	std::lock_guard<std::mutex> lock(w->lock);
+	if (idx < TIMER_HEADS || idx >= w->nodes.size() || (w->nodes[idx].gen & 0xffffff) != gen
+			|| w->nodes[idx].owner != ext_inst_of(self))
+		return ENOENT;
+	timer_unlink(w, idx);
+	timer_free(w, idx);
+	return 0;
+}
+
+static int timer_defer(struct fd_ext_arg * self, fd_ext_timer_cb cb, void * data)
+{
+	struct fd_ext_inst * inst = ext_inst_of(self);
+	struct timer_job j = { cb, data, inst };
+
+	if (cb == NULL)
+		return EINVAL;
+	if (!timer_started.load(std::memory_order_acquire))
+		timer_start_threads();
+
+	std::lock_guard<std::mutex> lock(exec_lock);
+	if (inst->timers_closed.load(std::memory_order_relaxed))
+		return ECANCELED;
+	exec_queue.push_back(j);
+	exec_cond.notify_one();
+	return 0;
+}
+
+const struct fd_ext_timers ext_timer_ops = {
+	timer_start,
+	timer_cancel,
+	timer_defer
+};
+
+/* The copy is being finalized: cancel its timers and jobs, and wait for the callbacks running, but the one calling */
+void ext_timer_release(struct fd_ext_inst * inst)
+{
+	inst->timers_closed.store(1, std::memory_order_relaxed);
+	if (!timer_started.load(std::memory_order_acquire))
+		return;
+
+	for (auto wi = timer_wheels.begin(); wi != timer_wheels.end(); ++wi) {
+		struct timer_wheel * w = *wi;
+		std::unique_lock<std::mutex> lock(w->lock);
+		for (uint32_t idx = TIMER_HEADS; idx < w->nodes.size(); idx++) {
+			if (w->nodes[idx].owner == inst) {
+				timer_unlink(w, idx);
+				timer_free(w, idx);
+			}
+		}
+		for (auto it = w->fired.begin(); it != w->fired.end(); ) {
+			if (it->owner == inst)
+				it = w->fired.erase(it);
+			else
+				++it;
+		}
+		while (w->running == inst && timer_current != inst)
+			w->cond.wait(lock);
+	}
+
+	std::unique_lock<std::mutex> lock(exec_lock);
+	for (auto it = exec_queue.begin(); it != exec_queue.end(); ) {
+		if (it->owner == inst)
+			it = exec_queue.erase(it);
+		else
+			++it;
+	}
+	for (size_t i = 0; i < exec_running.size(); i++) {
+		while (exec_running[i] == inst && timer_current != inst)
+			exec_cond.wait(lock);
+	}
+}
+
+/* An abandoned copy may still have timers: the wheels and the executors run until the process exits */
+void ext_timer_leave(void)
+{
+	std::lock_guard<std::mutex> lock(timer_start_lock);
+
+	for (auto wi = timer_wheels.begin(); wi != timer_wheels.end(); ++wi) {
+		if ((*wi)->thread.joinable())
+			(*wi)->thread.detach();
+	}
+	for (auto it = exec_threads.begin(); it != exec_threads.end(); ++it) {
+		if (it->joinable())
+			it->detach();
+	}
+}
+
+/* All the extensions were finalized */
+void ext_timer_stop(void)
+{
+	std::lock_guard<std::mutex> lock(timer_start_lock);
+
+	if (!timer_started.load(std::memory_order_acquire))
+		return;
+	for (auto wi = timer_wheels.begin(); wi != timer_wheels.end(); ++wi) {
+		{
+			std::lock_guard<std::mutex> wlock((*wi)->lock);
+			(*wi)->stop = 1;
+			(*wi)->cond.notify_all();
+		}
+		(*wi)->thread.join();
+		delete *wi;
+	}
+	timer_wheels.clear();
+	{
+		std::lock_guard<std::mutex> elock(exec_lock);
+		exec_stop = 1;
+		exec_queue.clear();
+		exec_cond.notify_all();
+	}
+	for (auto it = exec_threads.begin(); it != exec_threads.end(); ++it)
+		it->join();
+	exec_threads.clear();
+	timer_next_wheel = 0;
+	timer_started.store(0, std::memory_order_release);
+}
@@ -0,0 +1,70 @@
+# benchmark of the extensions framework itself, run with 'make bench' from extensions/makefile;
+# generates $(BENCH_COUNT) synthetic extensions with gen_ext.sh, builds them and runs fdbench;
+# the result is written as JSON into $(BENCHDIR)/result.json, keep it to compare releases;
+# 'make benchstatic' links the same extensions into fdbench_static instead (static build mode,
+# see 'make static'), into $(BENCHDIR)/result_static.json; 'make benchcmp' runs both;
+
+BENCHDIR = $(API_BIN)/bench
+# daemon sources: extension*.cpp and dict.cpp
+HOSTSRCDIR ?= $(VOB_ROOT)/mboss_ts/dra/source
+# libraries the daemon sources need (cch_port, ...)
+BENCH_LIBS ?=
+
+# shape of the synthetic extensions: count, dependents of each one (0: no dependency),
+# busy time of fd_ext_init, approximate code size, dictionary lookup in the hooks (none, name or cached)
+BENCH_COUNT ?= 100
+BENCH_FANOUT ?= 4
+BENCH_INIT_US ?= 1000
+BENCH_TEXT_KB ?= 16
+BENCH_LOOKUP ?= cached
+# measurement
+BENCH_ROUNDS ?= 5
+BENCH_MSGS ?= 1000000
+# dispatch threads, up to all the cores when 0
+BENCH_THREADS ?= 0
+
+BENCH_INCLUDES = \
+	-I$(SRCDIR)/../server_tech_api/diameter_api/diameter_common_api/include \
+	$(EXT_INCLUDES)
+# the daemon side is built with the default visibility, it exports what extension.exports lists
+BENCH_CPOPTS = $(filter-out -fvisibility%,$(EXT_CPOPTS))
+BENCH_HOSTSRC = $(wildcard $(HOSTSRCDIR)/extension*.cpp) $(HOSTSRCDIR)/dict.cpp
+BENCH_GEN = $(SRCDIR)/bench/gen_ext.sh -n $(BENCH_COUNT) -f $(BENCH_FANOUT) -i $(BENCH_INIT_US) \
+		-t $(BENCH_TEXT_KB) -l $(BENCH_LOOKUP) -o $(BENCHDIR)
+BENCH_RUN = -r $(BENCH_ROUNDS) -m $(BENCH_MSGS) $(if $(filter-out 0,$(BENCH_THREADS)),-t $(BENCH_THREADS))
+
+.PHONY: bench benchstatic benchcmp cleanbench
+
+bench: $(BENCHDIR)/fdbench
+	$(BENCH_GEN)
+	$(MAKE) -f $(BENCHDIR)/gen.mk CC="$(CC)" CXX="$(CXX)" \
+		CCOPTS="$(EXT_CCOPTS) $(EXT_DEFINES) $(BENCH_INCLUDES)" \
+		CPOPTS="$(EXT_CPOPTS) $(EXT_DEFINES) $(BENCH_INCLUDES)" LDOPTS="$(EXT_LDOPTS)"
+	$(BENCHDIR)/fdbench $(BENCH_RUN) -o $(BENCHDIR)/result.json $(BENCHDIR)/home/
+	@cat $(BENCHDIR)/result.json
+
+# the extensions and the daemon sources in one binary, optimized together
+benchstatic:
+	$(BENCH_GEN)
+	$(MAKE) -f $(BENCHDIR)/gen.mk static CC="$(CC)" CXX="$(CXX)" AR="$(AR)" \
+		STCCOPTS="$(call GetStaticOpt,$(EXT_CCOPTS)) $(EXT_DEFINES) $(BENCH_INCLUDES)" \
+		STCPOPTS="$(call GetStaticOpt,$(EXT_CPOPTS)) $(EXT_DEFINES) $(BENCH_INCLUDES)"
+	$(CXX) $(filter-out -fPIC,$(BENCH_CPOPTS)) $(EXT_STATIC_OPTS) $(APP_OPT) $(BENCH_INCLUDES) -I$(HOSTSRCDIR) -DBENCH_STATIC \
+		-pthread -o $(BENCHDIR)/fdbench_static $(SRCDIR)/bench/fdbench.cpp $(BENCH_HOSTSRC) \
+		-Wl,--whole-archive $(BENCHDIR)/libbench.a -Wl,--no-whole-archive $(BENCH_LIBS) -ldl
+	$(BENCHDIR)/fdbench_static $(BENCH_RUN) -o $(BENCHDIR)/result_static.json $(BENCHDIR)/home/
+	@cat $(BENCHDIR)/result_static.json
+
+# dispatch cost of the two build modes, from the results of both
+benchcmp: bench benchstatic
+	@for f in result result_static; do \
+		printf '%-16s' $$f; grep -o '"\(dispatch_ns\|dispatch_per_extension_ns\|dispatch_batch_ns\)": [0-9.]*' $(BENCHDIR)/$$f.json | tr '\n' ' '; echo; \
+	done
+
+$(BENCHDIR)/fdbench: $(SRCDIR)/bench/fdbench.cpp $(BENCH_HOSTSRC)
+	$(MKDIR) $(BENCHDIR)
+	$(CXX) $(BENCH_CPOPTS) $(APP_OPT) $(BENCH_INCLUDES) -I$(HOSTSRCDIR) \
+		-Wl,--dynamic-list=$(HOSTSRCDIR)/extension.exports -pthread -o $@ $^ $(BENCH_LIBS) -ldl
+
+cleanbench:
+	-$(RM) $(BENCHDIR)
@@ -0,0 +1,347 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Benchmark of the extensions framework, driving the extensions generated by gen_ext.sh.
+ *
+ * fdbench [-r rounds] [-m messages] [-t threads] [-o result.json] <home>
+ *
+ * Each round measures fd_ext_initialize, fd_ext_load and fd_ext_term on the extensions
+ * of <home>/cfg/extensions.cfg. The last round also measures:
+ *  - the dictionary search by name on the dictionary passed to the extensions;
+ *  - the cost of fd_ext_hook_dispatch for a message every extension hooks, one at a time
+ *    and by batches of FD_EXT_BATCH_MAX;
+ *  - the resident memory the first fd_ext_load added, and the dynamic relocations of the
+ *    loaded .fdx;
+ *  - the throughput of the dispatch from 1 up to <threads> threads (all the cores by
+ *    default), each one with its own contexts in the extensions.
+ * Then the text of the extensions is moved onto huge pages (fd_ext_huge_text), with the
+ * iTLB misses of the dispatch before and after (-1 where perf events are not available).
+ *
+ * The result is a single JSON object. Built with -DBENCH_STATIC, the extensions are
+ * linked in (see 'make benchstatic') and "link" is "static" in the result.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <link.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include "cch_port.h"
+#include "diameter_base.h"
+#include "dau_common_def.h"
+#include "extension.h"
+#include "dict.h"
+
+struct bench_round {
+	double	initialize_ms;
+	double	load_ms;
+	double	term_ms;
+};
+
+static double bench_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Resident memory of the process, in KB */
+static unsigned long bench_rss_kb(void)
+{
+	unsigned long size = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f) {
+		if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Count the dynamic relocations of the loaded .fdx, which dlopen had to process */
+static int bench_relocs_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+	unsigned long *relocs = (unsigned long *)data;
+	size_t len = info->dlpi_name ? strlen(info->dlpi_name) : 0;
+
+	if (len < 4 || strcmp(info->dlpi_name + len - 4, ".fdx"))
+		return 0;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Dyn) *dyn;
+		unsigned long rel = 0, relent = 0, rela = 0, relaent = 0, plt = 0, pltent = 0;
+
+		if (info->dlpi_phdr[i].p_type != PT_DYNAMIC)
+			continue;
+		for (dyn = (const ElfW(Dyn) *)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr); dyn->d_tag != DT_NULL; dyn++) {
+			switch (dyn->d_tag) {
+			case DT_RELSZ: rel = dyn->d_un.d_val; break;
+			case DT_RELENT: relent = dyn->d_un.d_val; break;
+			case DT_RELASZ: rela = dyn->d_un.d_val; break;
+			case DT_RELAENT: relaent = dyn->d_un.d_val; break;
+			case DT_PLTRELSZ: plt = dyn->d_un.d_val; break;
+			case DT_PLTREL: pltent = dyn->d_un.d_val == DT_RELA ? sizeof(ElfW(Rela)) : sizeof(ElfW(Rel)); break;
+			}
+		}
+		*relocs += (relent ? rel / relent : 0) + (relaent ? rela / relaent : 0) + (pltent ? plt / pltent : 0);
+	}
+	return 0;
+}
+
+/* Average time of a fd_dict_search by name, in ns */
+static double bench_dict_search(unsigned long count)
+{
+	dictionary *pDictionary = dictionary::getInstance();
+	struct dict_object *obj = NULL;
+	double start = bench_now_ms();
+
+	for (unsigned long i = 0; i < count; i++)
+		pDictionary->fd_dict_search(DICT_AVP, AVP_BY_NAME, "Session-Id", &obj, ENOENT);
+	return (bench_now_ms() - start) * 1e6 / count;
+}
+
+/* Average time of a dispatch, in ns */
+static double bench_dispatch(unsigned long count)
+{
+	/* Credit-Control-Request header */
+	uint8_t raw[20] = { 1, 0, 0, 20, 0x80, 0, 1, 0x10, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 1 };
+	struct fd_ext_msg msg;
+	double start;
+
+	memset(&msg, 0, sizeof(msg));
+	fd_ext_msg_parse(&msg, raw, sizeof(raw));
+	start = bench_now_ms();
+	for (unsigned long i = 0; i < count; i++) {
+		msg.hbh_id = i;
+		fd_ext_hook_dispatch(FD_EXT_HOOK_MSG_RECEIVED, &msg);
+	}
+	return (bench_now_ms() - start) * 1e6 / count;
+}
+
+/* Average time of a dispatch by batches, per message, in ns */
+static double bench_dispatch_batch(unsigned long count)
+{
+	uint8_t raw[20] = { 1, 0, 0, 20, 0x80, 0, 1, 0x10, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 1 };
+	struct fd_ext_msg msg[FD_EXT_BATCH_MAX], *msgs[FD_EXT_BATCH_MAX];
+	int verdicts[FD_EXT_BATCH_MAX];
+	double start;
+
+	memset(msg, 0, sizeof(msg));
+	for (unsigned k = 0; k < FD_EXT_BATCH_MAX; k++) {
+		fd_ext_msg_parse(&msg[k], raw, sizeof(raw));
+		msg[k].hbh_id = k;
+		msgs[k] = &msg[k];
+	}
+	count = (count + FD_EXT_BATCH_MAX - 1) / FD_EXT_BATCH_MAX;
+	start = bench_now_ms();
+	for (unsigned long i = 0; i < count; i++)
+		fd_ext_hook_dispatch_batch(FD_EXT_HOOK_MSG_RECEIVED, msgs, verdicts, FD_EXT_BATCH_MAX);
+	return (bench_now_ms() - start) * 1e6 / (count * FD_EXT_BATCH_MAX);
+}
+
+/* iTLB misses of a dispatch, -1 if they cannot be counted */
+static double bench_dispatch_itlb(unsigned long count, double *ns)
+{
+	struct perf_event_attr attr;
+	long long misses;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_ITLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd >= 0)
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	*ns = bench_dispatch(count);
+	if (fd < 0)
+		return -1;
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+		misses = -count;
+	close(fd);
+	return (double)misses / count;
+}
+
+/* Throughput of the dispatch, in millions of messages per second, with count messages per thread */
+static double bench_dispatch_threads(unsigned nthreads, unsigned long count)
+{
+	std::vector<std::thread> threads;
+	double start = bench_now_ms();
+
+	for (unsigned t = 0; t < nthreads; t++)
+		threads.push_back(std::thread([count]() {
+			fd_ext_thread_attach();
+			bench_dispatch(count);
+			fd_ext_thread_detach();
+		}));
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+	return (double)nthreads * count / ((bench_now_ms() - start) * 1e3);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-r rounds] [-m messages] [-t threads] [-o result.json] <home>\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<struct bench_round> rounds;
+	std::vector<std::pair<unsigned, double> > scaling;
+	unsigned nrounds = 5, nexts = 0, nthreads = std::thread::hardware_concurrency() ?: 1;
+	unsigned long nmsgs = 1000000;
+	const char *output = NULL;
+	double dict_ns = 0, dispatch_ns = 0, batch_ns = 0, load_min = 0;
+	double itlb_before = -1, itlb_after = -1, huge_ns_before = 0, huge_ns_after = 0;
+	struct fd_ext_huge_report huge = { 0, 0, 0, 0, 0 };
+	unsigned long rss_before, rss_kb = 0, relocs = 0;
+	char path[1024] = "";
+	FILE *out = stdout;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "r:m:t:o:")) != -1) {
+		switch (opt) {
+		case 'r': nrounds = strtoul(optarg, NULL, 10); break;
+		case 'm': nmsgs = strtoul(optarg, NULL, 10); break;
+		case 't': nthreads = strtoul(optarg, NULL, 10); break;
+		case 'o': output = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || nrounds == 0 || nmsgs == 0 || nthreads == 0)
+		usage(argv[0]);
+
+	for (unsigned r = 0; r < nrounds; r++) {
+		struct bench_round round;
+		double t0, t1, t2;
+
+		t0 = bench_now_ms();
+		if (fd_ext_initialize(argv[optind]) != RTN_SUCCESS) {
+			fprintf(stderr, "fd_ext_initialize failed\n");
+			return 1;
+		}
+		rss_before = bench_rss_kb();
+		t1 = bench_now_ms();
+		ret = fd_ext_load();
+		t2 = bench_now_ms();
+		if (ret != 0) {
+			fprintf(stderr, "fd_ext_load failed: %s\n", strerror(ret));
+			return 1;
+		}
+		/* the first round maps the files, the next ones may find them still loaded */
+		if (r == 0)
+			rss_kb = bench_rss_kb() - rss_before;
+		round.initialize_ms = t1 - t0;
+		round.load_ms = t2 - t1;
+		if (!load_min || round.load_ms < load_min)
+			load_min = round.load_ms;
+
+		if (r == nrounds - 1) {
+			struct fd_ext_stats st;
+			char name[32];
+			for (nexts = 0; ; nexts++) {
+				snprintf(name, sizeof(name), "bench_%u", nexts);
+				if (fd_ext_stats_get(name, &st))
+					break;
+			}
+			fd_ext_critical_path(path, sizeof(path));
+			dl_iterate_phdr(bench_relocs_cb, &relocs);
+			dict_ns = bench_dict_search(nmsgs / 10 ?: 1);
+			dispatch_ns = bench_dispatch(nmsgs);
+			batch_ns = bench_dispatch_batch(nmsgs);
+			for (unsigned n = 1; ; n = n * 2 < nthreads ? n * 2 : nthreads) {
+				scaling.push_back(std::make_pair(n, bench_dispatch_threads(n, nmsgs)));
+				if (n == nthreads)
+					break;
+			}
+			itlb_before = bench_dispatch_itlb(nmsgs, &huge_ns_before);
+			fd_ext_huge_text("all", &huge);
+			itlb_after = bench_dispatch_itlb(nmsgs, &huge_ns_after);
+		}
+
+		t0 = bench_now_ms();
+		fd_ext_term();
+		round.term_ms = bench_now_ms() - t0;
+		rounds.push_back(round);
+	}
+
+	if (output && (out = fopen(output, "w")) == NULL) {
+		perror(output);
+		return 1;
+	}
+#ifdef BENCH_STATIC
+	fprintf(out, "{\n\t\"link\": \"static\",\n");
+#else /* BENCH_STATIC */
+	fprintf(out, "{\n\t\"link\": \"dynamic\",\n");
+#endif /* BENCH_STATIC */
+	fprintf(out, "\t\"extensions\": %u,\n\t\"rounds\": [", nexts);
+	for (size_t r = 0; r < rounds.size(); r++)
+		fprintf(out, "%s\n\t\t{ \"initialize_ms\": %.3f, \"load_ms\": %.3f, \"term_ms\": %.3f }", r ? "," : "",
+			rounds[r].initialize_ms, rounds[r].load_ms, rounds[r].term_ms);
+	fprintf(out, "\n\t],\n\t\"load_ms_min\": %.3f,\n\t\"critical_path\": \"%s\",\n", load_min, path);
+	fprintf(out, "\t\"load_rss_kb\": %lu,\n\t\"rss_per_extension_kb\": %.1f,\n", rss_kb, nexts ? (double)rss_kb / nexts : 0);
+	fprintf(out, "\t\"relocations\": %lu,\n\t\"relocations_per_extension\": %.1f,\n", relocs, nexts ? (double)relocs / nexts : 0);
+	fprintf(out, "\t\"dict_search_by_name_ns\": %.1f,\n\t\"dispatch_ns\": %.1f,\n\t\"dispatch_per_extension_ns\": %.1f,\n",
+		dict_ns, dispatch_ns, nexts ? dispatch_ns / nexts : 0);
+	fprintf(out, "\t\"dispatch_batch_ns\": %.1f,\n\t\"dispatch_batch_per_extension_ns\": %.1f,\n",
+		batch_ns, nexts ? batch_ns / nexts : 0);
+	fprintf(out, "\t\"dispatch_scaling\": [");
+	for (size_t i = 0; i < scaling.size(); i++)
+		fprintf(out, "%s\n\t\t{ \"threads\": %u, \"mmsgs_per_s\": %.3f, \"per_thread\": %.3f }", i ? "," : "",
+			scaling[i].first, scaling[i].second, scaling[i].second / scaling[i].first);
+	fprintf(out, "\n\t],\n\t\"huge_text\": { \"status\": %d, \"segments\": %u, \"small_pages_before\": %u, \"small_pages_after\": %u, "
+		"\"huge_pages\": %u,\n\t\t\"dispatch_ns_before\": %.1f, \"dispatch_ns_after\": %.1f, "
+		"\"itlb_misses_per_msg_before\": %.3f, \"itlb_misses_per_msg_after\": %.3f }\n}\n",
+		huge.status, huge.segments, huge.small_pages_before, huge.small_pages_after, huge.huge_pages,
+		huge_ns_before, huge_ns_after, itlb_before, itlb_after);
+	if (out != stdout)
+		fclose(out);
+
+	UNUSED(error_message);
+	UNUSED(avp_value_sizes);
+	return 0;
+}
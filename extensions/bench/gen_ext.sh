@@ -0,0 +1,187 @@
+#!/bin/sh
+# generate synthetic extensions for the framework benchmark, see bench.mk;
+# writes the sources into $out/src, the daemon layout into $out/home/ and $out/gen.mk to build the .fdx;
+
+usage() {
+	echo "usage: $0 -n count -f fanout -i init_us -t text_kb -l none|name|cached -o outdir" >&2
+	exit 1
+}
+
+count=100; fanout=4; init_us=1000; text_kb=16; lookup=cached; out=
+while getopts "n:f:i:t:l:o:" opt; do
+	case $opt in
+	n) count=$OPTARG ;;
+	f) fanout=$OPTARG ;;
+	i) init_us=$OPTARG ;;
+	t) text_kb=$OPTARG ;;
+	l) lookup=$OPTARG ;;
+	o) out=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+[ -n "$out" ] || usage
+case $lookup in none) lk=0 ;; name) lk=1 ;; cached) lk=2 ;; *) usage ;; esac
+
+mkdir -p "$out/src" "$out/home/cfg" "$out/home/lib/extensions" || exit 1
+rm -f "$out"/src/bench_* "$out"/home/lib/extensions/bench_* "$out"/st/bench_* "$out"/libbench.a
+
+# about 16 functions per KB of text
+nfn=$((text_kb * 16))
+[ $nfn -gt 0 ] || nfn=1
+
+list=
+i=0
+while [ $i -lt $count ]; do
+	# a tree: extension i depends on (i-1)/fanout, so that each one has up to 'fanout' dependents
+	deps=
+	if [ $fanout -gt 0 ] && [ $i -gt 0 ]; then
+		deps=", \"bench_$(( (i - 1) / fanout ))\""
+	fi
+
+	{
+		echo "/* generated by gen_ext.sh */"
+		echo "#include <time.h>"
+		echo "#include \"extension.h\""
+		echo
+		echo "#define BENCH_LOOKUP $lk"
+		echo "extern int bench_addavp_$i(struct fd_ext_arg *arg);"
+		echo "extern void *bench_lookup_$i(void *dict);"
+		echo "static int bench_main(struct fd_ext_arg *arg);"
+		echo "EXTENSION_ENTRY(\"bench_$i\", bench_main$deps);"
+		echo
+		j=0
+		while [ $j -lt $nfn ]; do
+			echo "static unsigned bench_fn_$j(unsigned x) { x ^= $((j * 7919 + i)); x *= 2654435761u; x += $j; x = (x << 7) | (x >> 25); return x ^ $((j + i * 31)); }"
+			j=$((j + 1))
+		done
+		echo "static unsigned (*const bench_fns[])(unsigned) = {"
+		j=0
+		while [ $j -lt $nfn ]; do
+			echo "	bench_fn_$j,"
+			j=$((j + 1))
+		done
+		echo "};"
+		cat <<EOT
+
+static const struct fd_ext_dict_decl bench_dict[] = { { FD_EXT_DICT_AVP, "Session-Id" } };
+static struct fd_ext_dict_cache *bench_objs;
+static void *bench_dictionary;
+volatile unsigned bench_sink_$i;
+
+/* the sink of each thread lives in its slot, so that the threads scale */
+FD_EXT_EXPORT int fd_ext_thread_init(struct fd_ext_arg *arg, void *ctx)
+{
+	return 0;
+}
+
+static int bench_hook(enum fd_ext_hook_point point, struct fd_ext_msg *msg, void *regdata, void *ctx)
+{
+	unsigned *sink = ctx ? (unsigned *)ctx : (unsigned *)&bench_sink_$i;
+#if BENCH_LOOKUP == 1
+	*sink += bench_lookup_$i(bench_dictionary) != NULL;
+#elif BENCH_LOOKUP == 2
+	*sink += FD_EXT_DICT(bench_objs, 0) != NULL;
+#endif
+	*sink += msg->hbh_id;
+	return FD_EXT_HOOK_CONTINUE;
+}
+
+/* the same over a batch: the dictionary object and the sink are loaded once */
+FD_EXT_EXPORT int fd_ext_hook_batch(enum fd_ext_hook_point point, fd_ext_hook_cb cb, void *regdata,
+				struct fd_ext_msg **msgs, int *verdicts, unsigned count, void *ctx)
+{
+	unsigned sink = 0, k;
+#if BENCH_LOOKUP == 1
+	sink += bench_lookup_$i(bench_dictionary) != NULL;
+#elif BENCH_LOOKUP == 2
+	sink += FD_EXT_DICT(bench_objs, 0) != NULL;
+#endif
+	for (k = 0; k < count; k++)
+		sink += msgs[k]->hbh_id;
+	*(ctx ? (unsigned *)ctx : (unsigned *)&bench_sink_$i) += sink;
+	return 0;
+}
+
+static int bench_main(struct fd_ext_arg *arg)
+{
+	struct timespec now, end;
+	unsigned x = 0, k;
+	int ret;
+
+	/* walk the text like a real initialization, then burn the remaining init time */
+	for (k = 0; k < sizeof(bench_fns) / sizeof(bench_fns[0]); k++)
+		x = bench_fns[k](x);
+	bench_sink_$i = x;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_nsec += ${init_us}L * 1000;
+	end.tv_sec += end.tv_nsec / 1000000000L;
+	end.tv_nsec %= 1000000000L;
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec < end.tv_sec || (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+
+	ret = bench_addavp_$i(arg);
+	if (ret != 0)
+		return ret;
+
+	bench_dictionary = arg->dict;
+	ret = arg->dict_cache->dict_declare(arg, bench_dict, 1, &bench_objs);
+	if (ret != 0)
+		return ret;
+	return arg->hooks->hook_register(arg, FD_EXT_HOOK_MSG_RECEIVED, FD_EXT_ANY, FD_EXT_ANY, $i, bench_hook, NULL, NULL);
+}
+EOT
+	} > "$out/src/bench_$i.c"
+
+	cat > "$out/src/bench_${i}_dict.cpp" <<EOT
+/* generated by gen_ext.sh */
+#include "extension.h"
+#pragma GCC visibility push(default)
+#include "dict.h"
+#pragma GCC visibility pop
+
+/* one dictionary object per extension, already there after the first round */
+extern "C" int bench_addavp_$i(struct fd_ext_arg *arg)
+{
+	struct dict_avp_data data = { $((100000 + i)), 0, (char*)"Bench-AVP-$i", 0, 0, AVP_TYPE_INTEGER32 };
+	int ret = arg->dict_cache->dict_new(arg, DICT_AVP, &data, NULL, NULL);
+	return ret == EEXIST ? 0 : ret;
+}
+
+extern "C" void *bench_lookup_$i(void *dict)
+{
+	struct dict_object *obj = NULL;
+	UNUSED(error_message);
+	UNUSED(avp_value_sizes);
+	static_cast<dictionary*>(dict)->fd_dict_search(DICT_AVP, AVP_BY_NAME, "Session-Id", &obj, ENOENT);
+	return obj;
+}
+EOT
+
+	list="$list${list:+,}bench_$i"
+	i=$((i + 1))
+done
+
+printf '[Extension]\nExtensionList=%s\n' "$list" > "$out/home/cfg/extensions.cfg"
+
+# make -f gen.mk CC=... CXX=... CCOPTS=... CPOPTS=...; the dictionary is resolved in fdbench;
+# make -f gen.mk static AR=... STCCOPTS=... STCPOPTS=... archives them all into libbench.a instead, for fdbench_static
+{
+	echo "# generated by gen_ext.sh"
+	echo "GENDIR = $out"
+	echo 'FDX = $(patsubst $(GENDIR)/src/%.c,$(GENDIR)/home/lib/extensions/%.fdx,$(wildcard $(GENDIR)/src/bench_*.c))'
+	echo 'ST = $(patsubst $(GENDIR)/src/%.c,$(GENDIR)/st/%.o,$(wildcard $(GENDIR)/src/bench_*.c))'
+	echo 'all: $(FDX)'
+	echo 'static: $(GENDIR)/libbench.a'
+	echo '$(GENDIR)/home/lib/extensions/%.fdx: $(GENDIR)/src/%.c $(GENDIR)/src/%_dict.cpp'
+	printf '\t$(CC) -c $(CCOPTS) -o $(GENDIR)/$*.o $(GENDIR)/src/$*.c\n'
+	printf '\t$(CXX) -c $(CPOPTS) -o $(GENDIR)/$*_dict.o $(GENDIR)/src/$*_dict.cpp\n'
+	printf '\t$(CXX) -shared $(CCOPTS) $(LDOPTS) -o $@ $(GENDIR)/$*.o $(GENDIR)/$*_dict.o\n'
+	echo '$(GENDIR)/st/%.o: $(GENDIR)/src/%.c $(GENDIR)/src/%_dict.cpp'
+	printf '\tmkdir -p $(GENDIR)/st\n'
+	printf '\t$(CC) -c $(STCCOPTS) -DFD_EXT_STATIC=$* -o $@ $(GENDIR)/src/$*.c\n'
+	printf '\t$(CXX) -c $(STCPOPTS) -DFD_EXT_STATIC=$* -o $(GENDIR)/st/$*_dict.o $(GENDIR)/src/$*_dict.cpp\n'
+	echo '$(GENDIR)/libbench.a: $(ST)'
+	printf '\trm -f $@\n'
+	printf '\t$(AR) rcs $@ $(ST) $(ST:.o=_dict.o)\n'
+} > "$out/gen.mk"
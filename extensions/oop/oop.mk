@@ -0,0 +1,27 @@
+# helper process of the extensions hosted out of process, 'make fdx_host' from extensions/makefile;
+# built from the daemon sources, it is installed as $(API_BIN)/fdx_host, set OopHelper in
+# extensions.cfg when the daemon does not find it as bin/fdx_host of its home directory;
+
+OOPDIR = $(API_BIN)
+HOSTSRCDIR ?= $(VOB_ROOT)/mboss_ts/dra/source
+# libraries the daemon sources need (cch_port, ...)
+OOP_LIBS ?= $(BENCH_LIBS)
+
+OOP_INCLUDES = \
+	-I$(SRCDIR)/../server_tech_api/diameter_api/diameter_common_api/include \
+	$(EXT_INCLUDES)
+# the daemon side is built with the default visibility, it exports what extension.exports lists
+OOP_CPOPTS = $(filter-out -fvisibility%,$(EXT_CPOPTS))
+OOP_HOSTSRC = $(wildcard $(HOSTSRCDIR)/extension*.cpp) $(HOSTSRCDIR)/dict.cpp
+
+.PHONY: fdx_host cleanoop
+
+fdx_host: $(OOPDIR)/fdx_host
+
+$(OOPDIR)/fdx_host: $(SRCDIR)/oop/fdx_host.cpp $(OOP_HOSTSRC)
+	$(MKDIR) $(OOPDIR)
+	$(CXX) $(OOP_CPOPTS) $(APP_OPT) $(OOP_INCLUDES) -I$(HOSTSRCDIR) \
+		-Wl,--dynamic-list=$(HOSTSRCDIR)/extension.exports -pthread -o $@ $^ $(OOP_LIBS) -ldl
+
+cleanoop:
+	-$(RM) $(OOPDIR)/fdx_host
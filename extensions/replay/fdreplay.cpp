@@ -0,0 +1,699 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2013, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Replay of recorded Diameter traffic through the extensions, without peers nor network.
+ *
+ * fdreplay [-t threads] [-c cpu,...] [-r rate] [-l loops] [-w warmup] [-n runs] [-o result.json] <capture> <home> [<home>...]
+ *
+ * The capture is either the messages one after the other, as written by fd_ext_capture,
+ * or a pcap file: the Diameter messages are taken from the TCP streams (no retransmission
+ * nor reordering handled) and from the unfragmented SCTP DATA chunks. It is mapped
+ * read-only: each thread copies a message into its own buffer before passing it, so that
+ * what the hooks change does not reach the next pass, run or home.
+ *
+ * Each run loads the extensions of <home>/cfg/extensions.cfg with fd_ext_initialize and
+ * fd_ext_load, then the threads (one per CPU of -c, or the first CPUs the process may
+ * run on), each pinned to its CPU, pass the messages to fd_ext_hook_dispatch: thread i
+ * takes the messages i, i + threads, ... in the order of the capture, <warmup> times
+ * (1 by default) then <loops> times measured, at <rate> messages per second in total or
+ * as fast as possible. The runs alternate between the homes, -n times each, so that two
+ * builds of the same extensions are compared on the same machine under the same drift.
+ *
+ * Reported for each run: the messages per second, the percentiles of the time of a
+ * dispatch, the verdicts, the malloc calls per message in the threads, and for each
+ * extension the percentiles of its hooks (from its statistics, the upper bounds of
+ * power of 2 buckets) and the allocations per message through fd_ext_alloc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+
+#include "cch_port.h"
+#include "diameter_base.h"
+#include "dau_common_def.h"
+#include "extension.h"
+#include "dict.h"
+
+/* Time of a dispatch: 16 linear buckets per power of 2 */
+#define REPLAY_SUB_BITS		4
+#define REPLAY_BUCKETS		(64 << REPLAY_SUB_BITS)
+
+/* malloc of the replay threads while they are measured, the executable's definitions take precedence */
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+static thread_local int replay_counting;
+static thread_local unsigned long replay_mallocs;
+
+extern "C" void *malloc(size_t size)
+{
+	if (replay_counting)
+		replay_mallocs++;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+	if (replay_counting)
+		replay_mallocs++;
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	if (replay_counting)
+		replay_mallocs++;
+	return __libc_realloc(ptr, size);
+}
+
+struct replay_msg {
+	const uint8_t	*data;
+	uint32_t	len;
+};
+
+struct replay_capture {
+	const char			*format;
+	uint8_t				*map;
+	size_t				size;
+	std::vector<uint8_t>		copy;		/* the messages of a pcap, reassembled */
+	std::vector<struct replay_msg>	msgs;
+	unsigned long			skipped;	/* bytes or chunks which were not messages */
+};
+
+/* What a thread measured */
+struct replay_thread {
+	unsigned long	msgs;
+	unsigned long	mallocs;
+	unsigned long	verdicts[5];
+	uint64_t	max_ns;
+	uint64_t	hist[REPLAY_BUCKETS];
+};
+
+struct replay_ext {
+	std::string		name;
+	struct fd_ext_stats	before;
+	struct fd_ext_stats	after;
+};
+
+/* Parameters of the runs */
+static unsigned replay_nthreads, replay_loops = 1, replay_warmup = 1;
+static double replay_rate;
+static std::vector<int> replay_cpus;
+
+static inline uint64_t replay_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned replay_bucket(uint64_t ns)
+{
+	unsigned msb;
+
+	if (ns < (1U << REPLAY_SUB_BITS))
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - REPLAY_SUB_BITS + 1) << REPLAY_SUB_BITS) | ((ns >> (msb - REPLAY_SUB_BITS)) & ((1U << REPLAY_SUB_BITS) - 1));
+}
+
+/* Middle of the bucket */
+static double replay_bucket_ns(unsigned b)
+{
+	unsigned msb = (b >> REPLAY_SUB_BITS) + REPLAY_SUB_BITS - 1;
+	uint64_t low;
+
+	if (b < (1U << REPLAY_SUB_BITS))
+		return b;
+	low = (1ULL << msb) | ((uint64_t)(b & ((1U << REPLAY_SUB_BITS) - 1)) << (msb - REPLAY_SUB_BITS));
+	return low + (double)(1ULL << (msb - REPLAY_SUB_BITS)) / 2;
+}
+
+static double replay_quantile(const uint64_t * hist, unsigned long count, double q)
+{
+	unsigned long seen = 0;
+
+	for (unsigned b = 0; b < REPLAY_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen && seen >= q * count)
+			return replay_bucket_ns(b);
+	}
+	return 0;
+}
+
+/* Upper bound of the power of 2 bucket of the statistics of an extension */
+static uint64_t replay_ext_quantile(const struct fd_ext_stats * before, const struct fd_ext_stats * after, double q)
+{
+	uint64_t calls = after->calls - before->calls, seen = 0;
+
+	for (int b = 0; b < FD_EXT_STATS_BUCKETS; b++) {
+		seen += after->hist[b] - before->hist[b];
+		if (seen && seen >= q * calls)
+			return 2ULL << b;
+	}
+	return 0;
+}
+
+/* A Diameter message at p, its length or 0 */
+static uint32_t replay_diameter(const uint8_t * p, size_t avail)
+{
+	uint32_t len;
+
+	if (avail < 20 || p[0] != 1)
+		return 0;
+	len = ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3];
+	if (len < 20 || (len & 3) || len > avail)
+		return 0;
+	return len;
+}
+
+/* The messages of the capture are those of the file */
+static void replay_index(struct replay_capture * cap, const uint8_t * p, size_t size)
+{
+	size_t off = 0;
+
+	while (off < size) {
+		uint32_t len = replay_diameter(p + off, size - off);
+		if (len == 0) {
+			cap->skipped += size - off;
+			break;
+		}
+		struct replay_msg m = { p + off, len };
+		cap->msgs.push_back(m);
+		off += len;
+	}
+}
+
+/* A TCP stream of the pcap, by addresses and ports */
+struct replay_flow {
+	std::string		key;
+	std::vector<uint8_t>	buf;
+};
+
+static uint32_t replay_be32(const uint8_t * p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void replay_append(struct replay_capture * cap, const uint8_t * p, size_t len)
+{
+	cap->copy.insert(cap->copy.end(), p, p + len);
+	struct replay_msg m = { NULL, (uint32_t)len };
+	cap->msgs.push_back(m);
+}
+
+/* The IP packet of a frame: TCP payloads to their stream, whole messages of SCTP DATA chunks */
+static void replay_packet(struct replay_capture * cap, std::vector<struct replay_flow> & flows, const uint8_t * ip, size_t len)
+{
+	const uint8_t * l4;
+	size_t l4len;
+	int proto;
+	std::string key;
+
+	if (len < 20)
+		return;
+	if ((ip[0] >> 4) == 4) {
+		size_t hl = (ip[0] & 15) * 4, tot = (ip[2] << 8) | ip[3];
+		if (hl < 20 || tot < hl || tot > len || (((ip[6] & 0x3f) << 8) | ip[7]) || (ip[6] & 0x20))
+			return;		/* IP fragments are not handled */
+		proto = ip[9];
+		key.assign((const char *)ip + 12, 8);
+		l4 = ip + hl;
+		l4len = tot - hl;
+	} else if ((ip[0] >> 4) == 6 && len >= 40) {
+		size_t tot = ((ip[4] << 8) | ip[5]) + 40;
+		if (tot > len)
+			return;
+		proto = ip[6];
+		key.assign((const char *)ip + 8, 32);
+		l4 = ip + 40;
+		l4len = tot - 40;
+	} else {
+		return;
+	}
+
+	if (proto == 6 && l4len >= 20) {
+		size_t hl = (l4[12] >> 4) * 4;
+		struct replay_flow * f = NULL;
+		size_t off = 0;
+		if (hl < 20 || hl > l4len)
+			return;
+		key.append((const char *)l4, 4);
+		for (size_t i = 0; i < flows.size() && f == NULL; i++) {
+			if (flows[i].key == key)
+				f = &flows[i];
+		}
+		if (f == NULL) {
+			flows.push_back(replay_flow());
+			f = &flows.back();
+			f->key = key;
+		}
+		f->buf.insert(f->buf.end(), l4 + hl, l4 + l4len);
+		for (;;) {
+			uint32_t mlen;
+			if (f->buf.size() - off < 20)
+				break;
+			mlen = replay_diameter(&f->buf[off], f->buf.size() - off);
+			if (mlen == 0) {
+				/* not at a message boundary: wait for more, or drop what cannot start one */
+				uint32_t want = ((uint32_t)f->buf[off + 1] << 16) | (f->buf[off + 2] << 8) | f->buf[off + 3];
+				if (f->buf[off] == 1 && want >= 20 && !(want & 3) && want > f->buf.size() - off)
+					break;
+				cap->skipped += f->buf.size() - off;
+				off = f->buf.size();
+				break;
+			}
+			replay_append(cap, &f->buf[off], mlen);
+			off += mlen;
+		}
+		f->buf.erase(f->buf.begin(), f->buf.begin() + off);
+	} else if (proto == 132 && l4len >= 12) {
+		size_t off = 12;
+		while (off + 16 <= l4len) {
+			const uint8_t * c = l4 + off;
+			size_t clen = (c[2] << 8) | c[3];
+			if (clen < 4 || clen > l4len - off)
+				break;
+			/* DATA, first and last fragment, PPID 46 or unspecified */
+			if (c[0] == 0 && (c[1] & 3) == 3 && clen > 16 && (replay_be32(c + 12) == 46 || replay_be32(c + 12) == 0)
+					&& replay_diameter(c + 16, clen - 16) == clen - 16)
+				replay_append(cap, c + 16, clen - 16);
+			else if (c[0] == 0)
+				cap->skipped++;
+			off += (clen + 3) & ~(size_t)3;
+		}
+	}
+}
+
+/* pcap, microsecond or nanosecond, either byte order; Ethernet (VLAN tags too), Linux cooked or raw IP */
+static int replay_pcap(struct replay_capture * cap)
+{
+	const uint8_t * p = cap->map;
+	uint32_t magic, link;
+	int swap;
+	size_t off = 24;
+	std::vector<struct replay_flow> flows;
+
+	memcpy(&magic, p, 4);
+	swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+	memcpy(&link, p + 20, 4);
+	if (swap)
+		link = __builtin_bswap32(link);
+	if (link != 1 && link != 113 && link != 101 && link != 228 && link != 229)
+		return ENOTSUP;
+
+	while (off + 16 <= cap->size) {
+		uint32_t incl;
+		const uint8_t * frame;
+		size_t l3;
+		uint16_t type;
+
+		memcpy(&incl, p + off + 8, 4);
+		if (swap)
+			incl = __builtin_bswap32(incl);
+		off += 16;
+		if (incl > cap->size - off)
+			break;
+		frame = p + off;
+		off += incl;
+		switch (link) {
+		case 1:
+			for (l3 = 14; ; l3 += 4) {
+				if (incl < l3)
+					break;
+				type = (frame[l3 - 2] << 8) | frame[l3 - 1];
+				if (type != 0x8100 && type != 0x88a8)
+					break;
+			}
+			if (incl >= l3 && (type == 0x0800 || type == 0x86dd))
+				replay_packet(cap, flows, frame + l3, incl - l3);
+			break;
+		case 113:
+			if (incl >= 16)
+				replay_packet(cap, flows, frame + 16, incl - 16);
+			break;
+		default:
+			replay_packet(cap, flows, frame, incl);
+			break;
+		}
+	}
+
+	/* the messages were copied one after the other */
+	size_t pos = 0;
+	for (size_t i = 0; i < cap->msgs.size(); i++) {
+		cap->msgs[i].data = &cap->copy[pos];
+		pos += cap->msgs[i].len;
+	}
+	return 0;
+}
+
+static int replay_open(struct replay_capture * cap, const char * path)
+{
+	struct stat st;
+	uint32_t magic = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return errno;
+	if (fstat(fd, &st) < 0 || st.st_size < 20) {
+		close(fd);
+		return EINVAL;
+	}
+	cap->size = st.st_size;
+	cap->map = (uint8_t *)mmap(NULL, cap->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (cap->map == MAP_FAILED)
+		return errno;
+
+	memcpy(&magic, cap->map, 4);
+	if (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1) {
+		cap->format = "pcap";
+		if (cap->size < 24)
+			return EINVAL;
+		return replay_pcap(cap);
+	}
+	cap->format = "raw";
+	replay_index(cap, cap->map, cap->size);
+	return 0;
+}
+
+/* Threads of a phase start together, once attached to the extensions */
+struct replay_barrier {
+	std::mutex		lock;
+	std::condition_variable	cond;
+	unsigned		waiting;
+	uint64_t		start;
+
+	void wait(unsigned count)
+	{
+		std::unique_lock<std::mutex> l(lock);
+		if (++waiting == count) {
+			start = replay_now_ns();
+			cond.notify_all();
+		} else {
+			cond.wait(l, [this, count] { return waiting >= count; });
+		}
+	}
+};
+
+static void replay_worker(const struct replay_capture * cap, unsigned tid, unsigned passes, int measured,
+				struct replay_barrier * barrier, struct replay_thread * out)
+{
+	double interval = replay_rate > 0 ? replay_nthreads * 1e9 / replay_rate : 0;
+	unsigned long seq = 0;
+	std::vector<uint8_t> buf;
+	uint32_t max = 0;
+
+	/* sized before the counting starts */
+	for (size_t k = tid; k < cap->msgs.size(); k += replay_nthreads)
+		max = std::max(max, cap->msgs[k].len);
+	buf.resize(max ?: 1);
+
+	if (!replay_cpus.empty()) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(replay_cpus[tid % replay_cpus.size()], &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	memset(out, 0, sizeof(*out));
+	fd_ext_thread_attach();
+	barrier->wait(replay_nthreads);
+
+	replay_counting = measured;
+	replay_mallocs = 0;
+	for (unsigned pass = 0; pass < passes; pass++) {
+		for (size_t k = tid; k < cap->msgs.size(); k += replay_nthreads, seq++) {
+			struct fd_ext_msg msg;
+			uint64_t t0, t1;
+			int verdict;
+
+			if (interval) {
+				uint64_t due = barrier->start + (uint64_t)((seq + (double)tid / replay_nthreads) * interval);
+				uint64_t now = replay_now_ns();
+				if (due > now + 100000) {
+					struct timespec ts = { (time_t)((due - 50000) / 1000000000ULL), (long)((due - 50000) % 1000000000ULL) };
+					clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+				}
+				while (replay_now_ns() < due)
+					;
+			}
+			memset(&msg, 0, sizeof(msg));
+			memcpy(&buf[0], cap->msgs[k].data, cap->msgs[k].len);
+			fd_ext_msg_parse(&msg, &buf[0], cap->msgs[k].len);
+			t0 = replay_now_ns();
+			verdict = fd_ext_hook_dispatch(FD_EXT_HOOK_MSG_RECEIVED, &msg);
+			t1 = replay_now_ns();
+			fd_ext_msg_release(&msg);
+
+			out->msgs++;
+			out->verdicts[verdict >= 0 && verdict < 5 ? verdict : 0]++;
+			out->hist[replay_bucket(t1 - t0)]++;
+			if (t1 - t0 > out->max_ns)
+				out->max_ns = t1 - t0;
+		}
+	}
+	replay_counting = 0;
+	out->mallocs = replay_mallocs;
+	fd_ext_thread_detach();
+}
+
+/* One phase: the threads are created for it, so that their counters are folded into the statistics when they exit */
+static double replay_phase(const struct replay_capture * cap, unsigned passes, int measured, std::vector<struct replay_thread> & res)
+{
+	std::vector<std::thread> threads;
+	struct replay_barrier barrier;
+
+	barrier.waiting = 0;
+	barrier.start = 0;
+	res.assign(replay_nthreads, replay_thread());
+	for (unsigned t = 0; t < replay_nthreads; t++)
+		threads.push_back(std::thread(replay_worker, cap, t, passes, measured, &barrier, &res[t]));
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+	return (replay_now_ns() - barrier.start) / 1e9;
+}
+
+/* The names of ExtensionList, in <home>/cfg/extensions.cfg */
+static void replay_names(const std::string & home, std::vector<struct replay_ext> & exts)
+{
+	FILE * f = fopen((home + "cfg/extensions.cfg").c_str(), "r");
+	char line[4096];
+
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		char * p = line + strspn(line, " \t");
+		if (strncasecmp(p, "ExtensionList", 13))
+			continue;
+		p = strchr(p, '=');
+		while (p && *p) {
+			size_t n;
+			p++;
+			p += strspn(p, " \t");
+			n = strcspn(p, ", \t\r\n");
+			if (n) {
+				struct replay_ext e;
+				e.name.assign(p, n);
+				exts.push_back(e);
+			}
+			p = strchr(p, ',');
+		}
+	}
+	fclose(f);
+}
+
+static int replay_run(FILE * out, const struct replay_capture * cap, std::string home, unsigned run, int first)
+{
+	std::vector<struct replay_thread> res;
+	std::vector<struct replay_ext> exts;
+	struct replay_thread all;
+	double seconds;
+	int ret;
+
+	if (home.empty() || home[home.size() - 1] != '/')
+		home += '/';
+	if (fd_ext_initialize(&home[0]) != RTN_SUCCESS) {
+		fprintf(stderr, "fd_ext_initialize failed for %s\n", home.c_str());
+		return 1;
+	}
+	ret = fd_ext_load();
+	if (ret != 0) {
+		fprintf(stderr, "fd_ext_load failed for %s: %s\n", home.c_str(), strerror(ret));
+		fd_ext_term();
+		return 1;
+	}
+	replay_names(home, exts);
+
+	if (replay_warmup)
+		replay_phase(cap, replay_warmup, 0, res);
+	for (size_t i = 0; i < exts.size(); i++)
+		memset(&exts[i].before, 0, sizeof(exts[i].before)), fd_ext_stats_get(exts[i].name.c_str(), &exts[i].before);
+	seconds = replay_phase(cap, replay_loops, 1, res);
+	for (size_t i = 0; i < exts.size(); i++)
+		memset(&exts[i].after, 0, sizeof(exts[i].after)), fd_ext_stats_get(exts[i].name.c_str(), &exts[i].after);
+	fd_ext_term();
+
+	memset(&all, 0, sizeof(all));
+	for (size_t t = 0; t < res.size(); t++) {
+		all.msgs += res[t].msgs;
+		all.mallocs += res[t].mallocs;
+		for (int v = 0; v < 5; v++)
+			all.verdicts[v] += res[t].verdicts[v];
+		for (unsigned b = 0; b < REPLAY_BUCKETS; b++)
+			all.hist[b] += res[t].hist[b];
+		if (res[t].max_ns > all.max_ns)
+			all.max_ns = res[t].max_ns;
+	}
+
+	fprintf(out, "%s\n\t\t{ \"home\": \"%s\", \"run\": %u, \"msgs\": %lu, \"seconds\": %.6f, \"msgs_per_s\": %.1f,\n", first ? "" : ",",
+		home.c_str(), run, all.msgs, seconds, seconds > 0 ? all.msgs / seconds : 0);
+	fprintf(out, "\t\t  \"dispatch_ns\": { \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %llu },\n",
+		replay_quantile(all.hist, all.msgs, 0.5), replay_quantile(all.hist, all.msgs, 0.9),
+		replay_quantile(all.hist, all.msgs, 0.99), replay_quantile(all.hist, all.msgs, 0.999), (unsigned long long)all.max_ns);
+	fprintf(out, "\t\t  \"verdicts\": { \"continue\": %lu, \"handled\": %lu, \"drop\": %lu, \"pending\": %lu, \"unavailable\": %lu },\n",
+		all.verdicts[FD_EXT_HOOK_CONTINUE], all.verdicts[FD_EXT_HOOK_HANDLED], all.verdicts[FD_EXT_HOOK_DROP],
+		all.verdicts[FD_EXT_HOOK_PENDING], all.verdicts[FD_EXT_HOOK_UNAVAILABLE]);
+	fprintf(out, "\t\t  \"mallocs_per_msg\": %.3f,\n\t\t  \"extensions\": [", all.msgs ? (double)all.mallocs / all.msgs : 0);
+	for (size_t i = 0; i < exts.size(); i++) {
+		const struct fd_ext_stats * b = &exts[i].before, * a = &exts[i].after;
+		uint64_t calls = a->calls - b->calls;
+		fprintf(out, "%s\n\t\t\t{ \"name\": \"%s\", \"calls\": %llu, \"avg_ns\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+			"\"allocs_per_msg\": %.3f }", i ? "," : "", exts[i].name.c_str(), (unsigned long long)calls,
+			calls ? (double)(a->call_ns - b->call_ns) / calls : 0,
+			(unsigned long long)replay_ext_quantile(b, a, 0.5), (unsigned long long)replay_ext_quantile(b, a, 0.99),
+			(unsigned long long)replay_ext_quantile(b, a, 0.999),
+			all.msgs ? (double)(a->mem_allocs - b->mem_allocs) / all.msgs : 0);
+	}
+	fprintf(out, "\n\t\t  ] }");
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-c cpu,...] [-r rate] [-l loops] [-w warmup] [-n runs] [-o result.json] <capture> <home> [<home>...]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct replay_capture cap;
+	unsigned runs = 1;
+	const char *output = NULL;
+	FILE *out = stdout;
+	int opt, ret, first = 1;
+
+	while ((opt = getopt(argc, argv, "t:c:r:l:w:n:o:")) != -1) {
+		switch (opt) {
+		case 't': replay_nthreads = strtoul(optarg, NULL, 10); break;
+		case 'c':
+			for (char *p = optarg; *p; p += *p == ',') {
+				char *end;
+				replay_cpus.push_back(strtol(p, &end, 10));
+				if (end == p)
+					usage(argv[0]);
+				p = end;
+			}
+			break;
+		case 'r': replay_rate = strtod(optarg, NULL); break;
+		case 'l': replay_loops = strtoul(optarg, NULL, 10); break;
+		case 'w': replay_warmup = strtoul(optarg, NULL, 10); break;
+		case 'n': runs = strtoul(optarg, NULL, 10); break;
+		case 'o': output = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2 || replay_loops == 0 || runs == 0)
+		usage(argv[0]);
+
+	/* a thread per CPU given, else on the first CPUs of the process */
+	if (replay_cpus.empty()) {
+		cpu_set_t set;
+		unsigned n = replay_nthreads ?: 1;
+		if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+			for (int c = 0; c < CPU_SETSIZE && replay_cpus.size() < n; c++) {
+				if (CPU_ISSET(c, &set))
+					replay_cpus.push_back(c);
+			}
+		}
+	}
+	if (replay_nthreads == 0)
+		replay_nthreads = replay_cpus.empty() ? 1 : replay_cpus.size();
+
+	cap.format = NULL;
+	cap.map = NULL;
+	cap.skipped = 0;
+	ret = replay_open(&cap, argv[optind]);
+	if (ret != 0 || cap.msgs.empty()) {
+		fprintf(stderr, "%s: %s\n", argv[optind], ret ? strerror(ret) : "no Diameter message");
+		return 1;
+	}
+
+	if (output && (out = fopen(output, "w")) == NULL) {
+		perror(output);
+		return 1;
+	}
+	fprintf(out, "{\n\t\"capture\": { \"path\": \"%s\", \"format\": \"%s\", \"messages\": %zu, \"skipped\": %lu },\n",
+		argv[optind], cap.format, cap.msgs.size(), cap.skipped);
+	fprintf(out, "\t\"threads\": %u,\n\t\"cpus\": [", replay_nthreads);
+	for (size_t i = 0; i < replay_cpus.size() && i < replay_nthreads; i++)
+		fprintf(out, "%s%d", i ? ", " : "", replay_cpus[i]);
+	fprintf(out, "],\n\t\"rate\": %.1f,\n\t\"warmup\": %u,\n\t\"loops\": %u,\n\t\"runs\": [", replay_rate, replay_warmup, replay_loops);
+	for (unsigned r = 0; r < runs && !ret; r++) {
+		for (int h = optind + 1; h < argc && !ret; h++, first = 0)
+			ret = replay_run(out, &cap, argv[h], r, first);
+	}
+	fprintf(out, "\n\t]\n}\n");
+	if (out != stdout)
+		fclose(out);
+
+	UNUSED(error_message);
+	UNUSED(avp_value_sizes);
+	return ret;
+}
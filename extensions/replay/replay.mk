@@ -0,0 +1,28 @@
+# replay of recorded Diameter traffic through the extensions, 'make fdreplay' from extensions/makefile;
+# built from the daemon sources like fdbench, it is installed as $(API_BIN)/fdreplay; record the
+# traffic with fd_ext_capture() in the daemon, or take a pcap, then, to compare two builds:
+#   fdreplay -t 4 -n 5 -o result.json capture.dia homeA/ homeB/
+
+REPLAYDIR = $(API_BIN)
+HOSTSRCDIR ?= $(VOB_ROOT)/mboss_ts/dra/source
+# libraries the daemon sources need (cch_port, ...)
+REPLAY_LIBS ?= $(BENCH_LIBS)
+
+REPLAY_INCLUDES = \
+	-I$(SRCDIR)/../server_tech_api/diameter_api/diameter_common_api/include \
+	$(EXT_INCLUDES)
+# the daemon side is built with the default visibility, it exports what extension.exports lists
+REPLAY_CPOPTS = $(filter-out -fvisibility%,$(EXT_CPOPTS))
+REPLAY_HOSTSRC = $(wildcard $(HOSTSRCDIR)/extension*.cpp) $(HOSTSRCDIR)/dict.cpp
+
+.PHONY: fdreplay cleanreplay
+
+fdreplay: $(REPLAYDIR)/fdreplay
+
+$(REPLAYDIR)/fdreplay: $(SRCDIR)/replay/fdreplay.cpp $(REPLAY_HOSTSRC)
+	$(MKDIR) $(REPLAYDIR)
+	$(CXX) $(REPLAY_CPOPTS) $(APP_OPT) $(REPLAY_INCLUDES) -I$(HOSTSRCDIR) \
+		-Wl,--dynamic-list=$(HOSTSRCDIR)/extension.exports -pthread -o $@ $^ $(REPLAY_LIBS) -ldl
+
+cleanreplay:
+	-$(RM) $(REPLAYDIR)/fdreplay
@@ -7,7 +7,7 @@
 extern "C" {
 #endif
 
-void addavp(void *args);
+void addavp(struct fd_ext_arg *arg);
 
 #ifdef __cplusplus
 }
@@ -36,8 +36,8 @@
 #include <stdio.h>
 #include "sample.h"
 
-/* The function MUST be called this */
-void fd_ext_fini(void)
+/* The function MUST be called this, and exported */
+FD_EXT_EXPORT void fd_ext_fini(void)
 {
 	/* This code is executed when the daemon is exiting; cleanup management should be placed here */
 	printf("Extension is terminated... Bye!\n");
@@ -36,19 +36,26 @@
 /* Sample file demonstrating how to write some C++ code */
 
 #include <iostream>
+/* the dictionary is the daemon's one, its declarations must not be hidden like those of the extension */
+#pragma GCC visibility push(default)
 #include "dict.h"
+#pragma GCC visibility pop
+#include "sample.h"
 
-extern "C" void addavp(void *args) {
+extern "C" void addavp(struct fd_ext_arg *arg) {
 	UNUSED(error_message);
 	UNUSED(avp_value_sizes);
 	/*
-	 * symbols of extension and main procedure belong to different code segment;
-	 * therefore the global pointer of main procedure need to be passed in,
-	 * intead of access through class static member;
+	 * the dictionary code is not linked into the extension, its symbols are resolved
+	 * in the daemon (see extension.exports); the pointer passed in is the same
+	 * instance as dictionary::getInstance();
 	 */
-	dictionary *pDictionary = static_cast<dictionary*>(args);
-	printf("Let's create that 'Example-AVP'...\n");
-	{
+	dictionary *pDictionary = static_cast<dictionary*>(arg->dict);
+	/* Objects created through dict_new are restored from the daemon's snapshot on the next start */
+	if (arg->warm_start) {
+		printf("'Example-AVP' restored from the snapshot\n");
+	} else {
+		printf("Let's create that 'Example-AVP'...\n");
 		struct dict_object * origin_host_avp = NULL;
 		struct dict_object * session_id_avp = NULL;
 		struct dict_object * example_avp_avp = NULL;
@@ -58,20 +65,20 @@ extern "C" void addavp(void *args) {
 		pDictionary->fd_dict_search (DICT_AVP, AVP_BY_NAME, "Origin-Host", &origin_host_avp, ENOENT);
 		pDictionary->fd_dict_search (DICT_AVP, AVP_BY_NAME, "Session-Id", &session_id_avp, ENOENT);
 
-		pDictionary->fd_dict_new ( DICT_AVP, &example_avp_data , NULL, &example_avp_avp );
+		arg->dict_cache->dict_new ( arg, DICT_AVP, &example_avp_data , NULL, &example_avp_avp );
 
 		rule_data.rule_avp = origin_host_avp;
 		rule_data.rule_min = 1;
 		rule_data.rule_max = 1;
-		pDictionary->fd_dict_new ( DICT_RULE, &rule_data, example_avp_avp, NULL );
+		arg->dict_cache->dict_new ( arg, DICT_RULE, &rule_data, example_avp_avp, NULL );
 
 		rule_data.rule_avp = session_id_avp;
 		rule_data.rule_min = 1;
 		rule_data.rule_max = -1;
-		pDictionary->fd_dict_new ( DICT_RULE, &rule_data, example_avp_avp, NULL );
+		arg->dict_cache->dict_new ( arg, DICT_RULE, &rule_data, example_avp_avp, NULL );
 
+		printf("'Example-AVP' created without error\n");
 	}
-	printf("'Example-AVP' created without error\n");
 	struct dict_object *ext = NULL;
 	pDictionary->fd_dict_search( DICT_AVP, AVP_BY_NAME, (char*)"Example-AVP", &ext, ENOENT);
 	printf("dict: %p, Example-AVP: %p\n", pDictionary, ext);
@@ -37,9 +37,30 @@
 #include "sample.h"
 
 static int sample_main(struct fd_ext_arg *arg);
+static int sample_hook(enum fd_ext_hook_point point, struct fd_ext_msg *msg, void *regdata, void *ctx);
+static void sample_reconf(struct fd_ext_arg *arg, const struct fd_ext_cfg_change *changes, unsigned count, void *data);
+static void sample_tick(void *data);
+static void sample_count(void *state, int created, void *data);
+
+/* State of a thread, kept in its slot; it fits in FD_EXT_THREAD_SLOT */
+struct sample_thread {
+	unsigned long received;
+};
+
+/* Dictionary objects used on the messages path, resolved by the daemon */
+enum { SAMPLE_SESSION_ID, SAMPLE_ORIGIN_HOST, SAMPLE_EXAMPLE_AVP };
+static const struct fd_ext_dict_decl sample_dict[] = {
+	{ FD_EXT_DICT_AVP, "Session-Id" },
+	{ FD_EXT_DICT_AVP, "Origin-Host" },
+	{ FD_EXT_DICT_AVP, "Example-AVP" }
+};
+static struct fd_ext_dict_cache *sample_objs;
+static struct fd_ext_arg *sample_arg;
 
 /* Define the entry point. A convenience macro is provided */
 EXTENSION_ENTRY("sample", sample_main);
+/* The services of the daemon it uses, checked before it is loaded */
+FD_EXT_SERVICES("hooks", "config", "thread", "timer", "session");
 
 /* The extension-specific initialization code */
 static int sample_main(struct fd_ext_arg *arg)
@@ -51,18 +72,98 @@ static int sample_main(struct fd_ext_arg *arg)
 	/* This is how we access daemon's global vars */
 	fprintf(stdout, "I am extension %s.", __FILE__);
 
-	/* The configuration file name is received in the conffile var. It's up to extension to parse it */
+	/* The configuration file name is received in the conffile var, the daemon parses it for us */
 	if (conffile) {
-		fprintf(stdout, "I should parse my configuration file there: %s\n", conffile);
+		struct fd_ext_cfg_view greeting;
+		if (arg->config->cfg_get(arg, "sample", "Greeting", &greeting) == 0)
+			fprintf(stdout, "%.*s\n", (int)greeting.len, greeting.ptr);
+		/* and tells when it changes */
+		arg->config->cfg_watch(arg, sample_reconf, NULL);
 	} else {
 		fprintf(stdout, "I received no configuration file to parse\n");
 	}
 
 	/* Call the c++ function */
-	addavp(arg->dict);
+	addavp(arg);
+
+	/* From now on, FD_EXT_DICT(sample_objs, SAMPLE_SESSION_ID) replaces fd_dict_search(..., "Session-Id", ...) */
+	arg->dict_cache->dict_declare(arg, sample_dict, sizeof(sample_dict) / sizeof(sample_dict[0]), &sample_objs);
+
+	/* The memory used on the messages path comes from the daemon, and is accounted to this extension */
+	sample_arg = arg;
+
+	/* Hooks are called on the messages path, here for every message received; they are removed after fd_ext_fini */
+	arg->hooks->hook_register(arg, FD_EXT_HOOK_MSG_RECEIVED, FD_EXT_ANY, FD_EXT_ANY, 0, sample_hook, NULL, NULL);
+
+	/* Periodic work runs on a thread of the daemon, no need to start one; it is cancelled before fd_ext_fini */
+	arg->timers->timer_start(arg, 60000, 60000, sample_tick, NULL, NULL);
 
 	/* The initialization function returns an error code with the standard POSIX meaning (ENOMEM, and so on) */
 	return 0;
 }
 
+/* Called for each message received, must not block */
+static int sample_hook(enum fd_ext_hook_point point, struct fd_ext_msg *msg, void *regdata, void *ctx)
+{
+	struct sample_thread *thr = ctx;
+	struct fd_ext_cfg_view sid;
+	uint32_t *ids;
+
+	/* Statistics of the thread, no lock and no shared cache line */
+	if (thr)
+		thr->received++;
+
+	/* State per session, in the store of the daemon: messages of the session, forgotten 5 minutes after the last one */
+	if (sample_arg->sessions->sess_id(msg, &sid) == 0)
+		sample_arg->sessions->sess_update(sample_arg, sid.ptr, sid.len, sizeof(unsigned long), 300000, sample_count, NULL);
+
+	/* Freed with the message, no need to track it */
+	ids = sample_arg->alloc->msg_alloc(sample_arg, msg, 2 * sizeof(uint32_t));
+	if (ids) {
+		ids[0] = msg->hbh_id;
+		ids[1] = msg->e2e_id;
+	}
+	return FD_EXT_HOOK_CONTINUE;
+}
+
+/* Called when the configuration file is replaced, with the keys that changed only */
+static void sample_reconf(struct fd_ext_arg *arg, const struct fd_ext_cfg_change *changes, unsigned count, void *data)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+		fprintf(stdout, "[%.*s] %.*s: '%.*s' -> '%.*s'\n", (int)changes[i].section.len, changes[i].section.ptr,
+			(int)changes[i].key.len, changes[i].key.ptr, (int)changes[i].old.len, changes[i].old.ptr ? changes[i].old.ptr : "",
+			(int)changes[i].value.len, changes[i].value.ptr ? changes[i].value.ptr : "");
+}
+
+/* Called under the lock of the entry of the session */
+static void sample_count(void *state, int created, void *data)
+{
+	++*(unsigned long *)state;
+}
+
+/* Called every minute, must be short: longer work goes to arg->timers->defer */
+static void sample_tick(void *data)
+{
+	fprintf(stdout, "sample is running\n");
+}
+
+/* Called on each thread before its first message, the slot is zeroed */
+FD_EXT_EXPORT int fd_ext_thread_init(struct fd_ext_arg *arg, void *ctx)
+{
+	struct sample_thread *thr = ctx;
+
+	thr->received = 0;
+	return 0;
+}
+
+/* Called when the thread exits, or before fd_ext_fini */
+FD_EXT_EXPORT void fd_ext_thread_fini(struct fd_ext_arg *arg, void *ctx)
+{
+	struct sample_thread *thr = ctx;
+
+	fprintf(stdout, "Thread received %lu messages\n", thr->received);
+}
+
 /* See file fini.c for an example of destructor */